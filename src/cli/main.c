@@ -6,6 +6,7 @@
 #include "pipe/global.h"
 #include "pipe/modules/api.h"
 #include "core/log.h"
+#include "core/trace.h"
 #include "core/version.h"
 
 #include <stdlib.h>
@@ -20,6 +21,8 @@ int main(int argc, char *argv[])
   // init global things, log and pipeline:
   dt_log_init(s_log_cli);
   dt_log_init_arg(argc, argv);
+  dt_trace_init(dt_log_global.mask & s_log_trace);
+  dt_trace_thread_name("main");
   dt_pipe_global_init();
   threads_global_init();
 
@@ -111,6 +114,9 @@ int main(int argc, char *argv[])
 
   dt_graph_cleanup(&graph);
   threads_global_cleanup();
+  if(dt_trace_enabled() && !dt_trace_write(DT_TRACE_FILE))
+    dt_log(s_log_trace, "wrote " DT_TRACE_FILE);
+  dt_trace_cleanup();
   qvk_cleanup();
   exit(res);
 }
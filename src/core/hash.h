@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// 64-bit fnv-1a, to find out whether something changed. not cryptographic.
+// chain calls by passing the last result as hash, start with dt_hash_init.
+
+#define dt_hash_init 0xcbf29ce484222325ul
+
+static inline uint64_t
+dt_hash(uint64_t hash, const void *data, size_t bytes)
+{
+  const uint8_t *b = data;
+  for(size_t i=0;i<bytes;i++)
+  {
+    hash ^= b[i];
+    hash *= 0x100000001b3ul;
+  }
+  return hash;
+}
@@ -19,6 +19,7 @@ typedef enum dt_log_mask_t
   s_log_perf = 1<<6,
   s_log_mem  = 1<<7,
   s_log_err  = 1<<8,
+  s_log_trace= 1<<9,  // record events, written as chrome trace json on exit
   s_log_all  = -1ul,
 }
 dt_log_mask_t;
@@ -49,6 +50,7 @@ dt_log_init_arg(int argc, char *argv[])
     "perf",
     "mem",
     "err",
+    "trace",
     "all",
   };
   int num = sizeof(id)/sizeof(id[0]);
@@ -118,6 +120,7 @@ dt_log(
     "[perf]",
     "[mem]",
     "\e[31m[ERR]\e[0m",
+    "[trace]",
   };
 
   if(dt_log_global.mask & mask)
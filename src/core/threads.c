@@ -1,4 +1,6 @@
 #include "threads.h"
+#include "core.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,16 +37,35 @@ typedef struct threads_task_t
 {
   atomic_uint     work_item;     // work item counter (if not referring to another task)
   atomic_uint     done;          // counting how many tasks are *done* (not just *picked*), to coordinate cleanup.
+  atomic_int      refs;          // tasks referring to us plus ourselves, recycle when this drops to zero
   uint32_t        work_item_cnt; // global number of work items. externally set to 0 if abortion is triggered.
   uint32_t        tid;           // id of thread working on this task, or -1u if not assigned yet
-  int32_t         reftask;       // use the atomics of this task (can be us)
+  int32_t         reftask;       // use the atomics of this task slot (can be us)
+  uint32_t        gen;           // incremented whenever the slot is reused, part of the task id
   threads_run_t   run;           // work function
   void           *data;          // user data to be passed to run function
   threads_free_t  free;          // optionally clean up user data
+  int32_t         free_head;     // tasks waiting for our last item to run their free, protected by mutex_done
+  int32_t         free_next;     // next in the free_head list of the task we refer to
+  threads_priority_t prio;       // priority class, decides which deque we're queued in
+  threads_token_t *token;        // optional cancellation token
+  uint32_t        token_gen;     // generation of the token when the task was pushed
   char            desc[30];      // description for debugging
 }
 threads_task_t;
 
+// double ended queue of task ids. the owning worker pushes and pops at the
+// back, idle workers steal from the front. tasks are coarse (one per thread
+// working on a job), so a mutex is cheap enough here.
+typedef struct threads_deque_t
+{
+  pthread_mutex_t mutex;
+  uint32_t       *task;  // ring buffer of task ids, task_max entries
+  uint32_t        beg;   // front, where others steal
+  uint32_t        cnt;   // number of tasks queued
+}
+threads_deque_t;
+
 typedef struct threads_t
 {
   uint32_t        num_threads;
@@ -55,7 +76,13 @@ typedef struct threads_t
   uint32_t       *cpuid;
   // pool of tasks
   uint32_t        task_max;
+  uint32_t        gen_max;       // task ids are gen * task_max + slot, need to fit an int
   threads_task_t *task;
+  // one deque of runnable tasks per worker and priority class
+  threads_deque_t *deque;
+  atomic_uint     next_deque;    // round robin for tasks pushed from outside the pool
+  atomic_uint     next_slot;     // where to start looking for a free task slot
+  atomic_int      pending[s_threads_prio_cnt]; // number of queued tasks per priority, incremented under mutex_push
   pthread_cond_t  cond_task_done;
   pthread_cond_t  cond_task_push;
   pthread_mutex_t mutex_done;
@@ -63,6 +90,221 @@ typedef struct threads_t
 }
 threads_t;
 
+static void
+threads_deque_push(threads_deque_t *d, uint32_t taskid)
+{
+  pthread_mutex_lock(&d->mutex);
+  d->task[(d->beg + d->cnt++) % thr.task_max] = taskid;
+  pthread_mutex_unlock(&d->mutex);
+}
+
+static int // returns -1 if empty
+threads_deque_pop_back(threads_deque_t *d)
+{
+  int taskid = -1;
+  pthread_mutex_lock(&d->mutex);
+  if(d->cnt) taskid = d->task[(d->beg + --d->cnt) % thr.task_max];
+  pthread_mutex_unlock(&d->mutex);
+  return taskid;
+}
+
+static int // returns -1 if empty
+threads_deque_pop_front(threads_deque_t *d)
+{
+  int taskid = -1;
+  pthread_mutex_lock(&d->mutex);
+  if(d->cnt)
+  {
+    taskid = d->task[d->beg];
+    d->beg = (d->beg + 1) % thr.task_max;
+    d->cnt--;
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return taskid;
+}
+
+static inline threads_deque_t *
+threads_deque(uint32_t tid, threads_priority_t prio)
+{
+  return thr.deque + s_threads_prio_cnt*tid + prio;
+}
+
+static int
+threads_pending()
+{
+  int cnt = 0;
+  for(int p=0;p<s_threads_prio_cnt;p++) cnt += thr.pending[p];
+  return cnt;
+}
+
+// queue the task and wake up one thread. workers push to their own deque,
+// others spread the tasks round robin. idle workers will steal if the
+// distribution turns out uneven.
+static void
+threads_task_queue(uint32_t taskid)
+{
+  const threads_priority_t prio = thr.task[taskid].prio;
+  const uint32_t q = thr_tls.worker ? thr_tls.tid : thr.next_deque++ % thr.num_threads;
+  threads_deque_push(threads_deque(q, prio), taskid);
+  // the pending count makes sure nobody goes to sleep while there is still work queued.
+  pthread_mutex_lock(&thr.mutex_push);
+  thr.pending[prio]++;
+  pthread_cond_signal(&thr.cond_task_push);
+  pthread_mutex_unlock(&thr.mutex_push);
+}
+
+// find a task to run of priority class prio_max or more important, highest
+// priority first: our own newest task (it's hot in cache), then steal the
+// oldest task of somebody else. returns -1 if there is nothing queued.
+static int
+threads_pop_task(threads_priority_t prio_max)
+{
+  const uint32_t tid = thr_tls.tid;
+  int taskid = -1;
+  for(int p=0;taskid < 0 && p<=prio_max;p++)
+  {
+    if(thr_tls.worker) taskid = threads_deque_pop_back(threads_deque(tid, p));
+    for(int k=thr_tls.worker;taskid < 0 && k<thr.num_threads;k++)
+      taskid = threads_deque_pop_front(threads_deque((tid + k) % thr.num_threads, p));
+  }
+  if(taskid >= 0) thr.pending[thr.task[taskid].prio]--;
+  return taskid;
+}
+
+// same as above for any priority, blocks until there is work.
+static int
+threads_next_task()
+{
+  while(!thr.shutdown)
+  {
+    int taskid = threads_pop_task(s_threads_prio_cnt-1);
+    if(taskid >= 0) return taskid;
+    pthread_mutex_lock(&thr.mutex_push);
+    while(threads_pending() <= 0 && !thr.shutdown) // may be -1 briefly while a push is in flight
+      pthread_cond_wait(&thr.cond_task_push, &thr.mutex_push);
+    pthread_mutex_unlock(&thr.mutex_push);
+  }
+  return -1;
+}
+
+// is there queued work of higher priority than the given class?
+static inline int
+threads_preempt(threads_priority_t prio)
+{
+  for(int p=0;p<prio;p++) if(thr.pending[p] > 0) return 1;
+  return 0;
+}
+
+static inline int
+threads_task_cancelled(const threads_task_t *task)
+{
+  return task->token && threads_cancelled(task->token, task->token_gen);
+}
+
+static void
+threads_task_release(threads_task_t *task)
+{ // the last one out recycles the task slot
+  if(--task->refs == 0)
+    __atomic_store_n(&task->tid, s_task_state_recycle, __ATOMIC_RELEASE);
+}
+
+// take a reference on the task with the given id. returns zero if the task
+// slot has been recycled already, and maybe been reused by some other task.
+static threads_task_t *
+threads_task_ref(int taskid)
+{
+  if(taskid < 0) return 0;
+  threads_task_t *task = thr.task + taskid % thr.task_max;
+  int refs = task->refs;
+  while(refs > 0)
+    if(atomic_compare_exchange_weak(&task->refs, &refs, refs+1)) break;
+  if(refs <= 0) return 0;
+  if(task->gen == taskid / thr.task_max) return task; // can't change while we hold a reference
+  threads_task_release(task); // somebody else's now
+  return 0;
+}
+
+static inline int
+threads_task_id(const threads_task_t *task)
+{
+  return task->gen * thr.task_max + (task - thr.task);
+}
+
+static void threads_task_finish(int taskid);
+
+// run one work item of the task, or skip it if the task has been cancelled.
+// whoever finishes the last item runs the free callbacks of the tasks which
+// ran out of items before.
+static inline void
+threads_task_item(threads_task_t *task, threads_task_t *ref, uint32_t item)
+{
+  if(!threads_task_cancelled(task))
+  {
+    const uint64_t beg = dt_trace_enabled() ? dt_trace_now() : 0;
+    task->run(item, task->data);
+    if(beg) dt_trace_event(dt_token("task"), dt_token(task->desc), beg, dt_trace_now(), 0);
+  }
+  if(++ref->done == task->work_item_cnt)
+  { // wake up everybody waiting for this task
+    pthread_mutex_lock(&thr.mutex_done);
+    int32_t t = ref->free_head;
+    ref->free_head = -1;
+    pthread_cond_broadcast(&thr.cond_task_done);
+    pthread_mutex_unlock(&thr.mutex_done);
+    while(t >= 0)
+    { // these hold references to ref, which stays valid for our caller
+      const int32_t next = thr.task[t].free_next;
+      thr.task[t].free(thr.task[t].data);
+      threads_task_finish(t);
+      t = next;
+    }
+  }
+}
+
+// run the items of this task, or only one if single is set. returns 1 on
+// shutdown and 2 if the task has been queued again, to make room for more
+// important work or because of single. returns 3 if others are still working
+// on items: the last of them runs our free callback and finishes the task.
+// otherwise the caller needs to threads_task_finish() after 0.
+static int
+threads_task_run(threads_task_t *task, int single)
+{
+  threads_task_t *ref = thr.task + task->reftask;
+  for(int i=0;;i++)
+  { // work on this task
+    if((threads_preempt(task->prio) || (single && i)) && ref->work_item < task->work_item_cnt)
+    { // go do the other thing first, continue with the next item later
+      threads_task_queue(task - thr.task);
+      return 2;
+    }
+    uint32_t item = ref->work_item++;
+    if(item >= task->work_item_cnt) break;
+    threads_task_item(task, ref, item);
+    if(thr.shutdown) return 1;
+  }
+  if(task->free)
+  { // only run cleanup once all items are done
+    pthread_mutex_lock(&thr.mutex_done);
+    const int defer = ref->done < task->work_item_cnt;
+    if(defer)
+    {
+      task->free_next = ref->free_head;
+      ref->free_head  = task - thr.task;
+    }
+    pthread_mutex_unlock(&thr.mutex_done);
+    if(defer) return 3;
+    task->free(task->data);
+  }
+  return 0;
+}
+
+static void
+threads_task_finish(int taskid)
+{ // mark task as recyclable, after everybody referring to it is done:
+  threads_task_t *task = thr.task + taskid;
+  if(task->reftask != taskid) threads_task_release(thr.task + task->reftask);
+  threads_task_release(task);
+}
 
 // thread worker function
 void *threads_work(void *arg)
@@ -70,6 +312,10 @@ void *threads_work(void *arg)
   // global init: set tls storage thread id
   const uint64_t tid = (uint64_t)arg;
   thr_tls.tid = tid;
+  thr_tls.worker = 1;
+  char name[32];
+  snprintf(name, sizeof(name), "worker %d", (int)tid);
+  dt_trace_thread_name(name);
 #ifdef __linux__
   // pin ourselves to a cpu:
   cpu_set_t set;
@@ -80,47 +326,16 @@ void *threads_work(void *arg)
 
   while(1)
   {
-    pthread_mutex_lock(&thr.mutex_push);
-    pthread_cond_wait(&thr.cond_task_push, &thr.mutex_push);
-    pthread_mutex_unlock(&thr.mutex_push);
-    if(thr.shutdown) break;
-    threads_task_t *task = 0;
-    for(int k=0;k<thr.task_max;k++)
-    { // brute force search for task
-      task = thr.task + k;
-      uint32_t oldval = __sync_val_compare_and_swap(&task->tid, s_task_state_ready, tid);
-      if(oldval == s_task_state_ready) break;
-      else task = 0;
-    }
-    if(task == 0) continue; // wait for a bit more
-    while(1)
-    { // work on this task
-      uint32_t item = thr.task[task->reftask].work_item++;
-      if(item >= task->work_item_cnt) break;
-      task->run(item, task->data);
-      thr.task[task->reftask].done++;
-      if(thr.shutdown) break;
-    }
-    if(thr.shutdown) break; // don't recycle task. in fact don't clean up and leak whatever we still have (better than lockup)
-    if(task->free)
-    { // only run cleanup once all tasks are finished:
-      // if we knew how many threads are working on this, we could test
-      // the every-increasing work_item for > work_item_cnt + num_threads
-      // and avoid the done pointer.
-      while(!thr.shutdown && (thr.task[task->reftask].done < task->work_item_cnt)) sched_yield();
-      if(thr.shutdown) break; // don't clean up, we didn't wait for everybody!
-      task->free(task->data);
-    }
-    // signal everybody that we're done with the task
-    pthread_mutex_lock(&thr.mutex_done);
-    pthread_cond_broadcast(&thr.cond_task_done);
-    pthread_mutex_unlock(&thr.mutex_done);
-    // mark task as recyclable:
-    uint32_t oldval = __sync_val_compare_and_swap(&task->tid, tid, s_task_state_recycle);
-    assert(oldval == tid); // this should never fail, people shall not mess with our task
-#ifdef NDEBUG
-    (void)oldval;
-#endif
+    int taskid = threads_next_task();
+    if(taskid < 0) break; // shutdown
+    threads_task_t *task = thr.task + taskid;
+    __atomic_store_n(&task->tid, tid, __ATOMIC_RELAXED);
+    // in case of shutdown, don't recycle task. in fact don't clean up and
+    // leak whatever we still have (better than lockup)
+    const int res = threads_task_run(task, 0);
+    if(res == 1) break;
+    if(res >= 2) continue; // preempted and queued again, or finished by somebody else
+    threads_task_finish(taskid);
   }
   return 0;
 }
@@ -134,6 +349,12 @@ void threads_global_cleanup()
   pthread_cond_destroy(&thr.cond_task_push);
   pthread_mutex_destroy(&thr.mutex_done);
   pthread_mutex_destroy(&thr.mutex_push);
+  for(int k=0;k<thr.num_threads*s_threads_prio_cnt;k++)
+  {
+    pthread_mutex_destroy(&thr.deque[k].mutex);
+    free(thr.deque[k].task);
+  }
+  free(thr.deque);
   free(thr.cpuid);
   free(thr.task);
   free(thr.worker);
@@ -159,45 +380,65 @@ threads_task_print_all()
     threads_task_print(t);
 }
 
-// push task
-// return:
-// -1 no more recyclable tasks, too many tasks running
-// -2 argument error, run function is zero or no work to be done cnt <= item
-// -3 invalid taskid
-// or >= 0: the new task id
-int threads_task(
-    const char *desc,
-    uint32_t    work_item_cnt,
-    int         taskid,
-    void       *data,
-    void      (*run)(uint32_t item, void *data),
-    void      (*free)(void*))
+// threads_task_prio(), optionally holding an extra reference to the task
+// that the caller needs to release.
+static int
+threads_task_push(
+    const char        *desc,
+    uint32_t           work_item_cnt,
+    int                taskid,
+    void              *data,
+    void             (*run)(uint32_t item, void *data),
+    void             (*free)(void*),
+    threads_priority_t prio,
+    threads_token_t   *token,
+    int                hold)
 {
-  if(taskid >= (int)thr.task_max) return -3;
+  if(prio >= s_threads_prio_cnt) return -2;
   if(run == 0 || work_item_cnt == 0) return -2;
-  if(taskid >= 0 && thr.task[taskid].work_item_cnt <= thr.task[taskid].work_item) return -2;
+  threads_task_t *ref = 0;
+  if(taskid >= 0)
+  { // keep the counters alive for us. no need to help if the task is done already
+    if(!(ref = threads_task_ref(taskid))) return -2;
+    if(ref->work_item_cnt <= ref->work_item)
+    {
+      threads_task_release(ref);
+      return -2;
+    }
+  }
   threads_task_t *task = 0;
+  // start searching where we left off, so slots are not reused right away.
+  // waiting on a task id that has been recycled and reused is bad news.
+  const uint32_t beg = thr.next_slot++;
   for(int k=0;k<thr.task_max;k++)
   { // brute force search for task
-    task = thr.task + k;
+    task = thr.task + (beg + k) % thr.task_max;
     uint32_t oldval = __sync_val_compare_and_swap(&task->tid, s_task_state_recycle, s_task_state_initing);
     if(oldval == s_task_state_recycle) break;
     else task = 0;
   }
   if(task == 0)
   {
+    if(ref) threads_task_release(ref);
     fprintf(stderr, "[threads] no more free tasks!\n");
     threads_task_print_all();
     return -1;
   }
   // set all required entries on task
+  const uint32_t id = task - thr.task;
   task->run  = run;
   task->free = free;
   task->data = data;
   task->work_item_cnt = work_item_cnt;
-  task->reftask = taskid >= 0 ? taskid : task - thr.task;
+  task->reftask = ref ? ref - thr.task : id;
+  task->gen = (task->gen + 1) % thr.gen_max;
   task->work_item = 0;
   task->done = 0;
+  task->free_head = -1;
+  task->prio = prio;
+  task->token = token;
+  task->token_gen = token ? threads_token_gen(token) : 0;
+  task->refs = 1 + hold; // last, others may take references from here on
   (void)snprintf(task->desc, sizeof(task->desc), "%s", desc);
 
   // mark as ready
@@ -206,29 +447,124 @@ int threads_task(
 #ifdef NDEBUG
   (void)oldval;
 #endif
-  // wake up one thread by signaling the condition
-  pthread_mutex_lock(&thr.mutex_push);
-  pthread_cond_signal(&thr.cond_task_push);
-  pthread_mutex_unlock(&thr.mutex_push);
-  return task->reftask; // return taskid of original job we're working on
+  // the task may be done and recycled as soon as it's queued
+  const int ret = ref ? taskid : threads_task_id(task); // return taskid of original job we're working on
+  threads_task_queue(id);
+  return ret;
 }
 
-void threads_wait(int taskid)
+int threads_task_prio(
+    const char        *desc,
+    uint32_t           work_item_cnt,
+    int                taskid,
+    void              *data,
+    void             (*run)(uint32_t item, void *data),
+    void             (*free)(void*),
+    threads_priority_t prio,
+    threads_token_t   *token)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return;
-  while(thr.task[taskid].done < thr.task[taskid].work_item_cnt)
-  {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += 1; // wait for one second max
-    // this is because the threads may finish in between us checking the condition
-    // and waiting on the condition (so the condition will not be triggered again)
+  return threads_task_push(desc, work_item_cnt, taskid, data, run, free, prio, token, 0);
+}
+
+int threads_task(
+    const char *desc,
+    uint32_t    work_item_cnt,
+    int         taskid,
+    void       *data,
+    void      (*run)(uint32_t item, void *data),
+    void      (*free)(void*))
+{
+  return threads_task_prio(desc, work_item_cnt, taskid, data, run, free, s_threads_prio_interactive, 0);
+}
+
+// wait for the task, the caller holds a reference to it
+static void
+threads_wait_task(threads_task_t *task)
+{
+  const uint32_t cnt = task->work_item_cnt;
+  while(!thr.shutdown && task->done < cnt)
+  { // instead of blocking a thread, help out with the items
+    uint32_t item = task->work_item++;
+    if(item < cnt)
+    {
+      threads_task_item(task, task, item);
+      continue;
+    }
+    // all items are being worked on. do one item of something else that is
+    // at least as important, but not more, so we don't get stuck in there.
+    int other = threads_pop_task(task->prio);
+    if(other >= 0)
+    {
+      if(!threads_task_run(thr.task + other, 1)) threads_task_finish(other);
+      continue;
+    }
     pthread_mutex_lock(&thr.mutex_done);
-    pthread_cond_timedwait(&thr.cond_task_done, &thr.mutex_done, &ts);
+    while(!thr.shutdown && task->done < cnt)
+      pthread_cond_wait(&thr.cond_task_done, &thr.mutex_done);
     pthread_mutex_unlock(&thr.mutex_done);
   }
 }
 
+void threads_wait(int taskid)
+{
+  threads_task_t *task = threads_task_ref(taskid);
+  if(!task) return; // long done and recycled
+  threads_wait_task(task);
+  threads_task_release(task);
+}
+
+typedef struct threads_range_t
+{
+  uint32_t begin, end, grain;
+  void   (*run)(uint32_t begin, uint32_t end, void *data);
+  void    *data;
+}
+threads_range_t;
+
+static void
+threads_range_run(uint32_t item, void *data)
+{
+  threads_range_t *r = data;
+  const uint32_t b = r->begin + item * r->grain;
+  const uint32_t e = r->end - b > r->grain ? b + r->grain : r->end;
+  r->run(b, e, r->data);
+}
+
+void threads_parallel_for(
+    uint32_t begin,
+    uint32_t end,
+    uint32_t grain,
+    void   (*run)(uint32_t begin, uint32_t end, void *data),
+    void    *data)
+{
+  if(end <= begin) return;
+  if(grain == 0) grain = 1;
+  const uint32_t chunks = (end - begin + grain - 1) / grain;
+  if(chunks == 1 || thr.num_threads < 2)
+  {
+    run(begin, end, data);
+    return;
+  }
+  // this lives on our stack: the tasks only call into it for items that
+  // have not been picked, and we don't return before all items are done.
+  threads_range_t range = { begin, end, grain, run, data };
+  const int taskid = threads_task_push("parallel for", chunks, -1, &range, threads_range_run, 0,
+      s_threads_prio_interactive, 0, 1);
+  if(taskid < 0)
+  {
+    run(begin, end, data);
+    return;
+  }
+  const int helpers = MIN(chunks, thr.num_threads) - 1;
+  for(int k=1;k<helpers;k++)
+    if(threads_task("parallel for", chunks, taskid, &range, threads_range_run, 0) < 0) break;
+  // work on it ourselves, too. this also means parallel for loops can be
+  // nested inside tasks without waiting for ourselves.
+  threads_task_t *task = thr.task + taskid % thr.task_max; // we hold a reference
+  threads_wait_task(task);
+  threads_task_release(task);
+}
+
 void threads_global_init()
 {
 #ifdef _WIN64
@@ -241,12 +577,17 @@ void threads_global_init()
 #endif
   thr.shutdown = 0;
   thr.task_max = thr.num_threads * 10;
+  thr.gen_max  = INT32_MAX / thr.task_max;
   thr.task     = malloc(sizeof(threads_task_t)*thr.task_max);
   thr.cpuid    = malloc(sizeof(uint32_t)*thr.num_threads);
   thr.worker   = malloc(sizeof(pthread_t)*thr.num_threads);
 
   for(int k=0;k<thr.task_max;k++)
-    thr.task[k].tid = s_task_state_recycle;
+  {
+    thr.task[k].tid  = s_task_state_recycle;
+    thr.task[k].refs = 0;
+    thr.task[k].gen  = 0;
+  }
 
   for(int k=0;k<thr.num_threads;k++)
     thr.cpuid[k] = k; // default init
@@ -285,12 +626,23 @@ void threads_global_init()
     fclose(f);
   }
 
+  thr.deque = malloc(sizeof(threads_deque_t)*thr.num_threads*s_threads_prio_cnt);
+  for(int k=0;k<thr.num_threads*s_threads_prio_cnt;k++)
+  {
+    pthread_mutex_init(&thr.deque[k].mutex, 0);
+    thr.deque[k].task = malloc(sizeof(uint32_t)*thr.task_max);
+    thr.deque[k].beg  = 0;
+    thr.deque[k].cnt  = 0;
+  }
+  for(int p=0;p<s_threads_prio_cnt;p++) thr.pending[p] = 0;
+  thr.next_deque = 0;
+  thr.next_slot  = 0;
+
   pthread_cond_init(&thr.cond_task_done, 0);
   pthread_cond_init(&thr.cond_task_push, 0);
   pthread_mutex_init(&thr.mutex_done, 0);
   pthread_mutex_init(&thr.mutex_push, 0);
 
-  thr.worker = malloc(sizeof(pthread_t)*thr.num_threads);
   for(uint64_t k=0;k<thr.num_threads;k++)
     pthread_create(thr.worker+k, 0, threads_work, (void*)k);
 }
@@ -320,13 +672,19 @@ int threads_num()
 // returns zero if the task is done
 int threads_task_running(int taskid)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return 0;
-  return thr.task[taskid].done < thr.task[taskid].work_item_cnt;
+  threads_task_t *task = threads_task_ref(taskid);
+  if(!task) return 0; // recycled, so it's done
+  int running = task->done < task->work_item_cnt;
+  threads_task_release(task);
+  return running;
 }
 
 // returns a progress indicator
 float threads_task_progress(int taskid)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return 0.0f;
-  return thr.task[taskid].done / (float) thr.task[taskid].work_item_cnt;
+  threads_task_t *task = threads_task_ref(taskid);
+  if(!task) return 1.0f;
+  float progress = task->done / (float) task->work_item_cnt;
+  threads_task_release(task);
+  return progress;
 }
@@ -12,7 +12,8 @@
 typedef struct threads_t threads_t;
 typedef struct threads_tls_t
 {
-  uint32_t tid; // thread id from 0..num_threads-1
+  uint32_t tid;    // thread id from 0..num_threads-1
+  uint32_t worker; // set on the pool threads, tid is zero elsewhere too
 }
 threads_tls_t;
 
@@ -24,6 +25,47 @@ extern thread_local threads_tls_t thr_tls;
 extern _Thread_local threads_tls_t thr_tls;
 #endif
 
+// priority classes of tasks. workers always pick the most important queued
+// task, and tasks of a lower class give way after the current work item as
+// soon as something more important is queued.
+typedef enum threads_priority_t
+{
+  s_threads_prio_interactive = 0, // the user is waiting for this
+  s_threads_prio_thumbnail   = 1, // thumbnails for the lighttable
+  s_threads_prio_batch       = 2, // export, copy, everything long running
+  s_threads_prio_cnt,
+}
+threads_priority_t;
+
+// cancellation token. cancelling invalidates all tasks that have been
+// pushed with this token so far: their remaining work items are skipped and
+// only the free callback runs. tasks pushed later are not affected, so the
+// token can be reused for the next batch of work.
+typedef struct threads_token_t
+{
+  uint32_t gen;
+}
+threads_token_t;
+
+static inline uint32_t
+threads_token_gen(const threads_token_t *token)
+{
+  return __atomic_load_n(&token->gen, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+threads_cancel(threads_token_t *token)
+{
+  __atomic_fetch_add(&token->gen, 1, __ATOMIC_ACQ_REL);
+}
+
+// returns non-zero if the token has been cancelled since gen was taken
+static inline int
+threads_cancelled(const threads_token_t *token, uint32_t gen)
+{
+  return threads_token_gen(token) != gen;
+}
+
 void threads_global_init();
 void threads_global_cleanup();
 
@@ -31,6 +73,9 @@ void threads_global_cleanup();
 // one task is going to be worked on by one thread. if you want multiple threads
 // do the same job, call this multiple times and pass the same work_item
 // and done pointers.
+// every worker keeps its own queue of tasks. tasks pushed from a worker go to
+// its own queue, others are distributed round robin, and idle workers steal
+// the oldest tasks from the others.
 int // returns the task id of the original job, i.e. taskid that was passed if >= 0
 threads_task(
     const char *desc,           // short textual description
@@ -38,7 +83,36 @@ threads_task(
     int         taskid,         // if >= 0, refer to previously added task (schedule another thread to help out there)
     void       *data,           // opaque user data that will be passed to the run function
     void      (*run)(uint32_t item, void *data),
-    void      (*free)(void*));  // this is called only at the very end to clean up (for every thread working on a job)
+    void      (*free)(void*));  // this is called only at the very end to clean up (for every thread working on a job),
+                                // by the thread that finishes the last work item
+
+// same as above, with a priority class (threads_task() is interactive) and an
+// optional cancellation token.
+// returns:
+// -1 no more recyclable tasks, too many tasks running
+// -2 argument error, run function is zero or no work to be done cnt <= item
+// or >= 0: the task id
+int
+threads_task_prio(
+    const char        *desc,
+    uint32_t           work_item_cnt,
+    int                taskid,
+    void              *data,
+    void             (*run)(uint32_t item, void *data),
+    void             (*free)(void*),
+    threads_priority_t prio,
+    threads_token_t   *token);       // may be zero
+
+// run fn on chunks [b,e) of at most grain items covering [begin,end) on the
+// thread pool. the calling thread works on the chunks too and returns when
+// all are done, so data can live on the stack. fine grained loops should use
+// this instead of one threads_task item per element.
+void threads_parallel_for(
+    uint32_t begin,
+    uint32_t end,
+    uint32_t grain,
+    void   (*fn)(uint32_t b, uint32_t e, void *data),
+    void    *data);
 
 // returns zero if the task is done
 int threads_task_running(int taskid);
@@ -55,7 +129,10 @@ int threads_shutting_down();
 // return number of threads
 int threads_num();
 
-// wait for a task to finish (pass the taskid that threads_task returned)
+// wait for a task to finish (pass the taskid that threads_task returned).
+// the waiting thread works on the remaining items of the task, and on queued
+// tasks of the same or more important priority class, instead of sleeping.
+// this makes it safe to wait for nested tasks from inside a task.
 void threads_wait(int taskid);
 
 static inline uint32_t threads_id()
@@ -0,0 +1,125 @@
+#include "core/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+dt_trace_t dt_trace_global;
+
+typedef struct dt_trace_ring_t
+{
+  atomic_uint_fast64_t head; // number of events ever written, only the owning thread writes
+  char                 name[32];
+  dt_trace_event_t     event[DT_TRACE_RING_SIZE];
+}
+dt_trace_ring_t;
+
+static dt_trace_ring_t *dt_trace_ring[DT_TRACE_MAX_THREADS];
+static atomic_int       dt_trace_ring_cnt;
+static _Thread_local dt_trace_ring_t *dt_trace_ring_tls;
+
+static dt_trace_ring_t *
+dt_trace_get_ring()
+{
+  if(dt_trace_ring_tls) return dt_trace_ring_tls;
+  const int id = dt_trace_ring_cnt++;
+  if(id >= DT_TRACE_MAX_THREADS) return 0; // too many threads, drop events
+  dt_trace_ring_t *r = calloc(1, sizeof(*r));
+  if(!r) return 0;
+  snprintf(r->name, sizeof(r->name), "thread %d", id);
+  dt_trace_ring[id] = r; // published to the writer by joining the thread
+  return dt_trace_ring_tls = r;
+}
+
+void
+dt_trace_init(int enabled)
+{
+  dt_trace_global.enabled = enabled;
+}
+
+void
+dt_trace_thread_name(const char *name)
+{
+  if(!dt_trace_enabled()) return;
+  dt_trace_ring_t *r = dt_trace_get_ring();
+  if(r) snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+void
+dt_trace_event(
+    dt_token_t cat,
+    dt_token_t name,
+    uint64_t   beg,
+    uint64_t   end,
+    uint32_t   track)
+{
+  if(!dt_trace_enabled()) return;
+  dt_trace_ring_t *r = dt_trace_get_ring();
+  if(!r) return;
+  const uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+  r->event[h % DT_TRACE_RING_SIZE] = (dt_trace_event_t){
+    .beg = beg, .end = end, .cat = cat, .name = name, .track = track };
+  atomic_store_explicit(&r->head, h+1, memory_order_release);
+}
+
+static void
+dt_trace_write_token(FILE *f, dt_token_t t)
+{ // tokens are up to 8 chars, escape what json does not like
+  for(int i=0;i<8;i++)
+  {
+    const char c = dt_token_str(t)[i];
+    if(!c) break;
+    if(c == '"' || c == '\\') fputc('\\', f);
+    if(c >= ' ') fputc(c, f);
+  }
+}
+
+int
+dt_trace_write(const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f) return 1;
+  uint64_t t0 = -1ul; // start the trace at zero for readability
+  const int cnt = dt_trace_ring_cnt < DT_TRACE_MAX_THREADS ? dt_trace_ring_cnt : DT_TRACE_MAX_THREADS;
+  for(int t=0;t<cnt;t++)
+  {
+    dt_trace_ring_t *r = dt_trace_ring[t];
+    if(!r) continue;
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    const uint64_t beg  = head > DT_TRACE_RING_SIZE ? head - DT_TRACE_RING_SIZE : 0;
+    for(uint64_t i=beg;i<head;i++)
+      if(r->event[i % DT_TRACE_RING_SIZE].beg < t0) t0 = r->event[i % DT_TRACE_RING_SIZE].beg;
+  }
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"gpu\"}}");
+  for(int t=0;t<cnt;t++)
+  {
+    dt_trace_ring_t *r = dt_trace_ring[t];
+    if(!r) continue;
+    fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", t+1, r->name);
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    const uint64_t beg  = head > DT_TRACE_RING_SIZE ? head - DT_TRACE_RING_SIZE : 0;
+    for(uint64_t i=beg;i<head;i++)
+    {
+      const dt_trace_event_t *e = r->event + i % DT_TRACE_RING_SIZE;
+      fprintf(f, ",\n{\"name\":\"");
+      dt_trace_write_token(f, e->name);
+      fprintf(f, "\",\"cat\":\"");
+      dt_trace_write_token(f, e->cat);
+      fprintf(f, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+          e->track ? 0 : t+1, (e->beg - t0)*1e-3, (e->end - e->beg)*1e-3);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  return 0;
+}
+
+void
+dt_trace_cleanup()
+{ // don't free the rings, threads we didn't join (or the pool, if it is shut
+  // down later) may be about to write to the one in their dt_trace_ring_tls.
+  // they are still reachable through dt_trace_ring and go away with the process.
+  dt_trace_global.enabled = 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+// event tracing to see what runs concurrently: every thread records begin
+// and end times of the interesting bits (thread pool tasks, phases of graph
+// runs, gpu kernels) into its own ring buffer, no locks involved. enabled
+// with -d trace, the rings are written as chrome trace json on exit, which
+// can be loaded into chrome://tracing or ui.perfetto.dev.
+#include "pipe/token.h"
+#include <stdint.h>
+#include <time.h>
+
+#define DT_TRACE_FILE        "vkdt-trace.json"
+#define DT_TRACE_RING_SIZE   (1<<16) // events per thread, older ones are overwritten
+#define DT_TRACE_MAX_THREADS 256
+
+typedef struct dt_trace_event_t
+{
+  uint64_t   beg, end; // nanoseconds, monotonic clock
+  dt_token_t cat;      // category, such as "task" or "graph"
+  dt_token_t name;
+  uint32_t   track;    // 0 for the recording thread, 1 for the gpu
+  uint32_t   pad;
+}
+dt_trace_event_t;
+
+typedef struct dt_trace_t
+{
+  int enabled;
+}
+dt_trace_t;
+
+extern VKDT_API dt_trace_t dt_trace_global;
+
+static inline int
+dt_trace_enabled()
+{
+  return dt_trace_global.enabled;
+}
+
+static inline uint64_t
+dt_trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// enable or disable recording
+void dt_trace_init(int enabled);
+
+// give the calling thread a name in the trace
+void dt_trace_thread_name(const char *name);
+
+// record an event from beg to end on the calling thread (or on the gpu track)
+void dt_trace_event(
+    dt_token_t cat,
+    dt_token_t name,
+    uint64_t   beg,
+    uint64_t   end,
+    uint32_t   track);
+
+// record the phase that started at *beg and ends now, and start the next one.
+static inline void
+dt_trace_phase(
+    uint64_t  *beg,
+    dt_token_t cat,
+    dt_token_t name)
+{
+  if(!dt_trace_enabled()) return;
+  const uint64_t end = dt_trace_now();
+  dt_trace_event(cat, name, *beg, end, 0);
+  *beg = end;
+}
+
+// write everything recorded so far as chrome trace json. call this after all
+// other threads stopped recording. returns non-zero on error.
+int dt_trace_write(const char *filename);
+
+// stop recording. the ring buffers stay allocated until the process exits:
+// threads which are still running may hold on to theirs.
+void dt_trace_cleanup();
@@ -5,7 +5,8 @@
 #include "core/sort.h"
 #include "pipe/graph-defaults.h"
 #include "stringpool.h"
-#include "exif.h"
+#include "metadata.h"
+#include "pqsort.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -80,33 +81,13 @@ compare_labels(const void *a, const void *b, void *arg)
 
 static int
 compare_createdate(const void *a, const void *b, void *arg)
-{ // you ask for complicated sort, you get slow and stupid.
-  // we don't store the date in the db, since there is in general no clear 1:1 mapping
-  // between images and cfg file/graph. also, loading a directory becomes painfully slow
-  // when initialising metadata during ingestion.
+{ // filled by dt_db_metadata_init() when loading the directory
   dt_db_t *db = arg;
   const uint32_t *ia = a, *ib = b;
-  char cda[20] = {0}, cdb[20] = {0};
-  char fna[1024], fnb[1024];
-  char aa[1024], bb[1024];
-  dt_db_image_path(db, ia[0], fna, sizeof(fna));
-  dt_db_image_path(db, ib[0], fnb, sizeof(fnb));
-  size_t off;
-  fs_realpath(fna, aa);
-  off = strnlen(aa, sizeof(aa));
-  if(off > 4) aa[off - 4] = 0;
-  else aa[off] = 0;
-
-  fs_realpath(fnb, bb);
-  off = strnlen(bb, sizeof(bb));
-  if(off > 4) bb[off - 4] = 0;
-  else bb[off] = 0;
-
-  char model[32];
-  dt_db_exif_mini(aa, cda, model, sizeof(model));
-  dt_db_exif_mini(bb, cdb, model, sizeof(model));
-
-  return strcmp(cda, cdb);
+  const uint64_t ca = db->image[ia[0]].createdate, cb = db->image[ib[0]].createdate;
+  if(ca > cb) return 1;
+  else if(cb > ca) return -1;
+  return 0;
 }
 
 static int
@@ -114,14 +95,72 @@ compare_filetype(const void *a, const void *b, void *arg)
 {
   dt_db_t *db = arg;
   const uint32_t *ia = a, *ib = b;
-  dt_token_t ta = dt_graph_default_input_module(db->image[ia[0]].filename);
-  dt_token_t tb = dt_graph_default_input_module(db->image[ib[0]].filename);
+  dt_token_t ta = db->image[ia[0]].filetype;
+  dt_token_t tb = db->image[ib[0]].filetype;
   // convert 64 to 32 bits:
   if(ta > tb) return 1;
   else if(tb > ta) return -1;
   return 0;
 }
 
+static sort_compare_t *
+compare_function(dt_db_property_t prop)
+{
+  switch(prop)
+  {
+  case s_prop_filename:   return compare_filename;
+  case s_prop_rating:     return compare_rating;
+  case s_prop_labels:     return compare_labels;
+  case s_prop_createdate: return compare_createdate;
+  case s_prop_filetype:   return compare_filetype;
+  default:                return 0;
+  }
+}
+
+// fixed width sort key, the order is the same as for the compare functions
+// above. file names only go in with their first eight characters.
+static inline uint64_t
+sort_key(const dt_db_t *db, uint32_t imgid, dt_db_property_t prop)
+{
+  const dt_image_t *img = db->image + imgid;
+  switch(prop)
+  {
+  case s_prop_filename:
+  {
+    uint64_t key = 0;
+    const unsigned char *c = (const unsigned char *)img->filename;
+    for(int i=0;i<8&&c[i];i++) key |= (uint64_t)c[i] << (56-8*i);
+    return key;
+  }
+  case s_prop_rating:     return 0xffff - img->rating; // higher rating comes first
+  case s_prop_labels:     return img->labels;
+  case s_prop_createdate: return img->createdate;
+  case s_prop_filetype:   return img->filetype;
+  default:                return 0;
+  }
+}
+
+// sort a list of image ids by computing keys once and sorting key/id pairs
+static void
+sort_images(dt_db_t *db, uint32_t *ids, uint32_t cnt, dt_db_property_t prop)
+{
+  if(prop == s_prop_none || cnt < 2) return;
+  dt_db_sort_t *p = malloc(sizeof(dt_db_sort_t)*cnt);
+  for(uint32_t i=0;i<cnt;i++)
+    p[i] = (dt_db_sort_t){ .key = sort_key(db, ids[i], prop), .id = ids[i] };
+  pqsort(p, cnt);
+  for(uint32_t i=0;i<cnt;i++) ids[i] = p[i].id;
+  if(prop == s_prop_filename)
+  { // resolve file names that share the first eight characters
+    for(uint32_t i=0,j;i<cnt;i=j)
+    {
+      for(j=i+1;j<cnt&&p[j].key==p[i].key;j++);
+      if(j - i > 1) sort(ids + i, j - i, sizeof(ids[0]), compare_filename, db);
+    }
+  }
+  free(p);
+}
+
 static inline void
 image_init(dt_image_t *img)
 {
@@ -153,32 +192,12 @@ dt_db_update_collection(dt_db_t *db)
       // TODO: match beginning of filter val string
       break;
     case s_prop_filetype:
-      if(dt_graph_default_input_module(db->image[k].filename) != db->collection_filter_val) continue;
+      if(db->image[k].filetype != db->collection_filter_val) continue;
       break;
     }
     db->collection[db->collection_cnt++] = k;
   }
-  // TODO: use db/tests/parallel radix sort
-  switch(db->collection_sort)
-  {
-  case s_prop_none:
-    break;
-  case s_prop_filename:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filetype, db);
-    break;
-  }
+  sort_images(db, db->collection, db->collection_cnt, db->collection_sort);
 }
 
 void dt_db_load_directory(
@@ -268,6 +287,9 @@ void dt_db_load_directory(
   clock_t end = clock();
   dt_log(s_log_perf|s_log_db, "time to load images %2.3fs", (end-beg)/(double)CLOCKS_PER_SEC);
 
+  // sorting and filtering only look at the metadata in memory
+  dt_db_metadata_init(db);
+
   char dbname[256];
   snprintf(dbname, sizeof(dbname), "%s/vkdt.db", dirname);
   dt_db_read(db, dbname);
@@ -325,6 +347,8 @@ int dt_db_load_image(
         &thumbid); // nothing we can do if this fails
 
   db->image[imgid].thumbnail = thumbid;
+  if(thumbid != -1u) thumbnails->thumb[thumbid].imgid = imgid;
+  dt_db_metadata_init(db);
 
   // collect images:
   dt_db_update_collection(db);
@@ -415,26 +439,17 @@ void dt_db_selection_clear(dt_db_t *db)
 }
 
 const uint32_t *dt_db_selection_get(dt_db_t *db)
-{
-  switch(db->collection_sort)
-  { // sync sorting criterion with collection
-  case s_prop_none:
-    break;
-  case s_prop_filename:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filetype, db);
-    break;
+{ // sync sorting criterion with collection. the selection stays sorted
+  // between calls, so only sort if something changed:
+  sort_compare_t *compare = compare_function(db->collection_sort);
+  if(!compare) return db->selection;
+  for(uint32_t i=1;i<db->selection_cnt;i++)
+  {
+    if(compare(db->selection + i-1, db->selection + i, db) > 0)
+    {
+      sort_images(db, db->selection, db->selection_cnt, db->collection_sort);
+      break;
+    }
   }
   return db->selection;
 }
@@ -26,6 +26,9 @@ typedef struct dt_image_t
   uint32_t    thumbnail; // index into thumbnails->thumb[] or -1u
   uint16_t    rating;    // -1u reject 0 1 2 3 4 5 stars
   uint16_t    labels;    // each bit is one colour label flag, 1<<15 is selected bit
+  uint64_t    createdate;// yyyymmddhhmmss as decimal number, see db/metadata.h
+  uint64_t    filetype;  // dt_token_t of the default input module
+  char        model[32]; // camera model, if we could find it
 }
 dt_image_t;
 
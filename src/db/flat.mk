@@ -1,12 +1,20 @@
 DB_O=\
 db/db.o\
+db/metadata.o\
+db/pqsort.o\
+db/preview.o\
 db/rc.o\
+db/thumbarchive.o\
 db/thumbnails.o
 DB_H=\
 db/db.h\
 db/exif.h\
 db/hash.h\
+db/metadata.h\
+db/pqsort.h\
+db/preview.h\
+db/thumbarchive.h\
 db/thumbnails.h\
 db/stringpool.h
-DB_CFLAGS=
-DB_LDFLAGS=
+DB_CFLAGS=$(VKDT_JPEG_CFLAGS)
+DB_LDFLAGS=-lz $(VKDT_JPEG_LDFLAGS)
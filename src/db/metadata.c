@@ -0,0 +1,148 @@
+#include "metadata.h"
+#include "stringpool.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/threads.h"
+#include "pipe/graph-defaults.h"
+#include "exif.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+
+typedef struct metadata_key_t
+{
+  int64_t  mtime;  // of the image file
+  uint64_t size;   // of the image file
+  int      cached; // the entry from the cache file is still valid
+}
+metadata_key_t;
+
+typedef struct metadata_job_t
+{
+  dt_db_t         *db;
+  metadata_key_t  *key;     // one per image
+  atomic_uint      changed; // number of images that were not in the cache
+}
+metadata_job_t;
+
+// the image file behind the db entry. for cfg files this follows
+// symlinks (as in tag collections) and strips the .cfg.
+static void
+metadata_image_file(
+    const dt_db_t *db,
+    uint32_t       imgid,
+    char          *fn,
+    size_t         size)
+{
+  char cfg[1040];
+  dt_db_image_path(db, imgid, cfg, sizeof(cfg));
+  if(!fs_realpath(cfg, fn)) snprintf(fn, size, "%s", cfg);
+  size_t off = strnlen(fn, size);
+  if(off > 4) fn[off - 4] = 0;
+}
+
+static void
+metadata_read(metadata_job_t *job, uint32_t imgid)
+{
+  dt_image_t *img = job->db->image + imgid;
+  metadata_key_t *key = job->key + imgid;
+  char fn[PATH_MAX];
+  metadata_image_file(job->db, imgid, fn, sizeof(fn));
+  struct stat sb = {0};
+  stat(fn, &sb);
+  if(key->cached && key->mtime == sb.st_mtime && key->size == sb.st_size)
+    return;
+  key->mtime  = sb.st_mtime;
+  key->size   = sb.st_size;
+  key->cached = 0;
+  char createdate[20] = {0};
+  img->model[0] = 0;
+  dt_db_exif_mini(fn, createdate, img->model, sizeof(img->model));
+  for(char *c=img->model;*c;c++) if(*c < ' ') *c = ' '; // keep the cache file line based
+  img->createdate = dt_db_metadata_pack_date(createdate);
+  img->filetype   = dt_graph_default_input_module(img->filename);
+  job->changed++;
+}
+
+static void
+metadata_range(uint32_t begin, uint32_t end, void *arg)
+{
+  for(uint32_t imgid=begin;imgid<end;imgid++)
+    metadata_read(arg, imgid);
+}
+
+// read the cache file, entries for images that are not in the db are dropped
+static void
+metadata_cache_read(
+    dt_db_t        *db,
+    metadata_key_t *key,
+    const char     *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f) return;
+  char line[2048], imgn[1024], model[1024], type[9];
+  int64_t mtime;
+  uint64_t size, createdate;
+  while(fgets(line, sizeof(line), f))
+  { // filename:mtime:size:createdate:filetype:model
+    model[0] = type[0] = 0;
+    if(sscanf(line, "%1023[^:]:%"SCNd64":%"SCNu64":%"SCNu64":%8[^:]:%1023[^\n]",
+          imgn, &mtime, &size, &createdate, type, model) < 5) continue;
+    uint32_t imgid = dt_stringpool_get(&db->sp_filename, imgn, strlen(imgn), -1u, 0);
+    if(imgid == -1u || imgid >= db->image_cnt) continue;
+    dt_image_t *img = db->image + imgid;
+    key[imgid] = (metadata_key_t){ .mtime = mtime, .size = size, .cached = 1 };
+    img->createdate = createdate;
+    img->filetype   = dt_token(type);
+    snprintf(img->model, sizeof(img->model), "%s", model);
+  }
+  fclose(f);
+}
+
+static void
+metadata_cache_write(
+    const dt_db_t        *db,
+    const metadata_key_t *key,
+    const char           *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f) return; // read-only directory, we'll scan again next time
+  for(uint32_t i=0;i<db->image_cnt;i++)
+  {
+    const dt_image_t *img = db->image + i;
+    fprintf(f, "%s:%"PRId64":%"PRIu64":%"PRIu64":%"PRItkn":%s\n",
+        img->filename, key[i].mtime, key[i].size, img->createdate,
+        dt_token_str(img->filetype), img->model);
+  }
+  fclose(f);
+}
+
+void
+dt_db_metadata_init(dt_db_t *db)
+{
+  if(!db->image_cnt) return;
+  clock_t beg = clock();
+  metadata_job_t job = { .db = db };
+  job.key = calloc(db->image_cnt, sizeof(metadata_key_t));
+  atomic_init(&job.changed, 0);
+
+  char filename[1100];
+  snprintf(filename, sizeof(filename), "%s/" DT_DB_METADATA_FILE, db->dirname);
+  if(db->dirname[0]) metadata_cache_read(db, job.key, filename);
+
+  // opening files is slow on network drives, so ask the thread pool to help.
+  threads_parallel_for(0, db->image_cnt, 16, metadata_range, &job);
+
+  const uint32_t changed = job.changed;
+  if(changed && db->dirname[0] && db->image_cnt > 1)
+    metadata_cache_write(db, job.key, filename);
+  free(job.key);
+  clock_t end = clock();
+  dt_log(s_log_perf|s_log_db, "time to read metadata %2.3fs, %u/%u images from cache",
+      (end-beg)/(double)CLOCKS_PER_SEC, db->image_cnt - changed, db->image_cnt);
+}
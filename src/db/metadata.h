@@ -0,0 +1,26 @@
+#pragma once
+// per directory cache of the image metadata needed to sort and filter the
+// collection (create date, camera model, file type). it is filled once in
+// parallel when loading a directory, so sorting never touches the files.
+// the cache is persisted as vkdt.meta next to vkdt.db, entries are keyed by
+// filename, mtime and size of the image file.
+#include "db.h"
+
+#define DT_DB_METADATA_FILE "vkdt.meta"
+
+// pack a "yyyy:mm:dd hh:mm:ss" date string into a decimal number
+// yyyymmddhhmmss, which sorts the same way. returns 0 if there are no digits.
+static inline uint64_t
+dt_db_metadata_pack_date(const char *datetime)
+{
+  uint64_t d = 0;
+  for(int i=0;i<19&&datetime[i];i++)
+    if(datetime[i] >= '0' && datetime[i] <= '9')
+      d = 10*d + datetime[i] - '0';
+  return d;
+}
+
+// fill createdate, model and filetype of all images in the db. uses the
+// cache file in the directory and only opens the images that are new or
+// changed since. writes the cache back if anything changed.
+void dt_db_metadata_init(dt_db_t *db);
@@ -0,0 +1,130 @@
+// radix sort, parallel over the buckets of the most significant byte that
+// differs between the keys. the buckets are then sorted independently by
+// least significant digit passes over the remaining bytes that differ.
+// dates, ratings and file name prefixes usually share a lot of bytes, these
+// are skipped entirely.
+#include "pqsort.h"
+#include "core/threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// below this, the pool is more overhead than help and all passes fit in cache
+#define PQSORT_PAR_MIN (1<<14)
+// below this, buckets are insertion sorted
+#define PQSORT_INS_MAX 48
+
+typedef struct pqsort_job_t
+{
+  dt_db_sort_t *p, *tmp;        // tmp holds the buckets, results go to p
+  uint64_t      beg[257];       // bucket boundaries
+  uint64_t      diff;           // bits that vary between keys
+  int           byte;           // the byte the buckets are split on
+}
+pqsort_job_t;
+
+static inline void
+insertion_sort(dt_db_sort_t *p, uint64_t num)
+{
+  for(uint64_t i=1;i<num;i++)
+  {
+    dt_db_sort_t t = p[i];
+    uint64_t j = i;
+    for(;j>0&&p[j-1].key>t.key;j--) p[j] = p[j-1];
+    p[j] = t;
+  }
+}
+
+// stable counting sort pass on one byte
+static inline void
+radix_pass(
+    const dt_db_sort_t *src,
+    dt_db_sort_t       *dst,
+    uint64_t            num,
+    int                 byte)
+{
+  uint64_t hist[256] = {0};
+  const int shift = 8*byte;
+  for(uint64_t i=0;i<num;i++) hist[(src[i].key >> shift) & 0xff]++;
+  uint64_t sum = 0;
+  for(int k=0;k<256;k++) { uint64_t c = hist[k]; hist[k] = sum; sum += c; }
+  for(uint64_t i=0;i<num;i++) dst[hist[(src[i].key >> shift) & 0xff]++] = src[i];
+}
+
+// sort src by the varying bytes below `top`, result ends up in dst.
+// src and dst are both scratch space for this range.
+static void
+radix_sort(
+    dt_db_sort_t *src,
+    dt_db_sort_t *dst,
+    uint64_t      num,
+    uint64_t      diff,
+    int           top)
+{
+  if(num <= PQSORT_INS_MAX)
+  {
+    insertion_sort(src, num);
+    if(src != dst) memcpy(dst, src, sizeof(dt_db_sort_t)*num);
+    return;
+  }
+  dt_db_sort_t *a = src, *b = dst;
+  int passes = 0;
+  for(int byte=0;byte<top;byte++)
+    if((diff >> (8*byte)) & 0xff) passes++;
+  // the result needs to end up in dst. with an even number of passes, move
+  // the input over first so the ping pong ends in the right place.
+  if(!(passes & 1))
+  {
+    memcpy(dst, src, sizeof(dt_db_sort_t)*num);
+    a = dst; b = src;
+  }
+  for(int byte=0;byte<top;byte++)
+  {
+    if(!((diff >> (8*byte)) & 0xff)) continue;
+    radix_pass(a, b, num, byte);
+    dt_db_sort_t *t = a; a = b; b = t;
+  }
+}
+
+static void
+pqsort_buckets(uint32_t begin, uint32_t end, void *arg)
+{
+  pqsort_job_t *job = arg;
+  for(uint32_t b=begin;b<end;b++)
+  {
+    const uint64_t beg = job->beg[b], num = job->beg[b+1] - beg;
+    if(num) radix_sort(job->tmp + beg, job->p + beg, num, job->diff, job->byte);
+  }
+}
+
+void pqsort(dt_db_sort_t *p, uint64_t num)
+{
+  if(num < 2) return;
+  uint64_t diff = 0;
+  for(uint64_t i=1;i<num;i++) diff |= p[i].key ^ p[0].key;
+  if(!diff) return; // all equal
+  int top = 7;
+  while(!((diff >> (8*top)) & 0xff)) top--;
+
+  dt_db_sort_t *tmp = malloc(sizeof(dt_db_sort_t)*num);
+  if(num < PQSORT_PAR_MIN)
+  {
+    memcpy(tmp, p, sizeof(dt_db_sort_t)*num);
+    radix_sort(tmp, p, num, diff, top+1);
+    free(tmp);
+    return;
+  }
+
+  // split into buckets on the most significant varying byte. this is also
+  // a lot more cache friendly than lsd passes over the whole array.
+  pqsort_job_t job = { .p = p, .tmp = tmp, .diff = diff, .byte = top };
+  uint64_t hist[256] = {0};
+  const int shift = 8*top;
+  for(uint64_t i=0;i<num;i++) hist[(p[i].key >> shift) & 0xff]++;
+  for(int k=0;k<256;k++) job.beg[k+1] = job.beg[k] + hist[k];
+  memcpy(hist, job.beg, sizeof(hist));
+  for(uint64_t i=0;i<num;i++) tmp[hist[(p[i].key >> shift) & 0xff]++] = p[i];
+
+  threads_parallel_for(0, 256, 1, pqsort_buckets, &job);
+  free(tmp);
+}
@@ -0,0 +1,18 @@
+#pragma once
+// parallel sort of 64-bit keys with a 32-bit id attached. this is what the
+// collection is sorted with: the keys are computed once per image and the
+// ids are the image ids, so no comparison callbacks are involved.
+#include <stdint.h>
+
+typedef struct dt_db_sort_t
+{
+  uint64_t key;
+  uint32_t id;
+  uint32_t pad;
+}
+dt_db_sort_t;
+
+// sort by ascending key. the sort is stable, equal keys keep their order.
+// large arrays are sorted on the thread pool, with the calling thread
+// working too.
+void pqsort(dt_db_sort_t *p, uint64_t num);
@@ -0,0 +1,406 @@
+#include "db/preview.h"
+#include "core/core.h"
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define STB_DXT_STATIC
+#define STB_DXT_IMPLEMENTATION
+#include "pipe/modules/o-bc1/stb_dxt.h"
+#pragma GCC diagnostic pop
+#include "pipe/modules/o-bc1/bc1.h"
+
+#include <stdio.h>
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PREVIEW_MAX_CANDIDATES 32
+#define PREVIEW_MAX_IFDS       64
+
+typedef struct preview_tiff_t
+{
+  const uint8_t *buf;
+  size_t         size;
+  uint64_t       base; // offsets in the ifds are relative to the tiff header
+  int            be;   // big endian (MM)
+}
+preview_tiff_t;
+
+typedef struct preview_cand_t
+{
+  uint64_t offset, length;
+  uint32_t wd, ht;
+}
+preview_cand_t;
+
+static inline uint32_t
+tiff_u16(const preview_tiff_t *t, uint64_t o)
+{
+  o += t->base;
+  if(o + 2 > t->size) return 0;
+  const uint8_t *b = t->buf + o;
+  return t->be ? (b[0] << 8) | b[1] : (b[1] << 8) | b[0];
+}
+
+static inline uint32_t
+tiff_u32(const preview_tiff_t *t, uint64_t o)
+{
+  o += t->base;
+  if(o + 4 > t->size) return 0;
+  const uint8_t *b = t->buf + o;
+  return t->be ?
+    ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3] :
+    ((uint32_t)b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+}
+
+// set up byte order from the tiff header at base, returns the offset of ifd0 or 0
+static uint64_t
+tiff_init(preview_tiff_t *t, const uint8_t *buf, size_t size, uint64_t base)
+{
+  *t = (preview_tiff_t){ .buf = buf, .size = size, .base = base };
+  if(base + 8 > size) return 0;
+  if(buf[base] == 'I' && buf[base+1] == 'I') t->be = 0;
+  else if(buf[base] == 'M' && buf[base+1] == 'M') t->be = 1;
+  else return 0;
+  const uint32_t magic = tiff_u16(t, 2);
+  // plain tiff, olympus orf, panasonic rw2
+  if(magic != 42 && magic != 0x4f52 && magic != 0x5352 && magic != 0x55) return 0;
+  return tiff_u32(t, 4);
+}
+
+// parse the jpeg markers up to the frame header to find the dimensions.
+// returns non-zero if this is not a jpeg libjpeg can decode (lossless raw data in dng for instance)
+static int
+jpeg_dimensions(const uint8_t *buf, uint64_t len, uint32_t *wd, uint32_t *ht)
+{
+  if(len < 4 || buf[0] != 0xff || buf[1] != 0xd8) return 1;
+  uint64_t p = 2;
+  while(p + 4 <= len)
+  {
+    if(buf[p] != 0xff) return 1;
+    const uint8_t m = buf[p+1];
+    if(m == 0xff) { p++; continue; } // fill byte
+    if(m == 0x01 || (m >= 0xd0 && m <= 0xd8)) { p += 2; continue; } // no length
+    if(m == 0xda || m == 0xd9) return 1; // start of scan or end before frame header
+    const uint32_t seg = (buf[p+2] << 8) | buf[p+3];
+    if(m == 0xc0 || m == 0xc1 || m == 0xc2)
+    { // baseline, extended, progressive huffman
+      if(p + 9 > len) return 1;
+      *ht = (buf[p+5] << 8) | buf[p+6];
+      *wd = (buf[p+7] << 8) | buf[p+8];
+      return !*wd || !*ht;
+    }
+    if(m >= 0xc3 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) return 1; // lossless, arithmetic, ..
+    p += 2 + seg;
+  }
+  return 1;
+}
+
+static void
+add_candidate(
+    const uint8_t  *buf,
+    size_t          size,
+    uint64_t        offset,
+    uint64_t        length,
+    preview_cand_t *cand,
+    int            *cnt)
+{
+  if(!length || offset >= size || *cnt >= PREVIEW_MAX_CANDIDATES) return;
+  if(length > size - offset) length = size - offset; // some writers are sloppy with the length
+  for(int i=0;i<*cnt;i++) if(cand[i].offset == offset) return;
+  uint32_t wd, ht;
+  if(jpeg_dimensions(buf + offset, length, &wd, &ht)) return;
+  cand[(*cnt)++] = (preview_cand_t){ .offset = offset, .length = length, .wd = wd, .ht = ht };
+}
+
+// walk ifd chains, sub ifds and the exif ifd and collect everything that looks like a jpeg
+static void
+tiff_walk(
+    const preview_tiff_t *t,
+    uint64_t              ifd0,
+    preview_cand_t       *cand,
+    int                  *cnt,
+    int                  *orientation)
+{
+  uint64_t stack[PREVIEW_MAX_IFDS];
+  int sp = 0, visited = 0;
+  stack[sp++] = ifd0;
+  while(sp && visited++ < PREVIEW_MAX_IFDS)
+  {
+    const uint64_t ifd = stack[--sp];
+    const uint32_t n = tiff_u16(t, ifd);
+    if(!n || t->base + ifd + 2 + 12*(uint64_t)n > t->size) continue;
+    uint64_t jpg_off = 0, jpg_len = 0, strip_off = 0, strip_len = 0;
+    uint32_t compression = 0;
+    for(uint32_t i=0;i<n;i++)
+    {
+      const uint64_t e = ifd + 2 + 12*i;
+      const uint32_t tag = tiff_u16(t, e), type = tiff_u16(t, e+2), count = tiff_u32(t, e+4);
+      const uint32_t val = type == 3 ? tiff_u16(t, e+8) : tiff_u32(t, e+8);
+      switch(tag)
+      {
+      case 0x002e: // panasonic JpgFromRaw, the data is the value
+        if(val) add_candidate(t->buf, t->size, t->base + val, count, cand, cnt);
+        break;
+      case 0x0103: compression = val; break;
+      case 0x0111: if(count == 1) strip_off = val; break;
+      case 0x0117: if(count == 1) strip_len = val; break;
+      case 0x0112: if(visited == 1 && !*orientation) *orientation = val; break;
+      case 0x0201: jpg_off = val; break;
+      case 0x0202: jpg_len = val; break;
+      case 0x014a: // sub ifds
+        if(count == 1) { if(sp < PREVIEW_MAX_IFDS) stack[sp++] = val; }
+        else for(uint32_t k=0;k<count && k<8 && sp<PREVIEW_MAX_IFDS;k++)
+          stack[sp++] = tiff_u32(t, val + 4*k);
+        break;
+      case 0x8769: // exif ifd
+        if(sp < PREVIEW_MAX_IFDS) stack[sp++] = val;
+        break;
+      }
+    }
+    if(jpg_off && jpg_len) add_candidate(t->buf, t->size, t->base + jpg_off, jpg_len, cand, cnt);
+    if((compression == 6 || compression == 7) && strip_off && strip_len)
+      add_candidate(t->buf, t->size, t->base + strip_off, strip_len, cand, cnt);
+    const uint32_t next = tiff_u32(t, ifd + 2 + 12*(uint64_t)n);
+    if(next && sp < PREVIEW_MAX_IFDS) stack[sp++] = next;
+  }
+}
+
+// read the orientation from the exif app1 segment of a jpeg, 0 if there is none
+static int
+jpeg_orientation(const uint8_t *buf, uint64_t len)
+{
+  uint64_t p = 2;
+  while(p + 4 <= len && buf[p] == 0xff)
+  {
+    const uint8_t m = buf[p+1];
+    if(m == 0xda || m == 0xd9) break;
+    const uint32_t seg = (buf[p+2] << 8) | buf[p+3];
+    if(m == 0xe1 && seg > 14 && p + 2 + seg <= len && !memcmp(buf + p + 4, "Exif\0\0", 6))
+    {
+      preview_tiff_t t;
+      const uint64_t ifd0 = tiff_init(&t, buf, p + 2 + seg, p + 10);
+      const uint32_t n = ifd0 ? tiff_u16(&t, ifd0) : 0;
+      for(uint32_t i=0;i<n;i++)
+        if(tiff_u16(&t, ifd0 + 2 + 12*i) == 0x0112)
+          return tiff_u16(&t, ifd0 + 2 + 12*i + 8);
+      return 0;
+    }
+    p += 2 + seg;
+  }
+  return 0;
+}
+
+int
+dt_preview_find_jpeg(
+    const uint8_t *buf,
+    size_t         size,
+    uint32_t       min_size,
+    uint64_t      *offset,
+    uint64_t      *length,
+    int           *orientation)
+{
+  preview_cand_t cand[PREVIEW_MAX_CANDIDATES];
+  int cnt = 0, ori = 0;
+  preview_tiff_t t;
+  uint64_t ifd0;
+  if(size > 92 && !memcmp(buf, "FUJIFILMCCD-RAW", 15))
+  { // raf has a header with the jpeg offset and length in big endian
+    const uint32_t off = ((uint32_t)buf[84] << 24) | (buf[85] << 16) | (buf[86] << 8) | buf[87];
+    const uint32_t len = ((uint32_t)buf[88] << 24) | (buf[89] << 16) | (buf[90] << 8) | buf[91];
+    add_candidate(buf, size, off, len, cand, &cnt);
+  }
+  else if(size > 4 && buf[0] == 0xff && buf[1] == 0xd8)
+    add_candidate(buf, size, 0, size, cand, &cnt);
+  else if((ifd0 = tiff_init(&t, buf, size, 0)))
+    tiff_walk(&t, ifd0, cand, &cnt, &ori);
+  if(!cnt) return 1;
+
+  int best = 0;
+  for(int i=1;i<cnt;i++)
+  {
+    const uint64_t sb = MAX(cand[best].wd, cand[best].ht), si = MAX(cand[i].wd, cand[i].ht);
+    if(sb < min_size ? si > sb : (si >= min_size && si < sb)) best = i;
+  }
+  *offset = cand[best].offset;
+  *length = cand[best].length;
+  if(!ori) ori = jpeg_orientation(buf + *offset, *length);
+  *orientation = (ori >= 1 && ori <= 8) ? ori : 1;
+  return 0;
+}
+
+typedef struct preview_jpgerr_t
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+}
+preview_jpgerr_t;
+
+static void
+preview_error_exit(j_common_ptr cinfo)
+{
+  preview_jpgerr_t *err = (preview_jpgerr_t *)cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+static inline float
+srgb_to_linear(float v)
+{
+  return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline uint8_t
+linear_to_srgb8(float v)
+{
+  v = CLAMP(v, 0.0f, 1.0f);
+  v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f/2.4f) - 0.055f;
+  return (uint8_t)(255.0f * v + 0.5f);
+}
+
+// decode the jpeg at the smallest dct scale that still covers tw x th and box
+// filter it down to exactly that, in linear rec2020. out is rgb float.
+static int
+preview_decode(
+    const uint8_t *buf,
+    uint64_t       len,
+    uint32_t       tw,
+    uint32_t       th,
+    float         *out)
+{
+  struct jpeg_decompress_struct dinfo;
+  preview_jpgerr_t err;
+  uint8_t *volatile img = 0;
+  dinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = preview_error_exit;
+  if(setjmp(err.setjmp_buffer))
+  {
+    jpeg_destroy_decompress(&dinfo);
+    free(img);
+    return 1;
+  }
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, (unsigned char *)buf, len);
+  jpeg_read_header(&dinfo, TRUE);
+  dinfo.out_color_space = JCS_RGB;
+  dinfo.scale_num   = 1;
+  dinfo.scale_denom = 1;
+  for(int d=8;d>1;d/=2)
+  {
+    if((dinfo.image_width+d-1)/d >= tw && (dinfo.image_height+d-1)/d >= th)
+    {
+      dinfo.scale_denom = d;
+      break;
+    }
+  }
+  jpeg_start_decompress(&dinfo);
+  const uint32_t dw = dinfo.output_width, dh = dinfo.output_height;
+  img = malloc(3*(size_t)dw*dh);
+  while(dinfo.output_scanline < dh)
+  {
+    JSAMPROW row = img + 3*(size_t)dw*dinfo.output_scanline;
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+
+  float lin[256];
+  for(int i=0;i<256;i++) lin[i] = srgb_to_linear(i/255.0f);
+  const float M[] = { // linear srgb to rec2020
+    0.6274040f, 0.3292820f, 0.0433136f,
+    0.0690970f, 0.9195400f, 0.0113612f,
+    0.0163916f, 0.0880132f, 0.8955950f };
+  for(uint32_t j=0;j<th;j++)
+  {
+    const uint32_t y0 = j*(uint64_t)dh/th, y1 = MAX(y0+1, (j+1)*(uint64_t)dh/th);
+    for(uint32_t i=0;i<tw;i++)
+    {
+      const uint32_t x0 = i*(uint64_t)dw/tw, x1 = MAX(x0+1, (i+1)*(uint64_t)dw/tw);
+      float rgb[3] = {0.0f};
+      for(uint32_t y=y0;y<y1;y++) for(uint32_t x=x0;x<x1;x++)
+        for(int c=0;c<3;c++) rgb[c] += lin[img[3*(dw*(size_t)y+x)+c]];
+      const float norm = 1.0f/((x1-x0)*(y1-y0));
+      for(int c=0;c<3;c++)
+        out[3*(tw*(size_t)j+i)+c] = norm * (M[3*c+0]*rgb[0] + M[3*c+1]*rgb[1] + M[3*c+2]*rgb[2]);
+    }
+  }
+  free(img);
+  return 0;
+}
+
+int
+dt_preview_bc1(
+    const char *filename,
+    uint32_t    max_wd,
+    uint32_t    max_ht,
+    uint8_t   **bc1,
+    uint32_t   *wd,
+    uint32_t   *ht)
+{
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) return 1;
+  struct stat st;
+  if(fstat(fd, &st) || st.st_size < 16)
+  {
+    close(fd);
+    return 1;
+  }
+  const size_t size = st.st_size;
+  const uint8_t *buf = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(buf == MAP_FAILED) return 1;
+
+  int res = 1, ori = 1;
+  uint64_t off, len;
+  float *lin = 0;
+  uint8_t *rgba = 0;
+  if(dt_preview_find_jpeg(buf, size, MAX(max_wd, max_ht), &off, &len, &ori)) goto done;
+
+  uint32_t jw, jh;
+  if(jpeg_dimensions(buf + off, len, &jw, &jh)) goto done;
+  const int swap = ori >= 5; // rotated by 90 degrees
+  // fit into the box, in display orientation, and never scale up
+  const uint32_t dw = swap ? jh : jw, dh = swap ? jw : jh;
+  const float scale = MAX(1.0f, MAX(dw / (float)max_wd, dh / (float)max_ht));
+  const uint32_t ow = ((uint32_t)(dw / scale)) & ~3u, oh = ((uint32_t)(dh / scale)) & ~3u;
+  if(ow < 4 || oh < 4) goto done;
+  const uint32_t tw = swap ? oh : ow, th = swap ? ow : oh; // in jpeg orientation
+
+  lin  = malloc(sizeof(float)*3*tw*th);
+  rgba = malloc(4*(size_t)ow*oh);
+  if(preview_decode(buf + off, len, tw, th, lin)) goto done;
+
+  for(uint32_t y=0;y<oh;y++) for(uint32_t x=0;x<ow;x++)
+  {
+    uint32_t sx = x, sy = y;
+    switch(ori)
+    {
+      case 2: sx = tw-1-x; sy = y;      break;
+      case 3: sx = tw-1-x; sy = th-1-y; break;
+      case 4: sx = x;      sy = th-1-y; break;
+      case 5: sx = y;      sy = x;      break;
+      case 6: sx = y;      sy = th-1-x; break;
+      case 7: sx = tw-1-y; sy = th-1-x; break;
+      case 8: sx = tw-1-y; sy = x;      break;
+    }
+    const float *in = lin + 3*(tw*(size_t)sy+sx);
+    uint8_t *o = rgba + 4*(ow*(size_t)y+x);
+    for(int c=0;c<3;c++) o[c] = linear_to_srgb8(in[c]);
+    o[3] = 255;
+  }
+
+  *bc1 = malloc(8*(size_t)(ow/4)*(oh/4));
+  bc1_compress(*bc1, rgba, ow, oh, 0, 1); // small and we're on a worker already
+  *wd = ow;
+  *ht = oh;
+  res = 0;
+done:
+  free(lin);
+  free(rgba);
+  munmap((void *)buf, size);
+  return res;
+}
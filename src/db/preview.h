@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// fast path for the first thumbnails of freshly imported images: almost every
+// raw format embeds a jpeg preview. we walk the tiff ifds (including sub ifds
+// and exif) to find it, decode it at reduced dct scale, downsample and bc1
+// encode on the cpu. no graph, no demosaic. the result is meant to be replaced
+// by the real processed thumbnail later on.
+//
+// supported containers: tiff based raws (dng, nef, cr2, arw, orf, rw2, pef, ..),
+// fuji raf, and plain jpeg files.
+
+// find the embedded jpeg in the file contents in buf. if there are several, the
+// smallest one with a long edge of at least min_size is picked (or the largest
+// if there is no such). returns zero on success and fills offset, length and
+// the exif orientation (1..8) of the preview.
+int dt_preview_find_jpeg(
+    const uint8_t *buf,
+    size_t         size,
+    uint32_t       min_size,
+    uint64_t      *offset,
+    uint64_t      *length,
+    int           *orientation);
+
+// extract the preview of the given image file, scale it to fit into max_wd x
+// max_ht, apply the exif orientation and compress it to bc1 blocks, the same
+// encoding o-bc1 writes for thumbnails (rec2020 primaries, srgb trc).
+// wd and ht are multiples of four. returns zero on success, the caller
+// has to free(*bc1).
+int dt_preview_bc1(
+    const char *filename,
+    uint32_t    max_wd,
+    uint32_t    max_ht,
+    uint8_t   **bc1,
+    uint32_t   *wd,
+    uint32_t   *ht);
@@ -0,0 +1,117 @@
+#include "../preview.h"
+#include "core/core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <jpeglib.h>
+
+// encode a wd x ht jpeg, red on the left half and blue on the right
+static unsigned long
+make_jpeg(uint8_t **out, int wd, int ht)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  unsigned long size = 0;
+  *out = 0;
+  jpeg_mem_dest(&cinfo, out, &size);
+  cinfo.image_width = wd;
+  cinfo.image_height = ht;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 95, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  uint8_t *row = malloc(3*wd);
+  for(int i=0;i<wd;i++)
+  {
+    row[3*i+0] = i <  wd/2 ? 255 : 0;
+    row[3*i+1] = 0;
+    row[3*i+2] = i >= wd/2 ? 255 : 0;
+  }
+  while(cinfo.next_scanline < ht) jpeg_write_scanlines(&cinfo, &row, 1);
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(row);
+  return size;
+}
+
+static void
+put16(uint8_t *b, uint32_t v) { b[0] = v; b[1] = v >> 8; }
+static void
+put32(uint8_t *b, uint32_t v) { put16(b, v); put16(b+2, v >> 16); }
+
+static void
+put_entry(uint8_t *b, uint32_t tag, uint32_t type, uint32_t count, uint32_t val)
+{
+  put16(b, tag); put16(b+2, type); put32(b+4, count); put32(b+8, val);
+}
+
+// little endian tiff with orientation 6 in ifd0, a small jpeg thumbnail there
+// and a larger one in a sub ifd, the way nef and dng files look.
+static size_t
+make_tiff(uint8_t **out, const uint8_t *small, uint32_t small_size, const uint8_t *large, uint32_t large_size)
+{
+  const uint32_t ifd0 = 8, ifd1 = ifd0 + 2 + 4*12 + 4, data = ifd1 + 2 + 3*12 + 4;
+  const size_t size = data + small_size + large_size;
+  uint8_t *b = calloc(size, 1);
+  memcpy(b, "II*\0", 4);
+  put32(b+4, ifd0);
+  put16(b+ifd0, 4);
+  put_entry(b+ifd0+2+ 0, 0x0112, 3, 1, 6);
+  put_entry(b+ifd0+2+12, 0x014a, 4, 1, ifd1);
+  put_entry(b+ifd0+2+24, 0x0201, 4, 1, data);
+  put_entry(b+ifd0+2+36, 0x0202, 4, 1, small_size);
+  put16(b+ifd1, 3);
+  put_entry(b+ifd1+2+ 0, 0x0103, 3, 1, 7);
+  put_entry(b+ifd1+2+12, 0x0111, 4, 1, data + small_size);
+  put_entry(b+ifd1+2+24, 0x0117, 4, 1, large_size);
+  memcpy(b+data, small, small_size);
+  memcpy(b+data+small_size, large, large_size);
+  *out = b;
+  return size;
+}
+
+int main(int argc, char *arg[])
+{
+  uint8_t *small, *large, *tiff;
+  unsigned long small_size = make_jpeg(&small, 40, 20);
+  unsigned long large_size = make_jpeg(&large, 400, 200);
+  size_t size = make_tiff(&tiff, small, small_size, large, large_size);
+
+  uint64_t off, len;
+  int ori;
+  assert(!dt_preview_find_jpeg(tiff, size, 32, &off, &len, &ori));
+  assert(len == small_size && ori == 6);   // smallest that's large enough
+  assert(!dt_preview_find_jpeg(tiff, size, 128, &off, &len, &ori));
+  assert(len == large_size);
+  assert(!dt_preview_find_jpeg(tiff, size, 1024, &off, &len, &ori));
+  assert(len == large_size);               // nothing is large enough, take the largest
+  assert(dt_preview_find_jpeg(tiff, 16, 32, &off, &len, &ori)); // truncated
+  assert(!dt_preview_find_jpeg(large, large_size, 32, &off, &len, &ori));
+  assert(off == 0 && ori == 1);            // plain jpeg
+
+  const char *filename = "preview-test.tif";
+  FILE *f = fopen(filename, "wb");
+  fwrite(tiff, size, 1, f);
+  fclose(f);
+  uint8_t *bc1 = 0;
+  uint32_t wd, ht;
+  assert(!dt_preview_bc1(filename, 64, 64, &bc1, &wd, &ht));
+  assert(wd == 32 && ht == 64);            // rotated by 90 degrees and fit into the box
+  // sensor left (red) is at the top now, right (blue) at the bottom:
+  const uint8_t *top = bc1, *bottom = bc1 + 8*(wd/4)*(ht/4-1);
+  const uint16_t ct = top[0] | (top[1] << 8), cb = bottom[0] | (bottom[1] << 8);
+  assert((ct >> 11) > (ct & 31));
+  assert((cb >> 11) < (cb & 31));
+  free(bc1);
+  unlink(filename);
+
+  free(small);
+  free(large);
+  free(tiff);
+  exit(0);
+}
@@ -1,4 +0,0 @@
-#pragma once
-#include <stdint.h>
-
-void pqsort(uint64_t *id, uint64_t num);
@@ -1,28 +1,67 @@
 #include "threads.h"
-#include "qsort.h"
+#include "../pqsort.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include <time.h>
 
-int main()
+static double
+now()
 {
-  threads_global_init(); // init thread pool
-  const int N = 1000000;
-  uint64_t *arr = malloc(sizeof(uint64_t)*N);
-  for(int k=0;k<N;k++) arr[k] = ((uint64_t)lrand48() << 32) | lrand48();
-  clock_t t = clock();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  const dt_db_sort_t *sa = a, *sb = b;
+  if(sa->key < sb->key) return -1;
+  if(sa->key > sb->key) return  1;
+  return (int)sa->id - (int)sb->id;
+}
+
+// sort N keys with the given number of random bits above a shared prefix,
+// compare against qsort and check the order is stable.
+static void
+test(const int N, const int bits, const uint64_t prefix)
+{
+  dt_db_sort_t *arr = malloc(sizeof(dt_db_sort_t)*N);
+  dt_db_sort_t *ref = malloc(sizeof(dt_db_sort_t)*N);
+  for(int k=0;k<N;k++)
+  {
+    uint64_t r = ((uint64_t)lrand48() << 32) | lrand48();
+    if(bits < 64) r &= (1ul << bits) - 1;
+    arr[k] = (dt_db_sort_t){ .key = prefix | r, .id = k };
+  }
+  memcpy(ref, arr, sizeof(dt_db_sort_t)*N);
+  double t = now();
   pqsort(arr, N);
-  t = clock() - t;
-  fprintf(stderr, "time to sort %d entries %g s\n", N, t/(double)CLOCKS_PER_SEC);
-  for(int k=1;k<N;k++)
+  t = now() - t;
+  double tq = now();
+  qsort(ref, N, sizeof(ref[0]), compare);
+  tq = now() - tq;
+  fprintf(stderr, "time to sort %8d entries with %2d bits: %8.4f s (qsort %8.4f s)\n", N, bits, t, tq);
+  for(int k=0;k<N;k++)
   {
-    assert(arr[k] > arr[k-1]);
-    // fprintf(stderr, "%lu ", arr[k]);
+    assert(arr[k].key == ref[k].key);
+    assert(arr[k].id  == ref[k].id); // stable, ids are ascending in the input
   }
-  // fprintf(stderr, "\n");
   free(arr);
+  free(ref);
+}
+
+int main()
+{
+  threads_global_init(); // init thread pool
+  test(1000000, 64, 0);
+  test(1000000, 40, 20230000000000ul); // dates share leading digits
+  test(  50000, 16, 0);                // ratings and labels
+  test(  10000, 48, 0);                // below the parallel threshold
+  test(     37, 64, 0);
   threads_global_cleanup();
   exit(0);
 }
@@ -0,0 +1,105 @@
+// dispatch overhead and scaling of the thread pool for tiny work items:
+// one threads_task item per element vs chunked threads_parallel_for.
+#include "threads.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+typedef struct job_t
+{
+  float       *buf;
+  atomic_uint  cnt; // number of items processed, to check nothing got lost
+}
+job_t;
+
+static inline float
+item(uint32_t i)
+{
+  return sqrtf(i + 0.5f);
+}
+
+static void
+run_item(uint32_t i, void *data)
+{
+  job_t *job = data;
+  job->buf[i] = item(i);
+  job->cnt++;
+}
+
+static void
+run_range(uint32_t b, uint32_t e, void *data)
+{
+  job_t *job = data;
+  for(uint32_t i=b;i<e;i++) job->buf[i] = item(i);
+  job->cnt += e - b;
+}
+
+static void
+check(const job_t *job, uint32_t n, const char *what)
+{
+  int err = job->cnt != n;
+  for(uint32_t i=0;i<n&&!err;i++) if(job->buf[i] != item(i)) err = 1;
+  if(err) fprintf(stderr, "[%s] wrong result for %u items!\n", what, n);
+}
+
+int main(int argc, char *argv[])
+{
+  threads_global_init();
+  const int nt = threads_num();
+  fprintf(stderr, "%d threads\n", nt);
+  fprintf(stderr, "      items     serial   per item  par for 1k  par for 64k [ms]\n");
+  for(uint32_t n=1000;n<=10000000;n*=10)
+  {
+    job_t job = { .buf = malloc(sizeof(float)*n) };
+    double beg = now();
+    run_range(0, n, &job);
+    double t_serial = now() - beg;
+    check(&job, n, "serial");
+
+    // per item dispatch is too slow for the large sizes, don't wait forever
+    double t_item = -1.0;
+    if(n <= 1000000)
+    {
+      job.cnt = 0;
+      beg = now();
+      int taskid = -1;
+      for(int k=0;k<nt;k++)
+      {
+        int id = threads_task("bench", n, taskid, &job, run_item, 0);
+        if(id < 0) break;
+        taskid = id;
+      }
+      threads_wait(taskid);
+      t_item = now() - beg;
+      check(&job, n, "per item");
+    }
+
+    job.cnt = 0;
+    beg = now();
+    threads_parallel_for(0, n, 1<<10, run_range, &job);
+    double t_par1k = now() - beg;
+    check(&job, n, "par for 1k");
+
+    job.cnt = 0;
+    beg = now();
+    threads_parallel_for(0, n, 1<<16, run_range, &job);
+    double t_par64k = now() - beg;
+    check(&job, n, "par for 64k");
+
+    fprintf(stderr, "%11u %10.3f %10.3f %11.3f %12.3f\n",
+        n, 1e3*t_serial, 1e3*t_item, 1e3*t_par1k, 1e3*t_par64k);
+    free(job.buf);
+  }
+  threads_global_cleanup();
+  exit(0);
+}
@@ -0,0 +1,131 @@
+#include "../thumbarchive.h"
+#include "core/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static size_t
+file_size(const char *filename)
+{
+  struct stat sb;
+  assert(!stat(filename, &sb));
+  return sb.st_size;
+}
+
+static void
+fill(uint8_t *buf, uint32_t size, uint8_t v)
+{
+  for(uint32_t i=0;i<size;i++) buf[i] = v + i;
+}
+
+static int
+check(dt_thumbarchive_t *a, uint64_t hash, int64_t mtime, uint8_t v)
+{
+  dt_thumbarchive_entry_t e;
+  if(dt_thumbarchive_find(a, hash, &e) || e.mtime != mtime) return 1;
+  uint8_t *buf = malloc(e.size), *ref = malloc(e.size);
+  fill(ref, e.size, v);
+  int err = dt_thumbarchive_read(a, &e, buf) || memcmp(buf, ref, e.size);
+  free(buf);
+  free(ref);
+  return err;
+}
+
+int main(int argc, char *arg[])
+{
+  char dir[] = "/tmp/thumbarchive-XXXXXX";
+  assert(mkdtemp(dir));
+  char filename[1040];
+  snprintf(filename, sizeof(filename), "%s/thumbnails.bc1a", dir);
+  const uint32_t wd = 64, ht = 32, size = 8*(wd/4)*(ht/4);
+  uint8_t buf[8*(64/4)*(32/4)];
+
+  // append and find again
+  dt_thumbarchive_t a;
+  assert(!dt_thumbarchive_open(&a, dir));
+  for(int i=1;i<=100;i++)
+  {
+    fill(buf, size, i);
+    assert(!dt_thumbarchive_append(&a, i, 1000+i, wd, ht, buf, size));
+  }
+  for(int i=1;i<=100;i++) assert(!check(&a, i, 1000+i, i));
+  assert(check(&a, 101, 0, 0));
+  // supersede and delete
+  fill(buf, size, 7);
+  assert(!dt_thumbarchive_append(&a, 1, 2000, wd, ht, buf, size));
+  assert(!dt_thumbarchive_append(&a, 2, 0, 0, 0, 0, 0));
+  assert(!check(&a, 1, 2000, 7));
+  dt_thumbarchive_entry_t e = {0};
+  assert(dt_thumbarchive_find(&a, 2, &e) && e.hash == 2); // tombstone
+  dt_thumbarchive_close(&a);
+
+  // reopen sees the same
+  assert(!dt_thumbarchive_open(&a, dir));
+  assert(a.entry_cnt == 100);
+  assert(!check(&a, 1, 2000, 7));
+  assert(dt_thumbarchive_find(&a, 2, &e));
+  for(int i=3;i<=100;i++) assert(!check(&a, i, 1000+i, i));
+  dt_thumbarchive_close(&a);
+
+  // torn tail: a record header promising more data than there is, as left by a crashed writer
+  const size_t good = file_size(filename);
+  int fd = open(filename, O_WRONLY | O_APPEND);
+  assert(fd >= 0);
+  assert(write(fd, buf, 40) == 40);
+  close(fd);
+  assert(!dt_thumbarchive_open(&a, dir));
+  assert(file_size(filename) == good); // cut off
+  for(int i=3;i<=100;i++) assert(!check(&a, i, 1000+i, i));
+  fill(buf, size, 200);
+  assert(!dt_thumbarchive_append(&a, 200, 3000, wd, ht, buf, size));
+  dt_thumbarchive_close(&a);
+  assert(!dt_thumbarchive_open(&a, dir));
+  assert(!check(&a, 200, 3000, 200)); // appended after the good records, so it's indexed
+  dt_thumbarchive_close(&a);
+
+  // overwrite one thumbnail a lot, reopening compacts the dead records away
+  assert(!dt_thumbarchive_open(&a, dir));
+  for(int i=0;i<1000;i++)
+  {
+    fill(buf, size, i);
+    assert(!dt_thumbarchive_append(&a, 300, i, wd, ht, buf, size));
+  }
+  const size_t large = file_size(filename);
+  dt_thumbarchive_close(&a);
+  assert(!dt_thumbarchive_open(&a, dir));
+  assert(file_size(filename) < large/4);
+  assert(!check(&a, 300, 999, 999 & 0xff));
+  assert(!check(&a, 1, 2000, 7));
+  assert(!check(&a, 200, 3000, 200));
+  assert(dt_thumbarchive_find(&a, 2, &e)); // tombstones are gone, but so is the record
+  for(int i=3;i<=100;i++) assert(!check(&a, i, 1000+i, i));
+  dt_thumbarchive_close(&a);
+
+  // a foreign header is replaced by a new file, not truncated under others' feet
+  fd = open(filename, O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  memset(buf, 0xab, size);
+  assert(write(fd, buf, size) == size);
+  close(fd);
+  fd = open(filename, O_RDONLY);
+  const uint8_t *old = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  assert(old != MAP_FAILED);
+  assert(!dt_thumbarchive_open(&a, dir));
+  assert(a.entry_cnt == 0);
+  assert(old[size-1] == 0xab); // still mapped fine
+  munmap((void *)old, size);
+  close(fd);
+  fill(buf, size, 9);
+  assert(!dt_thumbarchive_append(&a, 9, 9000, wd, ht, buf, size));
+  assert(!check(&a, 9, 9000, 9));
+  dt_thumbarchive_close(&a);
+
+  unlink(filename);
+  rmdir(dir);
+  exit(0);
+}
@@ -0,0 +1,467 @@
+#include "db/thumbarchive.h"
+#include "core/log.h"
+#include "pipe/token.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <zlib.h>
+#ifndef _WIN64
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// on-disk layout: file header, followed by records. every record is a
+// record header followed by the bc1 blocks, padded to 8 bytes.
+typedef struct dt_thumbarchive_header_t
+{
+  uint64_t magic;    // dt_token("bc1a")
+  uint32_t version;  // 1
+  uint32_t pad;
+}
+dt_thumbarchive_header_t;
+
+typedef struct dt_thumbarchive_record_t
+{
+  uint32_t magic;    // first four bytes of dt_token("thmb"), to detect garbage
+  uint32_t size;     // size of the bc1 data in bytes
+  uint32_t wd, ht;   // dimensions in pixels
+  uint64_t hash;     // hash64() of the filename
+  int64_t  mtime;    // mtime of the .cfg file
+}
+dt_thumbarchive_record_t;
+
+#define DT_THUMBARCHIVE_VERSION 1
+#define DT_THUMBARCHIVE_RECORD_MAGIC ((uint32_t)dt_token("thmb"))
+
+static inline uint64_t
+record_size(uint32_t size)
+{
+  return sizeof(dt_thumbarchive_record_t) + ((size + 7ul) & ~7ul);
+}
+
+static void
+index_insert(
+    dt_thumbarchive_t             *a,
+    const dt_thumbarchive_entry_t *e)
+{
+  if(2*(a->entry_cnt+1) > a->entry_max)
+  { // grow and rehash, keep load factor below one half
+    dt_thumbarchive_entry_t *old = a->entry;
+    const uint32_t old_max = a->entry_max;
+    a->entry_max = old_max ? 2*old_max : 1024;
+    a->entry = calloc(sizeof(dt_thumbarchive_entry_t), a->entry_max);
+    a->entry_cnt = 0;
+    for(uint32_t i=0;i<old_max;i++)
+      if(old[i].hash) index_insert(a, old + i);
+    free(old);
+  }
+  uint32_t j = e->hash & (a->entry_max-1);
+  while(a->entry[j].hash && a->entry[j].hash != e->hash)
+    j = (j+1) & (a->entry_max-1);
+  if(!a->entry[j].hash) a->entry_cnt++;
+  else if(a->entry[j].size) a->live -= record_size(a->entry[j].size);
+  if(e->size) a->live += record_size(e->size);
+  a->entry[j] = *e; // later records supersede earlier ones
+}
+
+#ifndef _WIN64
+#define DT_THUMBARCHIVE_MAP_GROWTH (16ul<<20)
+
+// forget the mapping and the index, the next refresh() starts over
+static void
+drop(dt_thumbarchive_t *a)
+{
+  if(a->map) munmap(a->map, a->map_size);
+  free(a->entry);
+  a->map       = 0;
+  a->map_size  = 0;
+  a->file_size = 0;
+  a->scan_end  = sizeof(dt_thumbarchive_header_t);
+  a->live      = 0;
+  a->entry     = 0;
+  a->entry_max = 0;
+  a->entry_cnt = 0;
+}
+
+static int
+write_all(int fd, const void *buf, uint64_t len, uint64_t off)
+{
+  for(uint64_t w=0;w<len;)
+  {
+    ssize_t res = pwrite(fd, (const uint8_t *)buf + w, len - w, off + w);
+    if(res <= 0) return 1;
+    w += res;
+  }
+  return 0;
+}
+
+// index all complete records we haven't seen yet. the mapping is larger than
+// the file and only replaced once the file outgrows it, so appends don't cost
+// a new mmap() every time. needs to hold the mutex.
+static int
+refresh(dt_thumbarchive_t *a)
+{
+  struct stat sb;
+  if(fstat(a->fd, &sb)) return 1;
+  const size_t size = sb.st_size;
+  if(size == a->file_size) return 0; // nothing new
+  if(size < a->scan_end) drop(a);    // truncated behind our back, start over
+  a->file_size = size;
+  if(size < sizeof(dt_thumbarchive_header_t)) return 1;
+  if(size > a->map_size)
+  {
+    if(a->map) munmap(a->map, a->map_size);
+    a->map = 0;
+    size_t map_size = size > 2*a->map_size ? size : 2*a->map_size;
+    map_size = (map_size + DT_THUMBARCHIVE_MAP_GROWTH-1) & ~(DT_THUMBARCHIVE_MAP_GROWTH-1);
+    void *map = mmap(0, map_size, PROT_READ, MAP_SHARED, a->fd, 0);
+    if(map == MAP_FAILED)
+    {
+      drop(a);
+      return 1;
+    }
+    a->map = map;
+    a->map_size = map_size;
+  }
+  while(a->scan_end + sizeof(dt_thumbarchive_record_t) <= size)
+  {
+    const dt_thumbarchive_record_t *r = (const dt_thumbarchive_record_t *)(a->map + a->scan_end);
+    if(r->magic != DT_THUMBARCHIVE_RECORD_MAGIC) break; // garbage, cut off by the next recover()
+    if(a->scan_end + record_size(r->size) > size) break; // incomplete, being written
+    dt_thumbarchive_entry_t e = {
+      .hash   = r->hash,
+      .mtime  = r->mtime,
+      .offset = a->scan_end + sizeof(dt_thumbarchive_record_t),
+      .wd     = r->wd,
+      .ht     = r->ht,
+      .size   = r->size,
+    };
+    index_insert(a, &e);
+    a->scan_end += record_size(r->size);
+  }
+  return 0;
+}
+
+// move the temp file over the archive and continue with that one. others may
+// still have the old file mapped, so it is never truncated in place. needs to
+// hold the mutex and the flocks on both files, the one on fd is kept.
+static int
+replace(dt_thumbarchive_t *a, int fd, const char *tmpfile)
+{
+  if(fsync(fd) || rename(tmpfile, a->filename))
+  {
+    unlink(tmpfile);
+    close(fd);
+    return 1;
+  }
+  flock(a->fd, LOCK_UN);
+  close(a->fd);
+  a->fd = fd;
+  drop(a);
+  return 0;
+}
+
+// replace the archive by an empty one with a valid header
+static int
+reset(dt_thumbarchive_t *a)
+{
+  char tmpfile[sizeof(a->filename)+10];
+  snprintf(tmpfile, sizeof(tmpfile), "%s.temp", a->filename);
+  int fd = open(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return 1;
+  flock(fd, LOCK_EX);
+  const dt_thumbarchive_header_t hdr = { .magic = dt_token("bc1a"), .version = DT_THUMBARCHIVE_VERSION };
+  if(write_all(fd, &hdr, sizeof(hdr), 0))
+  {
+    unlink(tmpfile);
+    close(fd);
+    return 1;
+  }
+  return replace(a, fd, tmpfile);
+}
+
+// take the file lock and bring the index up to date. makes sure the file is
+// still the one behind our path (compaction in another process replaces it),
+// starts a new one if there is no valid header, and cuts off whatever follows
+// the last complete record: nobody is writing while we hold the lock, so this
+// has been left behind by a crashed writer. needs to hold the mutex, returns
+// zero with the flock held.
+static int
+recover(dt_thumbarchive_t *a)
+{
+  for(int i=0;;i++)
+  {
+    if(i == 4) return 1;
+    if(a->fd < 0) a->fd = open(a->filename, O_RDWR | O_CREAT, 0644);
+    if(a->fd < 0)
+    {
+      dt_log(s_log_err|s_log_db, "[thm] could not open thumbnail archive %s: %s", a->filename, strerror(errno));
+      return 1;
+    }
+    flock(a->fd, LOCK_EX);
+    struct stat sf, sp;
+    if(!fstat(a->fd, &sf) && !stat(a->filename, &sp) &&
+        sf.st_ino == sp.st_ino && sf.st_dev == sp.st_dev) break;
+    flock(a->fd, LOCK_UN); // replaced or deleted, open again by path
+    close(a->fd);
+    a->fd = -1;
+    drop(a);
+  }
+  dt_thumbarchive_header_t hdr = {0};
+  if(pread(a->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != dt_token("bc1a") || hdr.version != DT_THUMBARCHIVE_VERSION)
+  { // new or incompatible file, start over
+    if(reset(a))
+    {
+      dt_log(s_log_err|s_log_db, "[thm] could not initialise thumbnail archive %s!", a->filename);
+      flock(a->fd, LOCK_UN);
+      return 1;
+    }
+  }
+  if(refresh(a))
+  {
+    flock(a->fd, LOCK_UN);
+    return 1;
+  }
+  if(a->file_size > a->scan_end)
+  {
+    dt_log(s_log_db, "[thm] cutting off %zu bytes of incomplete records from %s",
+        a->file_size - a->scan_end, a->filename);
+    if(ftruncate(a->fd, a->scan_end))
+    {
+      flock(a->fd, LOCK_UN);
+      return 1;
+    }
+    a->file_size = a->scan_end;
+  }
+  return 0;
+}
+
+// rewrite the live records to a new file and move it over the old one, if
+// enough of the archive is dead. needs to hold the mutex and the flock
+// (recover() returned zero), which is then held on the new file.
+static void
+compact(dt_thumbarchive_t *a)
+{
+  const size_t dead = a->scan_end - sizeof(dt_thumbarchive_header_t) - a->live;
+  if(dead < (1ul<<20) || (dead < a->live && dead < (64ul<<20))) return;
+  char tmpfile[sizeof(a->filename)+10];
+  snprintf(tmpfile, sizeof(tmpfile), "%s.temp", a->filename);
+  int fd = open(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return;
+  flock(fd, LOCK_EX); // keep others out until we're done switching
+  const dt_thumbarchive_header_t hdr = { .magic = dt_token("bc1a"), .version = DT_THUMBARCHIVE_VERSION };
+  const uint64_t pad = 0;
+  uint64_t off = sizeof(hdr);
+  int err = write_all(fd, &hdr, sizeof(hdr), 0);
+  for(uint32_t i=0;i<a->entry_max && !err;i++)
+  {
+    const dt_thumbarchive_entry_t *e = a->entry + i;
+    if(!e->hash || !e->size) continue; // empty slots and tombstones go away
+    const dt_thumbarchive_record_t r = {
+      .magic = DT_THUMBARCHIVE_RECORD_MAGIC,
+      .size  = e->size,
+      .wd    = e->wd,
+      .ht    = e->ht,
+      .hash  = e->hash,
+      .mtime = e->mtime,
+    };
+    err = write_all(fd, &r, sizeof(r), off) ||
+          write_all(fd, a->map + e->offset, e->size, off + sizeof(r)) ||
+          write_all(fd, &pad, record_size(e->size) - sizeof(r) - e->size, off + sizeof(r) + e->size);
+    off += record_size(e->size);
+  }
+  if(err)
+  {
+    unlink(tmpfile);
+    close(fd);
+  }
+  if(err || replace(a, fd, tmpfile))
+  {
+    dt_log(s_log_err|s_log_db, "[thm] could not compact thumbnail archive %s!", a->filename);
+    return;
+  }
+  dt_log(s_log_db, "[thm] compacted thumbnail archive %s, removed %zu dead bytes", a->filename, dead);
+  refresh(a);
+}
+#endif
+
+int
+dt_thumbarchive_open(
+    dt_thumbarchive_t *a,
+    const char        *cachedir)
+{
+  memset(a, 0, sizeof(*a));
+  a->fd = -1;
+  threads_mutex_init(&a->mutex, 0);
+#ifdef _WIN64
+  return 1; // no mmap, use the separate .bc1 files
+#else
+  snprintf(a->filename, sizeof(a->filename), "%s/thumbnails.bc1a", cachedir);
+  drop(a);
+  threads_mutex_lock(&a->mutex);
+  int err = recover(a);
+  if(!err)
+  {
+    compact(a);
+    flock(a->fd, LOCK_UN);
+  }
+  else if(a->fd >= 0)
+  {
+    close(a->fd);
+    a->fd = -1;
+  }
+  threads_mutex_unlock(&a->mutex);
+  if(!err) dt_log(s_log_db, "[thm] thumbnail archive %s holds %u thumbnails", a->filename, a->entry_cnt);
+  return err;
+#endif
+}
+
+void
+dt_thumbarchive_close(
+    dt_thumbarchive_t *a)
+{
+#ifndef _WIN64
+  if(a->map) munmap(a->map, a->map_size);
+  if(a->fd >= 0) close(a->fd);
+#endif
+  free(a->entry);
+  threads_mutex_destroy(&a->mutex);
+  a->map = 0;
+  a->entry = 0;
+  a->fd = -1;
+}
+
+static inline int
+lookup(
+    dt_thumbarchive_t       *a,
+    uint64_t                 hash,
+    dt_thumbarchive_entry_t *e)
+{
+  if(!a->entry_max) return 1;
+  uint32_t j = hash & (a->entry_max-1);
+  while(a->entry[j].hash)
+  {
+    if(a->entry[j].hash == hash)
+    {
+      *e = a->entry[j];
+      return e->size == 0; // deleted?
+    }
+    j = (j+1) & (a->entry_max-1);
+  }
+  return 1;
+}
+
+int
+dt_thumbarchive_find(
+    dt_thumbarchive_t       *a,
+    uint64_t                 hash,
+    dt_thumbarchive_entry_t *e)
+{
+  int err = 1;
+  threads_mutex_lock(&a->mutex);
+  if(a->fd >= 0)
+  {
+#ifndef _WIN64
+    refresh(a); // pick up what others appended in the meantime, this is one fstat() if nothing changed
+#endif
+    err = lookup(a, hash, e);
+  }
+  threads_mutex_unlock(&a->mutex);
+  return err;
+}
+
+int
+dt_thumbarchive_read(
+    dt_thumbarchive_t             *a,
+    const dt_thumbarchive_entry_t *e,
+    void                          *dst)
+{
+  int err = 1;
+  threads_mutex_lock(&a->mutex);
+  dt_thumbarchive_entry_t cur;
+  // the index may have been rebuilt in the meantime, only trust offsets that are still current
+  if(a->map && !lookup(a, e->hash, &cur) && cur.offset == e->offset && cur.size == e->size &&
+      e->offset + e->size <= a->scan_end)
+  {
+    memcpy(dst, a->map + e->offset, e->size);
+    err = 0;
+  }
+  threads_mutex_unlock(&a->mutex);
+  return err;
+}
+
+int
+dt_thumbarchive_append(
+    dt_thumbarchive_t *a,
+    uint64_t           hash,
+    int64_t            mtime,
+    uint32_t           wd,
+    uint32_t           ht,
+    const void        *data,
+    uint32_t           size)
+{
+#ifdef _WIN64
+  return 1;
+#else
+  const uint64_t len = record_size(size);
+  uint8_t *buf = calloc(len, 1);
+  dt_thumbarchive_record_t *r = (dt_thumbarchive_record_t *)buf;
+  *r = (dt_thumbarchive_record_t) {
+    .magic = DT_THUMBARCHIVE_RECORD_MAGIC,
+    .size  = size,
+    .wd    = wd,
+    .ht    = ht,
+    .hash  = hash,
+    .mtime = mtime,
+  };
+  if(size) memcpy(buf + sizeof(*r), data, size);
+  int err = 1;
+  // the flock only keeps other processes out, threads share our file descriptor
+  threads_mutex_lock(&a->mutex);
+  if(a->fd >= 0 && !recover(a))
+  {
+    const uint64_t off = a->scan_end;
+    err = write_all(a->fd, buf, len, off);
+    if(err && ftruncate(a->fd, off)) {} // cut off partial record, if any
+    flock(a->fd, LOCK_UN);
+    if(!err) refresh(a);
+  }
+  threads_mutex_unlock(&a->mutex);
+  free(buf);
+  if(err) dt_log(s_log_err|s_log_db, "[thm] could not write to thumbnail archive %s!", a->filename);
+  return err;
+#endif
+}
+
+int
+dt_thumbarchive_append_bc1(
+    dt_thumbarchive_t *a,
+    uint64_t           hash,
+    int64_t            mtime,
+    const char        *bc1filename)
+{
+  uint32_t header[4] = {0};
+  gzFile f = gzopen(bc1filename, "rb");
+  if(!f) return 1;
+  if(gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4 ||
+     header[0] != dt_token("bc1z") || header[1] != 1)
+  {
+    gzclose(f);
+    return 1;
+  }
+  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
+  const uint32_t size = 8*(wd/4)*(ht/4);
+  uint8_t *buf = malloc(size);
+  int err = gzread(f, buf, size) != size;
+  gzclose(f);
+  if(!err) err = dt_thumbarchive_append(a, hash, mtime, wd, ht, buf, size);
+  free(buf);
+  return err;
+}
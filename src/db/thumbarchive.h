@@ -0,0 +1,87 @@
+#pragma once
+#include "core/threads.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// packed thumbnail archive. this is one append-only file in the cache directory,
+// ~/.cache/vkdt/thumbnails.bc1a, which holds raw (not gzipped) bc1 blocks for a
+// lot of images. it is memory mapped for reading, so loading a thumbnail is a
+// hash table lookup and a memcpy to the gpu staging buffer.
+//
+// records are keyed by hash64() of the .cfg filename and store the mtime of the
+// .cfg when the thumbnail was rendered. later records supersede earlier ones with
+// the same hash, records with zero bytes of data serve as tombstones.
+//
+// the file is shared between processes and threads: appending happens under
+// the mutex and an exclusive flock(), readers only ever index complete records.
+// when opening and before appending, a tail left incomplete by a crashed writer
+// is cut off. when opening finds more dead bytes (superseded records and
+// tombstones) than a threshold, the live records are rewritten to a new file
+// which replaces the old one. the others notice that and re-open by path.
+
+typedef struct dt_thumbarchive_entry_t
+{
+  uint64_t hash;    // hash64() of the filename
+  int64_t  mtime;   // mtime of the .cfg file this thumbnail was rendered from
+  uint64_t offset;  // offset of the bc1 data in the archive file
+  uint32_t wd;      // width in pixels, multiple of 4
+  uint32_t ht;      // height in pixels, multiple of 4
+  uint32_t size;    // size of the bc1 data in bytes, 0 means deleted
+}
+dt_thumbarchive_entry_t;
+
+typedef struct dt_thumbarchive_t
+{
+  char                     filename[1040];
+  int                      fd;         // file descriptor or -1 if not opened
+  uint8_t                 *map;        // read-only mapping of the file, may extend past its end
+  size_t                   map_size;   // size of the mapping, grows geometrically
+  size_t                   file_size;  // size of the file when we last looked
+  size_t                   scan_end;   // records up to this byte offset have been indexed
+  size_t                   live;       // bytes of records that are not superseded or deleted
+  dt_thumbarchive_entry_t *entry;      // open addressing hash table, keyed by hash
+  uint32_t                 entry_max;  // size of the table, power of two
+  uint32_t                 entry_cnt;  // number of occupied slots
+  threads_mutex_t          mutex;      // protects index and mapping
+}
+dt_thumbarchive_t;
+
+// open or create the archive in the given directory.
+// returns zero on success.
+int dt_thumbarchive_open(dt_thumbarchive_t *a, const char *cachedir);
+
+void dt_thumbarchive_close(dt_thumbarchive_t *a);
+
+// look up the most recent record for the given hash. returns zero if it has been
+// found and is not deleted. picks up records appended by others in the meantime.
+int dt_thumbarchive_find(
+    dt_thumbarchive_t       *a,
+    uint64_t                 hash,
+    dt_thumbarchive_entry_t *e);
+
+// copy the bc1 blocks of the given entry to dst, which needs to hold e->size bytes.
+// returns zero on success.
+int dt_thumbarchive_read(
+    dt_thumbarchive_t             *a,
+    const dt_thumbarchive_entry_t *e,
+    void                          *dst);
+
+// append a new record. pass size 0 to mark the thumbnail as deleted.
+// returns zero on success.
+int dt_thumbarchive_append(
+    dt_thumbarchive_t *a,
+    uint64_t           hash,
+    int64_t            mtime,
+    uint32_t           wd,
+    uint32_t           ht,
+    const void        *data,
+    uint32_t           size);
+
+// append the content of a gzipped .bc1 file as written by o-bc1.
+// returns zero on success.
+int dt_thumbarchive_append_bc1(
+    dt_thumbarchive_t *a,
+    uint64_t           hash,
+    int64_t            mtime,
+    const char        *bc1filename);
@@ -3,6 +3,7 @@
 #include "db/db.h"
 #include "db/thumbnails.h"
 #include "db/hash.h"
+#include "db/preview.h"
 #include "qvk/qvk.h"
 #include "pipe/graph-io.h"
 #include "pipe/graph-defaults.h"
@@ -17,6 +18,9 @@
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+
+#define DT_THUMBNAILS_MAX_MOVES 64 // thumbnails moved in one compaction batch
 
 #if 0
 void
@@ -39,13 +43,28 @@ debug_test_list(
 }
 #endif
 
+// one graph per four cores, but each one may hold a full raw image on the gpu.
+// budget a gigabyte of video memory for each.
+static int
+default_graph_cnt()
+{
+  uint64_t vram = 0;
+  for(uint32_t i=0;i<qvk.mem_properties.memoryHeapCount;i++)
+    if(qvk.mem_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      vram = MAX(vram, qvk.mem_properties.memoryHeaps[i].size);
+  const int by_cpu = threads_num() / 4;
+  const int by_gpu = vram >> 30;
+  return CLAMP(MIN(by_cpu, by_gpu), 1, DT_THUMBNAILS_MAX_GRAPHS);
+}
+
 VkResult
 dt_thumbnails_init(
     dt_thumbnails_t *tn,
     const int wd,
     const int ht,
     const int cnt,
-    const size_t heap_size)
+    const size_t heap_size,
+    const int graphs)
 {
   memset(tn, 0, sizeof(*tn));
 
@@ -60,18 +79,24 @@ dt_thumbnails_init(
   tn->thumb_wd = wd,
   tn->thumb_ht = ht,
   tn->thumb_max = cnt;
+  tn->preview = 1;
+  tn->preview_task = -1;
 
-  dt_graph_init(tn->graph + 0);
-  dt_graph_init(tn->graph + 1);
-  tn->graph[0].queue       =  qvk.queue_work0;
-  tn->graph[0].queue_idx   =  qvk.queue_idx_work0;
-  tn->graph[0].queue_mutex = &qvk.queue_mutex;
-  tn->graph[1].queue       =  qvk.queue_work1;
-  tn->graph[1].queue_idx   =  qvk.queue_idx_work1;
-  tn->graph[1].queue_mutex = &qvk.queue_mutex;
+  // not fatal, we'll fall back to individual .bc1 files:
+  dt_thumbarchive_open(&tn->archive, tn->cachedir);
 
-  threads_mutex_init(tn->graph_lock + 0, 0);
-  threads_mutex_init(tn->graph_lock + 1, 0);
+  tn->graph_cnt = graphs > 0 ? graphs : default_graph_cnt();
+  tn->graph_cnt = CLAMP(tn->graph_cnt, 1, DT_THUMBNAILS_MAX_GRAPHS);
+  for(int i=0;i<tn->graph_cnt;i++)
+  { // alternate between the two work queues, they share the mutex
+    dt_graph_init(tn->graph + i);
+    tn->graph[i].queue       = (i & 1) ? qvk.queue_work1     : qvk.queue_work0;
+    tn->graph[i].queue_idx   = (i & 1) ? qvk.queue_idx_work1 : qvk.queue_idx_work0;
+    tn->graph[i].queue_mutex = &qvk.queue_mutex;
+    threads_mutex_init(tn->graph_lock + i, 0);
+  }
+  threads_mutex_init(&tn->visible_lock, 0);
+  if(cnt == 0) dt_log(s_log_db, "using %d graphs for thumbnail creation", tn->graph_cnt);
 
   // just creating bc1 files in the background, not actually used to serve
   // any thumbnails:
@@ -80,8 +105,13 @@ dt_thumbnails_init(
   tn->thumb = malloc(sizeof(dt_thumbnail_t)*tn->thumb_max);
   memset(tn->thumb, 0, sizeof(dt_thumbnail_t)*tn->thumb_max);
   // need at least one extra slot to catch free block (if contiguous, else more)
-  // seems we sometimes get quite fragmented memory after long runs, be sure we can always split free memory:
-  dt_vkalloc_init(&tn->alloc, 3*tn->thumb_max, heap_size);
+  // seems we sometimes get quite fragmented memory after long runs, be sure we can always split free memory.
+  // thousands of thumbnails come and go here, so use the O(1) allocator:
+  if(dt_vkalloc_init_tlsf(&tn->alloc, 3*tn->thumb_max, heap_size))
+  {
+    dt_log(s_log_err|s_log_db, "could not allocate thumbnail memory pool!");
+    return VK_INCOMPLETE;
+  }
 
   // init lru list
   tn->lru = tn->thumb + 1; // [0] is special: busy bee
@@ -179,11 +209,14 @@ void
 dt_thumbnails_cleanup(
     dt_thumbnails_t *tn)
 {
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  for(int i=0;i<tn->graph_cnt;i++)
   {
     dt_graph_cleanup(tn->graph + i);
     pthread_mutex_destroy(tn->graph_lock + i);
   }
+  pthread_mutex_destroy(&tn->visible_lock);
+  free(tn->visible);
+  tn->visible = 0;
   for(int i=0;i<tn->thumb_max;i++)
   {
     if(tn->thumb[i].image)      vkDestroyImage    (qvk.device, tn->thumb[i].image,      0);
@@ -194,7 +227,10 @@ dt_thumbnails_cleanup(
   if(tn->dset_layout) vkDestroyDescriptorSetLayout(qvk.device, tn->dset_layout, 0);
   if(tn->dset_pool)   vkDestroyDescriptorPool     (qvk.device, tn->dset_pool,   0);
   if(tn->vkmem)       vkFreeMemory                (qvk.device, tn->vkmem,       0);
+  if(tn->staging)       vkDestroyBuffer           (qvk.device, tn->staging,       0);
+  if(tn->vkmem_staging) vkFreeMemory              (qvk.device, tn->vkmem_staging, 0);
   dt_vkalloc_cleanup(&tn->alloc);
+  dt_thumbarchive_close(&tn->archive);
 }
 
 void
@@ -206,6 +242,24 @@ dt_thumbnails_invalidate(
   char bc1filename[1040];
   snprintf(bc1filename, sizeof(bc1filename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
   unlink(bc1filename);
+  dt_thumbarchive_entry_t e;
+  if(!dt_thumbarchive_find(&tn->archive, hash, &e))
+    dt_thumbarchive_append(&tn->archive, hash, 0, 0, 0, 0, 0);
+}
+
+// move a .bc1 file as written by o-bc1 to the archive.
+// returns zero if the file has been consumed.
+static int
+archive_bc1(
+    dt_thumbnails_t *tn,
+    uint64_t         hash,
+    time_t           mtime,
+    const char      *bc1filename)
+{
+  if(tn->archive.fd < 0) return 1;
+  if(dt_thumbarchive_append_bc1(&tn->archive, hash, mtime, bc1filename)) return 1;
+  unlink(bc1filename);
+  return 0;
 }
 
 // process one image and write a .bc1 thumbnail
@@ -221,8 +275,9 @@ dt_thumbnails_cache_one(
   const char *f2 = filename + len - 4;
   if(strcasecmp(f2, ".cfg")) return VK_INCOMPLETE;
 
-  // use ~/.cache/vkdt/<hash-of-filename>.bc1 as output file name
-  // if that already exists with a newer timestamp than the cfg, bail out
+  // o-bc1 hands the blocks over in memory and we append them to the archive.
+  // without archive, write ~/.cache/vkdt/<hash-of-filename>.bc1 instead.
+  // if the archive already holds a thumbnail for the same cfg timestamp, bail out
 
   dt_token_t input_module = dt_graph_default_input_module(filename);
   char cfgfilename[PATH_MAX+100];
@@ -247,14 +302,23 @@ dt_thumbnails_cache_one(
     else return VK_INCOMPLETE;
   }
 
+  dt_thumbarchive_entry_t e;
+  if(!dt_thumbarchive_find(&tn->archive, hash, &e) && e.mtime >= tcfg)
+    return VK_SUCCESS; // already up to date
+
   if(!stat(bc1filename, &statbuf))
-  { // check timestamp
+  { // check timestamp of a bc1 from before we had the archive
     tbc1 = statbuf.st_mtime;
-    if(tcfg && (tbc1 >= tcfg)) return VK_SUCCESS; // already up to date
+    if(tcfg && (tbc1 >= tcfg))
+    {
+      archive_bc1(tn, hash, tcfg, bc1filename);
+      return VK_SUCCESS; // already up to date
+    }
   }
 
   dt_graph_reset(graph);
 
+  const int archived = tn->archive.fd >= 0;
   char *extrap[] = {
     "param:f2srgb:main:usemat:0", // write thumbnails as rec2020 with gamma
     "frames:1",                   // only render first frame of animation
@@ -271,7 +335,7 @@ dt_thumbnails_cache_one(
       .max_height = tn->thumb_ht,
       .mod        = dt_token("o-bc1"),
       .inst       = dt_token("main"),
-      .p_filename = bc1filename,
+      .p_filename = archived ? "" : bc1filename,
     }},
   };
 
@@ -281,75 +345,320 @@ dt_thumbnails_cache_one(
     dt_log(s_log_db, "[thm] running the thumbnail graph failed on image '%s'!", filename);
     // mark as dead
     snprintf(cfgfilename, sizeof(cfgfilename), "%s/data/bomb.bc1", dt_pipe.basedir);
-    fs_link(cfgfilename, bc1filename);
+    if(tn->archive.fd < 0 || dt_thumbarchive_append_bc1(&tn->archive, hash, tcfg, cfgfilename))
+      fs_link(cfgfilename, bc1filename);
     return 4;
   }
   clock_t end = clock();
   dt_log(s_log_perf, "[thm] ran graph in %3.0fms", 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  if(archived)
+  {
+    const int modid = dt_module_get(graph, dt_token("o-bc1"), dt_token("main"));
+    const uint32_t *blocks = modid >= 0 ? graph->module[modid].data : 0;
+    if(!blocks || // header as in the .bc1 file, followed by the blocks
+        dt_thumbarchive_append(&tn->archive, hash, tcfg, blocks[2], blocks[3], blocks+4, 8*(blocks[2]/4)*(blocks[3]/4)))
+      return VK_INCOMPLETE;
+  }
 
   return VK_SUCCESS;
 }
 
+VkResult
+dt_thumbnails_cache_preview(
+    dt_thumbnails_t *tn,
+    const char      *filename)
+{
+  int len = strnlen(filename, 2048);
+  if(len <= 4 || strcasecmp(filename + len - 4, ".cfg")) return VK_INCOMPLETE;
+  if(tn->archive.fd < 0) return VK_INCOMPLETE; // we couldn't mark it outdated otherwise
+
+  // only for freshly imported images: no history and no thumbnail at all, not even a deleted one
+  struct stat statbuf = {0};
+  if(!stat(filename, &statbuf)) return VK_INCOMPLETE;
+  uint64_t hash = hash64(filename);
+  dt_thumbarchive_entry_t e = {0};
+  if(!dt_thumbarchive_find(&tn->archive, hash, &e) || e.hash == hash) return VK_INCOMPLETE; // e.hash is set for deleted ones
+  char bc1filename[PATH_MAX+100];
+  snprintf(bc1filename, sizeof(bc1filename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
+  if(!stat(bc1filename, &statbuf)) return VK_INCOMPLETE;
+
+  char imgfilename[PATH_MAX];
+  snprintf(imgfilename, sizeof(imgfilename), "%.*s", len-4, filename);
+  uint8_t *bc1 = 0;
+  uint32_t wd = 0, ht = 0;
+  clock_t beg = clock();
+  if(dt_preview_bc1(imgfilename, tn->thumb_wd, tn->thumb_ht, &bc1, &wd, &ht)) return VK_INCOMPLETE;
+  clock_t end = clock();
+  dt_log(s_log_perf, "[thm] extracted preview in %3.0fms", 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  // mtime zero is older than any .cfg, so dt_thumbnails_cache_one() will replace it:
+  int err = dt_thumbarchive_append(&tn->archive, hash, 0, wd, ht, bc1, 8*(wd/4)*(ht/4));
+  free(bc1);
+  return err ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+// the list of images one task works on, shared by all its workers. instead of
+// going through it in order, workers claim images one at a time and take the
+// ones visible in the lighttable first (see dt_thumbnails_cache_prioritise()).
+// this way scrolling reorders the remaining work without aborting anything.
+typedef struct cache_list_t
+{
+  atomic_int           ref;
+  uint32_t             cnt;
+  uint32_t            *coll;      // image ids
+  uint32_t            *index;     // image id -> index into coll, or -1u
+  uint32_t             index_cnt;
+  _Atomic uint8_t     *state;     // per index: 0 pending, 1 in progress, 2 done
+  atomic_uint          cursor;    // everything before this has been claimed
+  atomic_int           stop;      // superseded by a newer list, don't claim anything
+  threads_mutex_t      mutex;     // io mutex handed to the graphs
+  pthread_cond_t       done;      // preview lists: signalled with mutex held when an image is done
+  struct cache_list_t *preview;   // the preview task on the same images, or 0
+}
+cache_list_t;
+
 typedef struct cache_coll_job_t
 {
-  uint64_t stamp;
-  threads_mutex_t mutex_storage;
+  uint32_t stamp;
   uint32_t gid;
-  threads_mutex_t *mutex;
   dt_thumbnails_t *tn;
   dt_db_t *db;
-  uint32_t *coll;
+  cache_list_t *list;
   void    (*ufn)(void);
 }
 cache_coll_job_t;
 
+static void
+cache_list_release(cache_list_t *l)
+{
+  if(!l || atomic_fetch_sub(&l->ref, 1) != 1) return;
+  cache_list_release(l->preview);
+  pthread_mutex_destroy(&l->mutex);
+  pthread_cond_destroy(&l->done);
+  free(l->coll);
+  free(l->index);
+  free((void *)l->state);
+  free(l);
+}
+
+static cache_list_t *
+cache_list_create(
+    dt_db_t        *db,
+    const uint32_t *imgid,
+    uint32_t        imgid_cnt)
+{
+  cache_list_t *l = calloc(1, sizeof(*l));
+  l->cnt   = imgid_cnt;
+  l->coll  = malloc(sizeof(uint32_t) * imgid_cnt);
+  memcpy(l->coll, imgid, sizeof(uint32_t) * imgid_cnt); // take copy because this thing changes
+  l->state = calloc(imgid_cnt, sizeof(uint8_t));
+  l->index_cnt = db->image_cnt;
+  l->index = malloc(sizeof(uint32_t) * l->index_cnt);
+  memset(l->index, 0xff, sizeof(uint32_t) * l->index_cnt);
+  for(uint32_t k=0;k<imgid_cnt;k++)
+    if(imgid[k] < l->index_cnt) l->index[imgid[k]] = k;
+  atomic_init(&l->ref, 1);
+  atomic_init(&l->cursor, 0);
+  atomic_init(&l->stop, 0);
+  threads_mutex_init(&l->mutex, 0);
+  pthread_cond_init(&l->done, 0);
+  return l;
+}
+
+static inline int
+cache_list_try(cache_list_t *l, uint32_t k)
+{
+  uint8_t pending = 0;
+  return atomic_compare_exchange_strong(&l->state[k], &pending, 1);
+}
+
+// claim the next image to work on: visible ones first, then in list order.
+// returns the index into the list or -1u if everything has been claimed.
+static uint32_t
+cache_list_claim(dt_thumbnails_t *tn, cache_list_t *l)
+{
+  uint32_t k = -1u;
+  if(atomic_load(&l->stop)) return k;
+  threads_mutex_lock(&tn->visible_lock);
+  for(uint32_t i=0;i<tn->visible_cnt&&k==-1u;i++)
+  {
+    const uint32_t id = tn->visible[i];
+    if(id < l->index_cnt && l->index[id] != -1u && cache_list_try(l, l->index[id]))
+      k = l->index[id];
+  }
+  threads_mutex_unlock(&tn->visible_lock);
+  if(k != -1u) return k;
+  while((k = atomic_fetch_add(&l->cursor, 1)) < l->cnt)
+    if(cache_list_try(l, k)) return k;
+  return -1u;
+}
+
 static void thread_free_coll(void *arg)
 {
   // task is done, every thread will call this
   cache_coll_job_t *j = arg;
-  // only first thread destroys shared things
-  if(j->gid == 0)
-  {
-    pthread_mutex_destroy(&j->mutex_storage);
-    free(j->coll);
-  }
+  cache_list_release(j->list); // last one destroys shared things
   free(j);
 }
 
+// stop the preview task of the last list: nothing new is claimed any more,
+// wait for the images that are being extracted right now.
+static void
+cache_preview_stop(dt_thumbnails_t *tn)
+{
+  cache_list_t *p = tn->preview_list;
+  if(p) atomic_store(&p->stop, 1);
+  if(tn->preview_task >= 0) threads_wait(tn->preview_task);
+  cache_list_release(p);
+  tn->preview_list = 0;
+  tn->preview_task = -1;
+}
+
 void
 dt_thumbnails_cache_abort(
     dt_thumbnails_t *tn)
 {
-  tn->job_timestamp++;
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  threads_cancel(&tn->job_token);
+  cache_preview_stop(tn); // remaining items are skipped now
+  for(int i=0;i<tn->graph_cnt;i++)
     threads_mutex_lock(tn->graph_lock+i);
   // now we hold all the locks at the same time. anyone picking up a lock after we return from here
   // will definitely see the new timestamp and abort immediately.
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  for(int i=0;i<tn->graph_cnt;i++)
     threads_mutex_unlock(tn->graph_lock+i);
 }
 
+void
+dt_thumbnails_cache_prioritise(
+    dt_thumbnails_t *tn,
+    const uint32_t  *imgid,
+    uint32_t         imgid_cnt)
+{
+  threads_mutex_lock(&tn->visible_lock);
+  if(imgid_cnt != tn->visible_cnt || memcmp(imgid, tn->visible, sizeof(uint32_t)*imgid_cnt))
+  {
+    if(imgid_cnt > tn->visible_max)
+    {
+      uint32_t *v = realloc(tn->visible, sizeof(uint32_t)*imgid_cnt);
+      if(v)
+      {
+        tn->visible = v;
+        tn->visible_max = imgid_cnt;
+      }
+    }
+    tn->visible_cnt = MIN(imgid_cnt, tn->visible_max);
+    memcpy(tn->visible, imgid, sizeof(uint32_t)*tn->visible_cnt);
+  }
+  threads_mutex_unlock(&tn->visible_lock);
+}
+
+// cheap first thumbnails from the embedded jpeg, no graph involved
+static void
+thread_work_preview(
+    uint32_t item, void *arg)
+{
+  cache_coll_job_t *j = arg;
+  if(threads_cancelled(&j->tn->job_token, j->stamp)) return;
+  cache_list_t *l = j->list;
+  const uint32_t k = cache_list_claim(j->tn, l);
+  if(k == -1u) return; // the graphs took over the rest
+  char filename[1024];
+  dt_db_image_path(j->db, l->coll[k], filename, sizeof(filename));
+  if(dt_thumbnails_cache_preview(j->tn, filename) == VK_SUCCESS)
+  {
+    threads_mutex_lock(&j->db->image_mutex);
+    j->db->image[l->coll[k]].thumbnail = 0;
+    threads_mutex_unlock(&j->db->image_mutex);
+    if(j->ufn) j->ufn();
+  }
+  threads_mutex_lock(&l->mutex);
+  atomic_store(&l->state[k], 2);
+  pthread_cond_broadcast(&l->done);
+  threads_mutex_unlock(&l->mutex);
+}
+
 static void
 thread_work_coll(
     uint32_t item, void *arg)
 {
   cache_coll_job_t *j = arg;
+  cache_list_t *l = j->list;
   threads_mutex_lock(j->tn->graph_lock+j->gid); // shield against potential overscheduling (call _cache_list() from the gui before the old one is done)
-  if(j->stamp != j->tn->job_timestamp) goto abort; // job invalid/stale, will not be able to access db any more!
-  j->tn->graph[j->gid].io_mutex = j->mutex;
+  if(threads_cancelled(&j->tn->job_token, j->stamp)) goto abort; // job invalid/stale, will not be able to access db any more!
+  const uint32_t k = cache_list_claim(j->tn, l);
+  if(k == -1u) goto abort;
+  const uint32_t id = l->coll[k];
+  if(l->preview && id < l->preview->index_cnt && l->preview->index[id] != -1u)
+  { // don't race the preview extraction for the same image. if it didn't start, it never will:
+    cache_list_t *p = l->preview;
+    const uint32_t pk = p->index[id];
+    if(cache_list_try(p, pk)) atomic_store(&p->state[pk], 2);
+    else
+    { // extracting right now, this takes a few milliseconds at most
+      threads_mutex_lock(&p->mutex);
+      while(atomic_load(&p->state[pk]) == 1)
+        pthread_cond_wait(&p->done, &p->mutex);
+      threads_mutex_unlock(&p->mutex);
+    }
+  }
+  j->tn->graph[j->gid].io_mutex = &l->mutex;
   char filename[1024];
-  dt_db_image_path(j->db, j->coll[item], filename, sizeof(filename));
+  dt_db_image_path(j->db, id, filename, sizeof(filename));
   (void) dt_thumbnails_cache_one(j->tn->graph + j->gid, j->tn, filename);
   // invalidate what we have in memory to trigger a reload:
   threads_mutex_lock(&j->db->image_mutex);
-  j->db->image[j->coll[item]].thumbnail = 0;
+  j->db->image[id].thumbnail = 0;
   threads_mutex_unlock(&j->db->image_mutex);
   j->tn->graph[j->gid].io_mutex = 0;
+  atomic_store(&l->state[k], 2);
   if(j->ufn) j->ufn();
 abort:
   threads_mutex_unlock(j->tn->graph_lock+j->gid);
 }
 
+// push one worker per graph on the list, returns the task id
+static int
+cache_list_push(
+    dt_thumbnails_t    *tn,
+    dt_db_t            *db,
+    cache_list_t       *list,
+    void              (*updatefn)(void),
+    void              (*run)(uint32_t, void *),
+    threads_priority_t  prio)
+{
+  int taskid = -1;
+  for(int k=0;k<tn->graph_cnt;k++)
+  {
+    cache_coll_job_t *job = malloc(sizeof(cache_coll_job_t));
+    *job = (cache_coll_job_t) {
+      .stamp = threads_token_gen(&tn->job_token),
+      .list  = list,
+      .gid   = k,
+      .tn    = tn,
+      .db    = db,
+      .ufn   = updatefn,
+    };
+    atomic_fetch_add(&list->ref, 1);
+    // we only care about internal errors. if we call with stupid values,
+    // it just does nothing and returns:
+    taskid = threads_task_prio(
+        "thumb",
+        list->cnt,
+        taskid,
+        job,
+        run,
+        thread_free_coll,
+        prio,
+        &tn->job_token);
+    if(taskid < 0)
+    {
+      thread_free_coll(job);
+      break;
+    }
+  }
+  cache_list_release(list); // drop our reference, the workers hold theirs
+  return taskid;
+}
+
 VkResult
 dt_thumbnails_cache_list(
     dt_thumbnails_t *tn,
@@ -364,47 +673,21 @@ dt_thumbnails_cache_list(
     return VK_INCOMPLETE;
   }
 
-  uint32_t *collection = malloc(sizeof(uint32_t) * imgid_cnt);
-  memcpy(collection, imgid, sizeof(uint32_t) * imgid_cnt); // take copy because this thing changes
-  cache_coll_job_t *job0 = 0;
-  int taskid = -1;
-  for(int k=0;k<DT_THUMBNAILS_THREADS;k++)
+  // the previews of the last list are for images we may not be looking at any more:
+  cache_preview_stop(tn);
+  cache_list_t *list = cache_list_create(db, imgid, imgid_cnt);
+  // extracting the embedded previews is quick, and the user is looking at the
+  // busy bees until we're done. so this goes first, at interactive priority:
+  if(tn->preview)
   {
-    cache_coll_job_t *job = malloc(sizeof(cache_coll_job_t));
-    if(k == 0)
-    {
-      *job = (cache_coll_job_t) {
-        .stamp = tn->job_timestamp,
-        .coll  = collection,
-        .gid   = k,
-        .tn    = tn,
-        .db    = db,
-        .ufn   = updatefn,
-      };
-      threads_mutex_init(&job->mutex_storage, 0);
-      job->mutex = &job->mutex_storage;
-      job0 = job;
-    }
-    else *job = (cache_coll_job_t) {
-      .stamp = tn->job_timestamp,
-      .mutex = &job0->mutex_storage,
-      .coll  = collection,
-      .gid   = k,
-      .tn    = tn,
-      .db    = db,
-      .ufn   = updatefn,
-    };
-    // we only care about internal errors. if we call with stupid values,
-    // it just does nothing and returns:
-    taskid = threads_task(
-        "thumb",
-        imgid_cnt,
-        taskid,
-        job,
-        thread_work_coll,
-        thread_free_coll);
-    if(taskid < 0) return VK_INCOMPLETE;
+    list->preview = cache_list_create(db, imgid, imgid_cnt);
+    atomic_fetch_add(&list->preview->ref, 2); // held by list and tn
+    tn->preview_list = list->preview;
+    tn->preview_task = cache_list_push(tn, db, list->preview, updatefn,
+        thread_work_preview, s_threads_prio_interactive);
   }
+  if(cache_list_push(tn, db, list, updatefn, thread_work_coll, s_threads_prio_thumbnail) < 0)
+    return VK_INCOMPLETE;
   return VK_SUCCESS;
 }
 
@@ -439,6 +722,8 @@ dt_thumbnails_load_list(
     if(imgid >= db->image_cnt) break; // safety first. this probably means this job is stale! big danger!
     dt_image_t *img = db->image + imgid;
     uint32_t tid = img->thumbnail;
+    if(tid > 0 && tid < tn->thumb_max && tn->thumb[tid].imgid != imgid)
+      tid = 0; // the slot has been evicted or handed to another image
     if(tid == 0)
     { // not loaded
       char filename[1024];
@@ -446,6 +731,7 @@ dt_thumbnails_load_list(
       uint32_t thumb_index = -1u;
       if(dt_thumbnails_load_one(tn, filename, &thumb_index) == VK_SUCCESS)
       {
+        tn->thumb[thumb_index].imgid = imgid;
         threads_mutex_lock(&db->image_mutex);
         img->thumbnail = thumb_index;
         threads_mutex_unlock(&db->image_mutex);
@@ -465,31 +751,60 @@ dt_thumbnails_load_list(
   }
 }
 
-// load a previously cached thumbnail to a VkImage onto the GPU.
-// returns VK_SUCCESS on success
-VkResult
-dt_thumbnails_load_one(
+// point the descriptor set of the thumbnail to the given image view
+static void
+thumbnail_write_dset(
+    dt_thumbnail_t *th,
+    VkImageView     image_view)
+{
+  VkDescriptorImageInfo img_info = {
+    .sampler       = th->wd > 32 ? qvk.tex_sampler : qvk.tex_sampler_nearest,
+    .imageView     = image_view,
+    .imageLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+  };
+  VkWriteDescriptorSet img_dset = {
+    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet          = th->dset,
+    .dstBinding      = 0,
+    .dstArrayElement = 0,
+    .descriptorCount = 1,
+    .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .pImageInfo      = &img_info,
+  };
+  vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+}
+
+// cache eviction: clean up memory in case there was something here.
+// the slot displays the busy bee until something else is loaded into it.
+static void
+thumbnail_evict(
     dt_thumbnails_t *tn,
-    const char      *filename,
-    uint32_t        *thumb_index)
+    dt_thumbnail_t  *th)
 {
-  dt_graph_t *graph = tn->graph;
-  char imgfilename[PATH_MAX] = {0};
-  if(strncmp(filename, "data/", 5))
-  { // only hash images that aren't straight from our resource directory:
-    // XXX run through realpath once for windows and / vs \\ confusion?
-    uint64_t hash = hash64(filename);
-    snprintf(imgfilename, sizeof(imgfilename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
+  if(th->image)      vkDestroyImage(qvk.device, th->image, VK_NULL_HANDLE);
+  if(th->image_view) vkDestroyImageView(qvk.device, th->image_view, VK_NULL_HANDLE);
+  th->image      = 0;
+  th->image_view = 0;
+  th->imgid      = -1u;
+  th->offset     = -1u;
+  if(th->mem)    dt_vkfree(&tn->alloc, th->mem);
+  th->mem        = 0;
+  // keep dset and prev/next dlist pointers! (i.e. don't memset th)
+  if(th != tn->thumb && tn->thumb[0].image_view)
+  {
+    th->wd = tn->thumb[0].wd;
+    th->ht = tn->thumb[0].ht;
+    thumbnail_write_dset(th, tn->thumb[0].image_view);
   }
-  else if(snprintf(imgfilename, sizeof(imgfilename), "%s/%s", dt_pipe.basedir, filename) >= sizeof(imgfilename)) return VK_INCOMPLETE;
-  struct stat statbuf = {0};
-  if(stat(imgfilename, &statbuf)) return VK_INCOMPLETE;
-
-  dt_graph_reset(graph);
-  int m0 = dt_module_add(graph, dt_token("i-bc1"), dt_token("main"));
-  int m1 = dt_module_add(graph, dt_token("thumb"), dt_token("main"));
-  dt_module_connect(graph, m0, 0, m1, 0);
+}
 
+// grab a thumbnail slot from the lru list (or reuse the given one)
+// and free whatever it held before.
+static dt_thumbnail_t *
+thumbnail_slot(
+    dt_thumbnails_t *tn,
+    uint32_t        *thumb_index)
+{
   dt_thumbnail_t *th = 0;
   if(*thumb_index == -1u)
   { // allocate thumbnail from lru list
@@ -504,43 +819,26 @@ dt_thumbnails_load_one(
   }
   else th = tn->thumb + *thumb_index;
 
-  // cache eviction:
-  // clean up memory in case there was something here:
-  if(th->image)      vkDestroyImage(qvk.device, th->image, VK_NULL_HANDLE);
-  if(th->image_view) vkDestroyImageView(qvk.device, th->image_view, VK_NULL_HANDLE);
-  th->image      = 0;
-  th->image_view = 0;
-  th->imgid      = -1u;
-  th->offset     = -1u;
-  if(th->mem)    dt_vkfree(&tn->alloc, th->mem);
-  th->mem        = 0;
-  // keep dset and prev/next dlist pointers! (i.e. don't memset th)
-
-  // set param for rawinput
-  // get module
-  dt_module_set_param_string(graph->module + m0, dt_token("filename"), imgfilename);
-
-  // run graph only up to roi computations to get size
-  // run all <= create nodes
-  dt_graph_run_t run = ~-(s_graph_run_create_nodes<<1);
-  if(dt_graph_run(graph, run) != VK_SUCCESS)
-  {
-    dt_log(s_log_err, "[thm] failed to run first half of graph!");
-    return VK_INCOMPLETE;
-  }
-
-  // now grab roi size from graph's main output node
-  th->wd = graph->module[m1].connector[0].roi.full_wd;
-  th->ht = graph->module[m1].connector[0].roi.full_ht;
+  thumbnail_evict(tn, th);
+  return th;
+}
 
-  VkFormat format = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+// create a bc1 VkImage of the given size, not bound to memory yet
+static VkResult
+thumbnail_new_image(
+    dt_thumbnails_t      *tn,
+    uint32_t              wd,
+    uint32_t              ht,
+    VkImage              *image,
+    VkMemoryRequirements *mem_req)
+{
   VkImageCreateInfo images_create_info = {
     .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
     .imageType = VK_IMAGE_TYPE_2D,
-    .format = format,
+    .format = VK_FORMAT_BC1_RGB_SRGB_BLOCK,
     .extent = {
-      .width  = th->wd,
-      .height = th->ht,
+      .width  = wd,
+      .height = ht,
       .depth  = 1
     },
     .mipLevels             = 1,
@@ -549,6 +847,7 @@ dt_thumbnails_load_one(
     .tiling                = VK_IMAGE_TILING_OPTIMAL,
     .usage                 =
         VK_IMAGE_ASPECT_COLOR_BIT
+      | VK_IMAGE_USAGE_TRANSFER_SRC_BIT // so we can move it around for compaction
       | VK_IMAGE_USAGE_TRANSFER_DST_BIT
       | VK_IMAGE_USAGE_SAMPLED_BIT,
     .sharingMode           = VK_SHARING_MODE_EXCLUSIVE,
@@ -556,32 +855,26 @@ dt_thumbnails_load_one(
     .pQueueFamilyIndices   = 0,
     .initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED,
   };
-
-  QVKR(vkCreateImage(qvk.device, &images_create_info, NULL, &th->image));
-  VkMemoryRequirements mem_req;
-  vkGetImageMemoryRequirements(qvk.device, th->image, &mem_req);
-  if(mem_req.memoryTypeBits != tn->memory_type_bits)
+  QVKR(vkCreateImage(qvk.device, &images_create_info, NULL, image));
+  vkGetImageMemoryRequirements(qvk.device, *image, mem_req);
+  if(mem_req->memoryTypeBits != tn->memory_type_bits)
     dt_log(s_log_qvk|s_log_err, "[thm] memory type bits don't match!");
+  tn->alignment = MAX(tn->alignment, mem_req->alignment);
+  return VK_SUCCESS;
+}
 
-  dt_vkmem_t *mem = dt_vkalloc(&tn->alloc, mem_req.size, mem_req.alignment);
-  if(!mem)
-  {
-    dt_log(s_log_err, "[thm] no more thumbnail gpu memory allocation possible!\n");
-    return VK_INCOMPLETE; // probably fragmented memory
-  }
-  // TODO: if (!mem) we have not enough memory! need to handle this now (more cache eviction?)
-  // TODO: could do batch cleanup in case we need memory:
-  // walk lru list from front and kill all contents (see above)
-  // but leave list as it is
-
-  assert(mem);
-  th->mem    = mem;
-  th->offset = mem->offset;
-
+// bind th->image to th->offset in our memory, create the image view and
+// write the descriptor set used for display.
+static VkResult
+thumbnail_bind_image(
+    dt_thumbnails_t *tn,
+    dt_thumbnail_t  *th)
+{
   VkImageViewCreateInfo images_view_create_info = {
     .sType      = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
     .viewType   = VK_IMAGE_VIEW_TYPE_2D,
-    .format     = format,
+    .format     = VK_FORMAT_BC1_RGB_SRGB_BLOCK,
+    .image      = th->image,
     .subresourceRange = {
       .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel   = 0,
@@ -590,27 +883,316 @@ dt_thumbnails_load_one(
       .layerCount     = 1
     },
   };
-  VkDescriptorImageInfo img_info = {
-    .sampler       = th->wd > 32 ? qvk.tex_sampler : qvk.tex_sampler_nearest,
-    .imageLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+  QVKR(vkBindImageMemory(qvk.device, th->image, tn->vkmem, th->offset));
+  QVKR(vkCreateImageView(qvk.device, &images_view_create_info, NULL, &th->image_view));
+  thumbnail_write_dset(th, th->image_view);
+  if(th == tn->thumb) // new busy bee, update all empty slots showing it
+    for(int i=1;i<tn->thumb_max;i++)
+      if(!tn->thumb[i].image) thumbnail_write_dset(tn->thumb+i, th->image_view);
+  return VK_SUCCESS;
+}
+
+// submit the command buffer borrowed from our graph and wait for it.
+// it's not running concurrently, the graph is only used from this thread.
+static VkResult
+thumbnail_submit(
+    dt_thumbnails_t *tn,
+    VkCommandBuffer  cmd_buf)
+{
+  dt_graph_t *graph = tn->graph;
+  QVKR(vkEndCommandBuffer(cmd_buf));
+  VkSubmitInfo submit = {
+    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers    = &cmd_buf,
   };
-  VkWriteDescriptorSet img_dset = {
-    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-    .dstBinding      = 0,
-    .dstArrayElement = 0,
-    .descriptorCount = 1,
-    .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-    .pImageInfo      = &img_info,
+  vkResetFences(qvk.device, 1, &graph->command_fence[0]);
+  QVKLR(graph->queue_mutex, vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[0]));
+  QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[0], VK_TRUE, ((uint64_t)1)<<40));
+  return VK_SUCCESS;
+}
+
+// compact the heap: move a batch of thumbnails from the top down into the
+// holes below them. all copies go into one command buffer with one submit.
+// returns VK_INCOMPLETE if nothing could be moved.
+static VkResult
+thumbnail_compact(
+    dt_thumbnails_t *tn)
+{
+  dt_vkmem_t *src[DT_THUMBNAILS_MAX_MOVES], *dst[DT_THUMBNAILS_MAX_MOVES];
+  const int cnt = dt_vkalloc_compact(&tn->alloc, tn->alignment, src, dst, DT_THUMBNAILS_MAX_MOVES);
+  if(!cnt) return VK_INCOMPLETE;
+  dt_thumbnail_t *th[DT_THUMBNAILS_MAX_MOVES] = {0};
+  for(int i=0;i<tn->thumb_max;i++) if(tn->thumb[i].mem)
+    for(int m=0;m<cnt;m++) if(tn->thumb[i].mem == src[m]) th[m] = tn->thumb + i;
+
+  // these are the most recent thumbnails, probably on screen right now. we're
+  // going to rewrite their descriptor sets and destroy the old images:
+  QVKL(&qvk.queue_mutex, vkDeviceWaitIdle(qvk.device));
+  VkCommandBuffer cmd_buf = tn->graph->command_buffer[0];
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
   };
+  VkResult res = vkBeginCommandBuffer(cmd_buf, &begin_info);
+  if(res != VK_SUCCESS)
+  {
+    for(int m=0;m<cnt;m++) dt_vkfree(&tn->alloc, dst[m]);
+    return res;
+  }
+  VkImage     old_image[DT_THUMBNAILS_MAX_MOVES] = {0};
+  VkImageView old_view [DT_THUMBNAILS_MAX_MOVES] = {0};
+  int moved = 0;
+  for(int m=0;m<cnt;m++)
+  {
+    VkImage image = 0;
+    VkMemoryRequirements mem_req;
+    int ok = th[m] && th[m]->image && thumbnail_new_image(tn, th[m]->wd, th[m]->ht, &image, &mem_req) == VK_SUCCESS &&
+       mem_req.size <= dst[m]->size && !(dst[m]->offset & (mem_req.alignment-1));
+    if(ok)
+    {
+      old_image[m] = th[m]->image;
+      old_view [m] = th[m]->image_view;
+      th[m]->image      = image;
+      th[m]->image_view = 0;
+      th[m]->mem        = dst[m];
+      th[m]->offset     = dst[m]->offset;
+      if(thumbnail_bind_image(tn, th[m]) != VK_SUCCESS)
+      { // the descriptor set is written last, it still shows the old image
+        if(th[m]->image_view) vkDestroyImageView(qvk.device, th[m]->image_view, VK_NULL_HANDLE);
+        th[m]->image      = old_image[m];
+        th[m]->image_view = old_view[m];
+        th[m]->mem        = src[m];
+        th[m]->offset     = src[m]->offset;
+        ok = 0;
+      }
+    }
+    if(!ok)
+    { // can't move this one, leave it where it was
+      if(image) vkDestroyImage(qvk.device, image, VK_NULL_HANDLE);
+      dt_vkfree(&tn->alloc, dst[m]);
+      src[m] = 0;
+      continue;
+    }
+    VkImageCopy region = {
+      .srcSubresource = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .layerCount = 1 },
+      .dstSubresource = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .layerCount = 1 },
+      .extent         = { th[m]->wd, th[m]->ht, 1 },
+    };
+    BARRIER_IMG_LAYOUT(old_image[m], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    BARRIER_IMG_LAYOUT(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    vkCmdCopyImage(cmd_buf,
+        old_image[m], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        image,        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    BARRIER_IMG_LAYOUT(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    moved++;
+  }
+  res = thumbnail_submit(tn, cmd_buf);
+  if(res != VK_SUCCESS)
+  { // the copies didn't go through, go back to the old images
+    for(int m=0;m<cnt;m++) if(src[m])
+    {
+      vkDestroyImageView(qvk.device, th[m]->image_view, VK_NULL_HANDLE);
+      vkDestroyImage    (qvk.device, th[m]->image,      VK_NULL_HANDLE);
+      th[m]->image      = old_image[m];
+      th[m]->image_view = old_view[m];
+      th[m]->mem        = src[m];
+      th[m]->offset     = src[m]->offset;
+      thumbnail_write_dset(th[m], old_view[m]);
+      if(th[m] == tn->thumb) // the busy bee is shown in all empty slots
+        for(int i=1;i<tn->thumb_max;i++)
+          if(!tn->thumb[i].image) thumbnail_write_dset(tn->thumb+i, old_view[m]);
+      dt_vkfree(&tn->alloc, dst[m]);
+    }
+    return res;
+  }
 
-  // bind image memory, create image view and descriptor set (used to display later on):
-  vkBindImageMemory(qvk.device, th->image, tn->vkmem, th->offset);
-  images_view_create_info.image = th->image;
-  QVKR(vkCreateImageView(qvk.device, &images_view_create_info, NULL, &th->image_view));
+  for(int m=0;m<cnt;m++) if(src[m])
+  {
+    vkDestroyImageView(qvk.device, old_view[m],  VK_NULL_HANDLE);
+    vkDestroyImage    (qvk.device, old_image[m], VK_NULL_HANDLE);
+    dt_vkfree(&tn->alloc, src[m]);
+  }
+  return moved ? VK_SUCCESS : VK_INCOMPLETE;
+}
 
-  img_dset.dstSet    = th->dset;
-  img_info.imageView = th->image_view;
-  vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+// find memory for a thumbnail image. if the heap is full or too fragmented,
+// evict least recently used thumbnails until there is enough free memory in
+// total, and compact the heap once. if that isn't enough, evict more.
+static dt_vkmem_t *
+thumbnail_alloc(
+    dt_thumbnails_t      *tn,
+    dt_thumbnail_t       *th,   // the thumbnail we allocate for, don't evict
+    VkMemoryRequirements *mem_req)
+{
+  dt_vkmem_t *mem = dt_vkalloc(&tn->alloc, mem_req->size, mem_req->alignment);
+  if(mem) return mem;
+
+  int evicted = 0, compacted = 0;
+  dt_thumbnail_t *l = tn->lru;
+  for(;l && tn->alloc.heap_size - tn->alloc.rss < mem_req->size + mem_req->alignment;l=l->next)
+  { // batch eviction until we have enough memory
+    if(l == th || !l->mem) continue;
+    thumbnail_evict(tn, l);
+    evicted++;
+  }
+  while(!(mem = dt_vkalloc(&tn->alloc, mem_req->size, mem_req->alignment)))
+  {
+    if(!compacted++ && thumbnail_compact(tn) == VK_SUCCESS)
+      continue; // enough memory but in pieces
+    // evicting merges the holes, too
+    while(l && (l == th || !l->mem)) l = l->next;
+    if(!l) break;
+    thumbnail_evict(tn, l);
+    evicted++;
+  }
+  dt_log(s_log_db, "[thm] evicted %d thumbnails%s to make room", evicted, compacted ? " and compacted the heap" : "");
+  return mem;
+}
+
+// create the bc1 VkImage for th->wd x th->ht, bind it to our memory
+// and write the descriptor set used for display.
+static VkResult
+thumbnail_create_image(
+    dt_thumbnails_t *tn,
+    dt_thumbnail_t  *th)
+{
+  VkMemoryRequirements mem_req;
+  QVKR(thumbnail_new_image(tn, th->wd, th->ht, &th->image, &mem_req));
+
+  dt_vkmem_t *mem = thumbnail_alloc(tn, th, &mem_req);
+  if(!mem)
+  {
+    dt_log(s_log_err, "[thm] no more thumbnail gpu memory allocation possible!");
+    return VK_INCOMPLETE;
+  }
+  th->mem    = mem;
+  th->offset = mem->offset;
+  return thumbnail_bind_image(tn, th);
+}
+
+// make sure our staging buffer holds at least size bytes
+static VkResult
+thumbnail_staging(
+    dt_thumbnails_t *tn,
+    uint64_t         size)
+{
+  if(tn->staging_size >= size) return VK_SUCCESS;
+  if(tn->staging)       vkDestroyBuffer(qvk.device, tn->staging,       0);
+  if(tn->vkmem_staging) vkFreeMemory   (qvk.device, tn->vkmem_staging, 0);
+  tn->staging = 0;
+  tn->vkmem_staging = 0;
+  tn->staging_size = 0;
+  size = MAX(size, tn->thumb_wd * (uint64_t)tn->thumb_ht / 2); // bc1 is 4 bits per pixel
+  VkBufferCreateInfo buffer_info = {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size        = size,
+    .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  QVKR(vkCreateBuffer(qvk.device, &buffer_info, 0, &tn->staging));
+  VkMemoryRequirements mem_req;
+  vkGetBufferMemoryRequirements(qvk.device, tn->staging, &mem_req);
+  VkMemoryAllocateInfo mem_alloc_info = {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = mem_req.size,
+    .memoryTypeIndex = qvk_get_memory_type(mem_req.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+  };
+  QVKR(vkAllocateMemory(qvk.device, &mem_alloc_info, 0, &tn->vkmem_staging));
+  QVKR(vkBindBufferMemory(qvk.device, tn->staging, tn->vkmem_staging, 0));
+  tn->staging_size = size;
+  return VK_SUCCESS;
+}
+
+// upload bc1 blocks straight from the memory mapped archive, no graph involved.
+static VkResult
+thumbnail_load_archived(
+    dt_thumbnails_t               *tn,
+    const dt_thumbarchive_entry_t *e,
+    uint32_t                      *thumb_index)
+{
+  if(e->wd == 0 || e->ht == 0 || e->size < 8*(e->wd/4)*(e->ht/4)) return VK_INCOMPLETE;
+  QVKR(thumbnail_staging(tn, e->size));
+  uint8_t *mapped = 0;
+  QVKR(vkMapMemory(qvk.device, tn->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+  int err = dt_thumbarchive_read(&tn->archive, e, mapped);
+  vkUnmapMemory(qvk.device, tn->vkmem_staging);
+  if(err) return VK_INCOMPLETE;
+
+  dt_thumbnail_t *th = thumbnail_slot(tn, thumb_index);
+  th->wd = e->wd;
+  th->ht = e->ht;
+  QVKR(thumbnail_create_image(tn, th));
+
+  // borrow command buffer and fence from our graph, it's not running concurrently:
+  dt_graph_t *graph = tn->graph;
+  VkCommandBuffer cmd_buf = graph->command_buffer[0];
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  QVKR(vkBeginCommandBuffer(cmd_buf, &begin_info));
+  VkBufferImageCopy region = {
+    .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+    .imageSubresource.layerCount = 1,
+    .imageExtent = { th->wd, th->ht, 1 },
+  };
+  BARRIER_IMG_LAYOUT(th->image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  vkCmdCopyBufferToImage(cmd_buf, tn->staging, th->image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+  BARRIER_IMG_LAYOUT(th->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  return thumbnail_submit(tn, cmd_buf);
+}
+
+// load a previously cached thumbnail to a VkImage onto the GPU.
+// returns VK_SUCCESS on success
+VkResult
+dt_thumbnails_load_one(
+    dt_thumbnails_t *tn,
+    const char      *filename,
+    uint32_t        *thumb_index)
+{
+  dt_graph_t *graph = tn->graph;
+  char imgfilename[PATH_MAX] = {0};
+  if(strncmp(filename, "data/", 5))
+  { // only hash images that aren't straight from our resource directory:
+    // XXX run through realpath once for windows and / vs \\ confusion?
+    uint64_t hash = hash64(filename);
+    dt_thumbarchive_entry_t e;
+    if(!dt_thumbarchive_find(&tn->archive, hash, &e))
+      return thumbnail_load_archived(tn, &e, thumb_index);
+    snprintf(imgfilename, sizeof(imgfilename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
+  }
+  else if(snprintf(imgfilename, sizeof(imgfilename), "%s/%s", dt_pipe.basedir, filename) >= sizeof(imgfilename)) return VK_INCOMPLETE;
+  struct stat statbuf = {0};
+  if(stat(imgfilename, &statbuf)) return VK_INCOMPLETE;
+
+  dt_graph_reset(graph);
+  int m0 = dt_module_add(graph, dt_token("i-bc1"), dt_token("main"));
+  int m1 = dt_module_add(graph, dt_token("thumb"), dt_token("main"));
+  dt_module_connect(graph, m0, 0, m1, 0);
+
+  dt_thumbnail_t *th = thumbnail_slot(tn, thumb_index);
+
+  // set param for rawinput
+  // get module
+  dt_module_set_param_string(graph->module + m0, dt_token("filename"), imgfilename);
+
+  // run graph only up to roi computations to get size
+  // run all <= create nodes
+  dt_graph_run_t run = ~-(s_graph_run_create_nodes<<1);
+  if(dt_graph_run(graph, run) != VK_SUCCESS)
+  {
+    dt_log(s_log_err, "[thm] failed to run first half of graph!");
+    return VK_INCOMPLETE;
+  }
+
+  // now grab roi size from graph's main output node
+  th->wd = graph->module[m1].connector[0].roi.full_wd;
+  th->ht = graph->module[m1].connector[0].roi.full_ht;
+
+  QVKR(thumbnail_create_image(tn, th));
 
   // now run the rest of the graph and copy over VkImage
   // let graph render into our thumbnail:
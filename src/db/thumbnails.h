@@ -2,6 +2,7 @@
 
 #include "pipe/graph.h"
 #include "pipe/alloc.h"
+#include "db/thumbarchive.h"
 #include "core/threads.h"
 
 #include <vulkan/vulkan.h>
@@ -16,7 +17,8 @@
 //
 // create thumbnails and default history here
 // /<full path from root>/imgname.raw.cfg
-// ~/.cache/vkdt/imgnamehash.bc1
+// ~/.cache/vkdt/thumbnails.bc1a (see thumbarchive.h)
+// ~/.cache/vkdt/imgnamehash.bc1 is only written temporarily by the o-bc1 module
 
 typedef struct dt_db_t dt_db_t;
 typedef struct dt_thumbnail_t
@@ -28,24 +30,33 @@ typedef struct dt_thumbnail_t
   uint64_t               offset;
   struct dt_thumbnail_t *prev;    // dlist for lru cache
   struct dt_thumbnail_t *next;
-  uint32_t               imgid;   // index into images->image[] or -1u
+  uint32_t               imgid;   // index into images->image[] or -1u if evicted
   uint32_t               wd;
   uint32_t               ht;
 }
 dt_thumbnail_t;
 
-#define DT_THUMBNAILS_THREADS 2
+#define DT_THUMBNAILS_MAX_GRAPHS 8
 typedef struct dt_thumbnails_t
 {
-  dt_graph_t            graph[DT_THUMBNAILS_THREADS];
-  threads_mutex_t       graph_lock[DT_THUMBNAILS_THREADS]; // needed for overscheduling thumbnail creation
-  uint64_t              job_timestamp;
+  dt_graph_t            graph[DT_THUMBNAILS_MAX_GRAPHS];
+  threads_mutex_t       graph_lock[DT_THUMBNAILS_MAX_GRAPHS]; // needed for overscheduling thumbnail creation
+  int                   graph_cnt;    // number of graphs rendering thumbnails in parallel
+  threads_token_t       job_token;    // cancels thumbnail jobs when the collection goes away
+  int                   preview;      // extract embedded jpeg previews before running the graphs
+  int                   preview_task; // task extracting previews for the last list, or -1
+  struct cache_list_t  *preview_list; // the images of that task, to stop it when a new list comes in
+
+  threads_mutex_t       visible_lock; // protects the visible list, read by the workers when picking the next image
+  uint32_t             *visible;      // image ids currently visible in the lighttable, rendered first
+  uint32_t              visible_cnt, visible_max;
 
   int                   thumb_wd;
   int                   thumb_ht;
 
   dt_vkalloc_t          alloc;
   uint32_t              memory_type_bits;
+  uint64_t              alignment;    // largest image alignment seen, to move images for compaction
   VkDeviceMemory        vkmem;
   VkDescriptorPool      dset_pool;
   VkDescriptorSetLayout dset_layout;
@@ -56,6 +67,11 @@ typedef struct dt_thumbnails_t
   dt_thumbnail_t       *lru;   // least recently used thumbnail, delete this first
   dt_thumbnail_t       *mru;   // most  recently used thumbnail, append here
 
+  dt_thumbarchive_t     archive;       // packed bc1 thumbnails on disk
+  VkBuffer              staging;       // to upload thumbnails from the archive without a graph
+  VkDeviceMemory        vkmem_staging;
+  uint64_t              staging_size;
+
   char                  cachedir[1024];
 }
 dt_thumbnails_t;
@@ -67,7 +83,8 @@ VkResult dt_thumbnails_init(
     const int wd,            // max width of thumbnail
     const int ht,            // max height of thumbnail
     const int cnt,           // max number of thumbnails
-    const size_t heap_size); // max heap size in bytes (allocated on GPU)
+    const size_t heap_size,  // max heap size in bytes (allocated on GPU)
+    const int graphs);       // number of graphs for background rendering, 0 picks one by cpu cores and gpu memory
 
 // free all resources
 void dt_thumbnails_cleanup(dt_thumbnails_t *tn);
@@ -84,6 +101,14 @@ VkResult dt_thumbnails_cache_list(
     uint32_t         imgid_cnt,        // number of image ids in list
     void           (*updatefn)(void)); // function to call after every render (or 0)
 
+// extract the embedded jpeg preview of the image behind the given .cfg file
+// and put it into the archive, marked as outdated so the graph will replace it
+// later. only done for images which have neither a .cfg nor a thumbnail yet.
+// runs in this thread. returns VK_SUCCESS if a new thumbnail has been stored.
+VkResult dt_thumbnails_cache_preview(
+    dt_thumbnails_t *tn,
+    const char      *filename);
+
 // create bc1 thumbnail only for given image
 // runs in this thread.
 // only accepting .cfg files here (can be non-existent and will be replaced in such case)
@@ -92,6 +117,14 @@ VkResult dt_thumbnails_cache_one(
     dt_thumbnails_t *tn,
     const char      *filename);
 
+// render the thumbnails of these images first. can be called every frame with
+// the visible range of the lighttable, the background threads will pick it up
+// for the next image they start, without aborting work in progress.
+void dt_thumbnails_cache_prioritise(
+    dt_thumbnails_t *tn,
+    const uint32_t  *imgid,       // image ids, in order of importance (will be copied)
+    uint32_t         imgid_cnt);
+
 // abort the caching in background threads. blocks until we're sure we're safe
 // (may have to wait for a thumbnail or two to finish rendering).
 void dt_thumbnails_cache_abort( dt_thumbnails_t *tn);
@@ -112,7 +145,7 @@ dt_thumbnails_load_list(
     uint32_t         beg,          // update collection[k] with k in [beg, end)
     uint32_t         end);         // 
 
-// explitly delete the cached bc1 thumbnail in ~/.cache/vkdt/
+// explitly delete the cached bc1 thumbnail in ~/.cache/vkdt/ (marks it deleted in the archive)
 void
 dt_thumbnails_invalidate(
     dt_thumbnails_t *tn,
@@ -237,6 +237,7 @@ darkroom_enter()
 
   dt_graph_init(&vkdt.graph_dev);
   vkdt.graph_dev.gui_attached = 1;
+  vkdt.graph_dev.cache_intermediate = dt_rc_get_int(&vkdt.rc, "gui/cache_intermediate", 1);
   dt_graph_history_init(&vkdt.graph_dev);
 
   if(dt_graph_read_config_ascii(&vkdt.graph_dev, graph_cfg))
@@ -314,6 +315,8 @@ darkroom_leave()
       &imgid, 1,
       &glfwPostEmptyEvent);
 
+  // keep expensive intermediate results around in case we come back:
+  dt_graph_evict_nodecache(&vkdt.graph_dev);
   // TODO: repurpose instead of cleanup!
   dt_graph_cleanup(&vkdt.graph_dev);
   dt_graph_history_cleanup(&vkdt.graph_dev);
@@ -56,6 +56,8 @@ int dt_gui_init()
   char configfile[512];
   if(snprintf(configfile, sizeof(configfile), "%s/config.rc", dt_pipe.homedir) < 512)
     dt_rc_read(&vkdt.rc, configfile);
+  const int nodecache_mb = dt_rc_get_int(&vkdt.rc, "gui/nodecache_mb", 1024);
+  dt_pipe.nodecache.max_bytes = nodecache_mb > 0 ? ((uint64_t)nodecache_mb) << 20 : 0;
 
   vkdt.wstate.copied_imgid = -1u; // none copied at startup
   threads_mutex_init(&vkdt.wstate.notification_mutex, 0);
@@ -6,6 +6,7 @@
 #include "pipe/modules/api.h"
 #include "db/thumbnails.h"
 #include "core/log.h"
+#include "core/trace.h"
 #include "core/signal.h"
 #include "core/version.h"
 #include "core/tools.h"
@@ -239,6 +240,8 @@ int main(int argc, char *argv[])
   // init global things, log and pipeline:
   dt_log_init(s_log_err|s_log_gui);
   int lastarg = dt_log_init_arg(argc, argv);
+  dt_trace_init(dt_log_global.mask & s_log_trace);
+  dt_trace_thread_name("gui");
   dt_pipe_global_init();
   threads_global_init();
   dt_set_signal_handlers();
@@ -274,8 +277,9 @@ int main(int argc, char *argv[])
   // also we have a temporary thumbnails struct and background threads
   // to create thumbnails, if necessary.
   // only width/height will matter here
-  dt_thumbnails_init(&vkdt.thumbnail_gen, 400, 400, 0, 0);
-  dt_thumbnails_init(&vkdt.thumbnails, 400, 400, 3000, 1ul<<30);
+  dt_thumbnails_init(&vkdt.thumbnail_gen, 400, 400, 0, 0, dt_rc_get_int(&vkdt.rc, "gui/thumb_graphs", 0));
+  dt_thumbnails_init(&vkdt.thumbnails, 400, 400, 3000, 1ul<<30, 1);
+  vkdt.thumbnail_gen.preview = dt_rc_get_int(&vkdt.rc, "gui/thumb_preview", 1);
   dt_db_init(&vkdt.db);
   char *filename = 0;
   {
@@ -362,6 +366,9 @@ out:
 
   threads_shutdown();
   threads_global_cleanup(); // join worker threads before killing their resources
+  if(dt_trace_enabled() && !dt_trace_write(DT_TRACE_FILE))
+    dt_log(s_log_trace, "wrote " DT_TRACE_FILE);
+  dt_trace_cleanup();
   dt_thumbnails_cleanup(&vkdt.thumbnails);
   dt_thumbnails_cleanup(&vkdt.thumbnail_gen);
   dt_gui_cleanup();
@@ -42,6 +42,7 @@ struct copy_job_t
   uint32_t move;  // set to non-zero to remove src after copy
   std::atomic_uint abort;
   std::atomic_uint state;
+  threads_token_t cancel; // skips the remaining files on abort or error
   int taskid;
 };
 void copy_job_cleanup(void *arg)
@@ -53,11 +54,14 @@ void copy_job_cleanup(void *arg)
 void copy_job_work(uint32_t item, void *arg)
 {
   copy_job_t *j = (copy_job_t *)arg;
-  if(j->abort) return;
   char src[1300], dst[1300];
   snprintf(src, sizeof(src), "%s/%s", j->src, j->ent[item].d_name);
   snprintf(dst, sizeof(dst), "%s/%s", j->dst, j->ent[item].d_name);
-  if(fs_copy(dst, src)) j->abort = 2;
+  if(fs_copy(dst, src))
+  {
+    j->abort = 2;
+    threads_cancel(&j->cancel);
+  }
   else if(j->move) fs_delete(src);
   glfwPostEmptyEvent(); // redraw status bar
 }
@@ -89,7 +93,8 @@ int copy_job(
       j->ent[j->cnt++] = *ent;
   closedir(dirp);
 
-  j->taskid = threads_task("copy", j->cnt, -1, j, copy_job_work, copy_job_cleanup);
+  j->taskid = threads_task_prio("copy", j->cnt, -1, j, copy_job_work, copy_job_cleanup,
+      s_threads_prio_batch, &j->cancel);
   return j->taskid;
 }
 
@@ -251,7 +256,11 @@ void render_files()
         }
         else if(job[k].state == 1)
         { // running
-          if(ImGui::Button("abort")) job[k].abort = 1;
+          if(ImGui::Button("abort"))
+          {
+            job[k].abort = 1;
+            threads_cancel(&job[k].cancel);
+          }
           ImGui::SameLine();
           ImGui::ProgressBar(threads_task_progress(job[k].taskid), ImVec2(-1, 0));
           if(ImGui::IsItemHovered()) dt_gui_set_tooltip("copying %s to %s", job[k].src, job[k].dst);
@@ -119,12 +119,16 @@ void render_lighttable_center(int hotkey)
   ImGui::GetCurrentWindow()->DC.CursorPos[0] = (int)ImGui::GetCurrentWindow()->DC.CursorPos[0];
   while(clipper.Step())
   {
+    const int vis_beg = MIN(clipper.DisplayStart * ipl, (int)vkdt.db.collection_cnt-1);
+    const int vis_end = MIN(clipper.DisplayEnd   * ipl, (int)vkdt.db.collection_cnt);
     dt_thumbnails_load_list(
         &vkdt.thumbnails,
         &vkdt.db,
         vkdt.db.collection,
-        MIN(clipper.DisplayStart * ipl, (int)vkdt.db.collection_cnt-1),
-        MIN(clipper.DisplayEnd   * ipl, (int)vkdt.db.collection_cnt));
+        vis_beg, vis_end);
+    // render what we're looking at first (the last step has the visible range):
+    if(vis_end > vis_beg)
+      dt_thumbnails_cache_prioritise(&vkdt.thumbnail_gen, vkdt.db.collection + vis_beg, vis_end - vis_beg);
     for(int line=clipper.DisplayStart;line<clipper.DisplayEnd;line++)
     {
       int i = line * ipl;
@@ -260,6 +264,7 @@ struct export_job_t
   uint8_t *pdata;
   std::atomic_uint abort;
   std::atomic_uint state; // 0 idle, 1 started, 2 cleaned
+  threads_token_t cancel; // skips the remaining images on abort
   int taskid;
   dt_graph_t graph;
 };
@@ -277,7 +282,6 @@ void export_job_work(uint32_t item, void *arg)
   char dir[512];
   dt_graph_export_t param = {0};
   export_job_t *j = (export_job_t *)arg;
-  if(j->abort) goto out;
 
   dt_db_image_path(&vkdt.db, j->sel[item], filedir, sizeof(filedir));
   fs_expand_export_filename(j->basename, sizeof(j->basename), filename, sizeof(filename), filedir, item);
@@ -331,7 +335,8 @@ int export_job(
   j->pdata = (uint8_t *)malloc(sizeof(uint8_t)*psize);
   memcpy(j->pdata, w->pdata[w->format], psize);
   dt_graph_init(&j->graph);
-  j->taskid = threads_task("export", j->cnt, -1, j, export_job_work, export_job_cleanup);
+  j->taskid = threads_task_prio("export", j->cnt, -1, j, export_job_work, export_job_cleanup,
+      s_threads_prio_batch, &j->cancel);
   return j->taskid;
 }
 // end export bg job stuff
@@ -806,7 +811,11 @@ void render_lighttable_right_panel(int hotkey)
       }
       else if(job[k].cnt > 0 && threads_task_running(job[k].taskid))
       { // running
-        if(ImGui::Button("abort")) job[k].abort = 1;
+        if(ImGui::Button("abort"))
+        {
+          job[k].abort = 1;
+          threads_cancel(&job[k].cancel);
+        }
         ImGui::SameLine();
         ImGui::ProgressBar(threads_task_progress(job[k].taskid), ImVec2(-1, 0));
         // technically a race condition on frame_cnt being inited by graph
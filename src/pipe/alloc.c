@@ -18,15 +18,53 @@ dt_vkalloc_init(dt_vkalloc_t *a, uint64_t pool_size, uint64_t bytesize)
   dt_vkalloc_nuke(a);
 }
 
+// two level segregated fit: free blocks are kept in bins by size class. the
+// first level is the power of two, the second level splits that linearly
+// into TLSF_SL_CNT classes. a bitmap per level finds the smallest non-empty
+// bin that is guaranteed to fit in O(1).
+#define TLSF_SL_LOG 5
+#define TLSF_SL_CNT (1<<TLSF_SL_LOG)
+#define TLSF_FL_CNT (48-TLSF_SL_LOG+1) // dt_vkmem_t.size has 48 bits
+
+typedef struct dt_vkalloc_tlsf_t
+{
+  uint64_t    fl_bitmap;
+  uint32_t    sl_bitmap[TLSF_FL_CNT];
+  dt_vkmem_t *bin[TLSF_FL_CNT][TLSF_SL_CNT];
+  dt_vkmem_t *tail;     // block at the end of the heap
+}
+dt_vkalloc_tlsf_t;
+
+int
+dt_vkalloc_init_tlsf(dt_vkalloc_t *a, uint64_t pool_size, uint64_t bytesize)
+{
+  memset(a, 0, sizeof(*a));
+  a->heap_size = bytesize;
+  a->pool_size = pool_size;
+  a->vkmem_pool = malloc(sizeof(dt_vkmem_t)*a->pool_size);
+  a->tlsf = malloc(sizeof(dt_vkalloc_tlsf_t));
+  if(!a->vkmem_pool || !a->tlsf)
+  {
+    dt_vkalloc_cleanup(a);
+    return 1;
+  }
+  dt_vkalloc_nuke(a);
+  return 0;
+}
+
 void
 dt_vkalloc_cleanup(dt_vkalloc_t *a)
 {
   // free whole thing
   free(a->vkmem_pool);
+  free(a->rec);
+  free(a->tlsf);
   // don't free a, it's owned externally
   memset(a, 0, sizeof(*a));
 }
 
+static void tlsf_insert(dt_vkalloc_tlsf_t *t, dt_vkmem_t *b);
+
 void
 dt_vkalloc_nuke(dt_vkalloc_t *a)
 {
@@ -39,6 +77,303 @@ dt_vkalloc_nuke(dt_vkalloc_t *a)
   for(int i=1;i<a->pool_size;i++)
     a->unused = DLIST_PREPEND(a->unused, a->vkmem_pool+i);
   a->peak_rss = a->rss = a->vmsize = 0ul;
+  a->step = a->rec_cnt = 0;
+  a->rec_fail = 0;
+  if(a->tlsf)
+  { // the one big free block goes to the bins instead
+    memset(a->tlsf, 0, sizeof(*a->tlsf));
+    dt_vkmem_t *b = a->free;
+    a->free = 0;
+    a->tlsf->tail = b;
+    tlsf_insert(a->tlsf, b);
+  }
+}
+
+// remember the lifetime of a fresh allocation
+static inline void
+record(dt_vkalloc_t *a, dt_vkmem_t *mem, uint64_t size, uint64_t alignment, int persistent)
+{
+  if(!a->plan || a->rec_fail) return;
+  if(a->rec_cnt >= a->rec_max)
+  {
+    uint32_t max = a->rec_max ? 2*a->rec_max : 256;
+    dt_vkalloc_rec_t *rec = realloc(a->rec, sizeof(dt_vkalloc_rec_t)*max);
+    if(!rec) { a->rec_fail = 1; return; }
+    a->rec = rec;
+    a->rec_max = max;
+  }
+  mem->rec = a->rec_cnt;
+  a->rec[a->rec_cnt++] = (dt_vkalloc_rec_t){
+    .size       = size,
+    .alignment  = alignment,
+    .beg        = persistent ? 0 : a->step,
+    .end        = -1u, // until freed
+    .persistent = persistent,
+  };
+}
+
+static inline int
+tlsf_fls(uint64_t x)
+{
+  return 63 - __builtin_clzll(x);
+}
+
+// size class of a block
+static inline void
+tlsf_mapping(uint64_t size, int *fl, int *sl)
+{
+  if(size < TLSF_SL_CNT)
+  {
+    *fl = 0;
+    *sl = size;
+    return;
+  }
+  const int f = tlsf_fls(size);
+  *fl = f - TLSF_SL_LOG + 1;
+  *sl = (size >> (f - TLSF_SL_LOG)) - TLSF_SL_CNT;
+}
+
+static void
+tlsf_insert(dt_vkalloc_tlsf_t *t, dt_vkmem_t *b)
+{
+  int fl, sl;
+  tlsf_mapping(b->size, &fl, &sl);
+  t->bin[fl][sl] = DLIST_PREPEND(t->bin[fl][sl], b);
+  t->fl_bitmap     |= 1ul << fl;
+  t->sl_bitmap[fl] |= 1u  << sl;
+  b->free = 1;
+}
+
+static void
+tlsf_remove(dt_vkalloc_tlsf_t *t, dt_vkmem_t *b)
+{
+  int fl, sl;
+  tlsf_mapping(b->size, &fl, &sl);
+  if(t->bin[fl][sl] == b) t->bin[fl][sl] = b->next;
+  DLIST_RM_ELEMENT(b);
+  if(!t->bin[fl][sl])
+  {
+    t->sl_bitmap[fl] &= ~(1u << sl);
+    if(!t->sl_bitmap[fl]) t->fl_bitmap &= ~(1ul << fl);
+  }
+  b->free = 0;
+}
+
+// smallest free block in a size class that fits every block of the given size
+static dt_vkmem_t *
+tlsf_find(dt_vkalloc_tlsf_t *t, uint64_t size)
+{
+  if(size >= TLSF_SL_CNT) // round up to the next class
+    size += (1ul << (tlsf_fls(size) - TLSF_SL_LOG)) - 1;
+  int fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  if(fl >= TLSF_FL_CNT) return 0;
+  uint32_t sl_map = t->sl_bitmap[fl] & (~0u << sl);
+  if(!sl_map)
+  {
+    const uint64_t fl_map = fl+1 < 64 ? t->fl_bitmap & (~0ul << (fl+1)) : 0;
+    if(!fl_map) return 0;
+    fl = __builtin_ctzll(fl_map);
+    sl_map = t->sl_bitmap[fl];
+  }
+  return t->bin[fl][__builtin_ctz(sl_map)];
+}
+
+// split the free block b (not in a bin) at offset `at`, return the back part
+static dt_vkmem_t *
+tlsf_split(dt_vkalloc_t *a, dt_vkmem_t *b, uint64_t at)
+{
+  dt_vkmem_t *r = a->unused;
+  a->unused = DLIST_REMOVE(a->unused, r); // remove first is O(1)
+  r->offset = r->offset_orig = at;
+  r->size   = b->offset_orig + b->size - at;
+  b->size   = at - b->offset_orig;
+  r->left   = b;
+  r->right  = b->right;
+  if(b->right) b->right->left = r;
+  else a->tlsf->tail = r;
+  b->right  = r;
+  return r;
+}
+
+// hand out [offset, offset+size) of the free block b which is not in a bin.
+// everything after goes back to the bins, the alignment gap in front stays
+// with the block.
+static dt_vkmem_t *
+tlsf_use(dt_vkalloc_t *a, dt_vkmem_t *b, uint64_t offset, uint64_t size, uint64_t alignment, int persistent)
+{
+  if(offset + size < b->offset_orig + b->size)
+    tlsf_insert(a->tlsf, tlsf_split(a, b, offset + size));
+  b->offset = offset;
+  b->size   = size;
+  b->ref    = 1;
+  a->rss += size;
+  a->peak_rss = MAX(a->peak_rss, a->rss);
+  a->vmsize = MAX(a->vmsize, offset + size);
+  a->used = DLIST_PREPEND(a->used, b);
+  record(a, b, size, alignment, persistent);
+  return b;
+}
+
+static dt_vkmem_t *
+tlsf_alloc(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
+{
+  if(!a->unused) return 0; // need one block for the rest
+  // ask for enough to align any block in the bin:
+  dt_vkmem_t *b = tlsf_find(a->tlsf, size + alignment - 1);
+  if(!b) return 0;
+  tlsf_remove(a->tlsf, b);
+  const uint64_t offset = (b->offset_orig + (alignment-1)) & ~(alignment-1);
+  return tlsf_use(a, b, offset, size, alignment, 0);
+}
+
+// like dt_vkalloc_feedback: memory past vmsize that has never been used
+static dt_vkmem_t *
+tlsf_alloc_feedback(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
+{
+  if(!a->unused || !a->unused->next) return 0; // need two blocks for front and back
+  dt_vkmem_t *b = a->tlsf->tail;
+  if(!b->free) return 0;
+  const uint64_t beg = MAX(b->offset_orig, a->vmsize);
+  const uint64_t offset = (beg + (alignment-1)) & ~(alignment-1);
+  if(offset + size > b->offset_orig + b->size) return 0;
+  tlsf_remove(a->tlsf, b);
+  if(beg > b->offset_orig)
+  { // keep the front free
+    dt_vkmem_t *f = b;
+    b = tlsf_split(a, f, beg);
+    tlsf_insert(a->tlsf, f);
+  }
+  return tlsf_use(a, b, offset, size, alignment, 1);
+}
+
+static void
+tlsf_free(dt_vkalloc_t *a, dt_vkmem_t *mem)
+{
+  if(a->used == mem) a->used = mem->next;
+  DLIST_RM_ELEMENT(mem);
+  // the block spans the alignment gap, too:
+  mem->size   = mem->offset + mem->size - mem->offset_orig;
+  mem->offset = mem->offset_orig;
+  dt_vkmem_t *l = mem->left, *r = mem->right;
+  if(l && l->free)
+  { // merge into the block before
+    tlsf_remove(a->tlsf, l);
+    l->size += mem->size;
+    l->right = r;
+    if(r) r->left = l;
+    else a->tlsf->tail = l;
+    a->unused = DLIST_PREPEND(a->unused, mem);
+    mem = l;
+  }
+  if(r && r->free)
+  { // swallow the block after
+    tlsf_remove(a->tlsf, r);
+    mem->size += r->size;
+    mem->right = r->right;
+    if(r->right) r->right->left = mem;
+    else a->tlsf->tail = mem;
+    a->unused = DLIST_PREPEND(a->unused, r);
+  }
+  tlsf_insert(a->tlsf, mem);
+}
+
+int
+dt_vkalloc_compact(
+    dt_vkalloc_t *a,
+    uint64_t      alignment,
+    dt_vkmem_t  **src,
+    dt_vkmem_t  **dst,
+    int           max)
+{
+  if(!a->tlsf) return 0;
+  if(!alignment) alignment = 1;
+  // two fingers: used blocks from the top, free blocks from the bottom. every
+  // used block looks at a few holes only and neither finger ever goes back,
+  // so the whole plan is O(n).
+  int cnt = 0;
+  uint64_t min_size = -1ul; // smallest block seen, smaller holes are of no use
+  uint64_t lim = 0;         // end of the highest block we moved, don't move it again
+  dt_vkmem_t *f = a->vkmem_pool; // the block at offset 0 is always the first one in the pool
+  for(dt_vkmem_t *u=a->tlsf->tail;u&&cnt<max&&a->unused;u=u->left)
+  {
+    if(u->free) continue;
+    if(u->offset_orig < lim) break;
+    if(u->size < min_size) min_size = u->size;
+    while(f != u && (!f->free || f->size < min_size)) f = f->right;
+    if(f == u || f->offset_orig > u->offset_orig) break;
+    int tries = 0;
+    for(dt_vkmem_t *h=f;h!=u&&tries<8;h=h->right)
+    {
+      if(!h->free) continue;
+      tries++;
+      const uint64_t offset = (h->offset_orig + (alignment-1)) & ~(alignment-1);
+      if(offset + u->size > h->offset_orig + h->size) continue;
+      tlsf_remove(a->tlsf, h);
+      dst[cnt] = tlsf_use(a, h, offset, u->size, alignment, 0);
+      src[cnt++] = u;
+      lim = MAX(lim, offset + u->size);
+      break;
+    }
+  }
+  return cnt;
+}
+
+// consistency check of the bins and the blocks in memory order, O(n)
+static int
+tlsf_check(dt_vkalloc_t *a)
+{
+  dt_vkalloc_tlsf_t *t = a->tlsf;
+  uint64_t num_free = 0, num_phys = 0, rss = 0, vmsize = 0;
+  for(int fl=0;fl<TLSF_FL_CNT;fl++) for(int sl=0;sl<TLSF_SL_CNT;sl++)
+  {
+    const int bit = (t->sl_bitmap[fl] >> sl) & 1;
+    if(bit != !!t->bin[fl][sl]) return 15;
+    if(bit && !((t->fl_bitmap >> fl) & 1)) return 15;
+    for(dt_vkmem_t *l=t->bin[fl][sl];l;l=l->next)
+    {
+      int f, s;
+      tlsf_mapping(l->size, &f, &s);
+      if(f != fl || s != sl || !l->free) return 16;
+      if(l->next && l->next->prev != l) return 10;
+      num_free++;
+    }
+  }
+  dt_vkmem_t *l = t->tail;
+  if(l->offset + l->size != a->heap_size) return 17;
+  for(;l;l=l->left)
+  {
+    if(++num_phys > a->pool_size) return 17; // cycle
+    if(l->left)
+    {
+      if(l->left->right != l) return 17;
+      if(l->left->offset + l->left->size != l->offset_orig) return 3;
+      if(l->free && l->left->free) return 18; // should have been merged
+    }
+    else if(l->offset_orig) return 2;
+    if(l->free) num_free--;
+    else
+    {
+      rss += l->size;
+      vmsize = MAX(vmsize, l->offset + l->size);
+    }
+  }
+  if(num_free) return 19; // free blocks missing in bins or the other way around
+  uint64_t num_used = DLIST_LENGTH(a->used);
+  uint64_t num_unused = DLIST_LENGTH(a->unused);
+  if(num_used + num_unused + (num_phys - num_used) != a->pool_size)
+  {
+    fprintf(stderr, "used %"PRIu64" blocks %"PRIu64" unused %"PRIu64" != %"PRIu64"\n", num_used, num_phys, num_unused, a->pool_size);
+    return 1;
+  }
+  for(l=a->used;l;l=l->next)
+  {
+    if(l->free) return 4;
+    if(l->next && l->next->prev != l) return 12;
+  }
+  if(vmsize > a->vmsize) return 7;
+  if(rss != a->rss) return 8;
+  return 0;
 }
 
 // feedback version of allocation:
@@ -51,6 +386,7 @@ dt_vkmem_t*
 dt_vkalloc_feedback(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
 {
   if(!alignment) alignment = 1;
+  if(a->tlsf) return tlsf_alloc_feedback(a, size, alignment);
   assert(!dt_vkalloc_check(a));
   // linear scan through free list O(n)
   dt_vkmem_t *l = a->free;
@@ -108,6 +444,7 @@ dt_vkalloc_feedback(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
   a->vmsize = MAX(a->vmsize, mem->offset + mem->size);
   a->used = DLIST_PREPEND(a->used, mem);
   mem->ref = 1;
+  record(a, mem, size, alignment, 1);
 
   assert(!dt_vkalloc_check(a));
   return mem;
@@ -117,6 +454,7 @@ dt_vkmem_t*
 dt_vkalloc(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
 {
   if(!alignment) alignment = 1;
+  if(a->tlsf) return tlsf_alloc(a, size, alignment);
   // linear scan through free list O(n)
   dt_vkmem_t *l = a->free;
   while(l)
@@ -156,6 +494,7 @@ dt_vkalloc(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
       a->vmsize = MAX(a->vmsize, mem->offset + mem->size);
       a->used = DLIST_PREPEND(a->used, mem);
       mem->ref = 1;
+      record(a, mem, size, alignment, 0);
       return mem;
     }
     l = l->next;
@@ -173,8 +512,15 @@ dt_vkfree(dt_vkalloc_t *a, dt_vkmem_t *mem)
     if(mem->ref) return; // don't free if still referenced
   }
   else return; // no ref count: already freed
+  if(a->plan && !a->rec_fail && mem->rec < a->rec_cnt && !a->rec[mem->rec].persistent)
+    a->rec[mem->rec].end = a->step;
   // remove from used list, put back to free list.
   a->rss -= mem->size;
+  if(a->tlsf)
+  {
+    tlsf_free(a, mem);
+    return;
+  }
   a->used = DLIST_REMOVE(a->used, mem);
   dt_vkmem_t *l = a->free;
   do
@@ -216,10 +562,124 @@ dt_vkfree(dt_vkalloc_t *a, dt_vkmem_t *mem)
   assert(0 && "vkalloc: inconsistent free list!");
 }
 
+typedef struct plan_order_t
+{
+  uint64_t key;
+  uint64_t size;
+  uint32_t beg;
+  uint32_t idx;
+}
+plan_order_t;
+
+static int
+plan_compare(const void *x, const void *y)
+{ // big ones first, then in schedule order
+  const plan_order_t *a = x, *b = y;
+  if(a->key  > b->key)  return -1;
+  if(a->key  < b->key)  return  1;
+  if(a->size > b->size) return -1;
+  if(a->size < b->size) return  1;
+  if(a->beg  < b->beg)  return -1;
+  if(a->beg  > b->beg)  return  1;
+  return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+// place the records in the given order, each one into the smallest gap
+// left by the already placed records with overlapping lifetimes.
+// writes offsets to `offset` and returns the resulting vmsize.
+static uint64_t
+plan_place(
+    const dt_vkalloc_rec_t *rec,
+    const plan_order_t     *order,
+    uint32_t                n,
+    uint32_t               *placed,  // scratch, placed records sorted by offset
+    uint64_t               *offset)
+{
+  uint64_t vmsize = 0;
+  uint32_t placed_cnt = 0;
+  for(uint32_t o=0;o<n;o++)
+  {
+    const uint32_t i = order[o].idx;
+    const dt_vkalloc_rec_t *r = rec + i;
+    const uint64_t align = r->alignment ? r->alignment : 1;
+    uint64_t prev_end = 0, best = -1ul, best_gap = -1ul;
+    for(uint32_t p=0;p<placed_cnt;p++)
+    {
+      const dt_vkalloc_rec_t *q = rec + placed[p];
+      if(q->beg > r->end || r->beg > q->end) continue; // disjoint lifetimes
+      const uint64_t off = (prev_end + (align-1)) & ~(align-1);
+      const uint64_t qoff = offset[placed[p]];
+      if(qoff > prev_end && off + r->size <= qoff && qoff - prev_end < best_gap)
+      {
+        best = off;
+        best_gap = qoff - prev_end;
+      }
+      prev_end = MAX(prev_end, qoff + q->size);
+    }
+    if(best == -1ul) best = (prev_end + (align-1)) & ~(align-1); // append
+    offset[i] = best;
+    vmsize = MAX(vmsize, best + r->size);
+    uint32_t p = placed_cnt++; // insert, keep sorted by offset
+    for(;p>0&&offset[placed[p-1]]>best;p--) placed[p] = placed[p-1];
+    placed[p] = i;
+  }
+  return vmsize;
+}
+
+int
+dt_vkalloc_plan(dt_vkalloc_t *a)
+{
+  a->vmsize_ff = a->vmsize;
+  if(!a->plan || a->tlsf || a->rec_fail || !a->rec_cnt) return 0;
+  const uint32_t n = a->rec_cnt, steps = a->step + 2; // last step is "never freed"
+  plan_order_t *order  = malloc(sizeof(plan_order_t)*n);
+  uint32_t     *placed = malloc(sizeof(uint32_t)*n);
+  uint64_t     *offset = malloc(sizeof(uint64_t)*2*n);
+  uint64_t     *live   = calloc(sizeof(uint64_t), steps);
+  int ret = 0;
+  if(!order || !placed || !offset || !live) goto out;
+
+  // two orders, keep the better one: greedy by size, and greedy by breadth,
+  // i.e. buffers contributing to the largest live sets go first.
+  for(uint32_t i=0;i<n;i++)
+    for(uint32_t s=a->rec[i].beg;s<=MIN(a->rec[i].end, steps-1);s++)
+      live[s] += a->rec[i].size;
+  uint64_t vmsize[2];
+  for(int k=0;k<2;k++)
+  {
+    for(uint32_t i=0;i<n;i++)
+    {
+      const dt_vkalloc_rec_t *r = a->rec + i;
+      order[i] = (plan_order_t){ .size = r->size, .beg = r->beg, .idx = i };
+      if(k == 1) for(uint32_t s=r->beg;s<=MIN(r->end, steps-1);s++)
+        order[i].key = MAX(order[i].key, live[s]);
+    }
+    qsort(order, n, sizeof(plan_order_t), plan_compare);
+    vmsize[k] = plan_place(a->rec, order, n, placed, offset + k*n);
+  }
+  const int k = vmsize[1] < vmsize[0];
+  if(vmsize[k] >= a->vmsize) goto out; // first fit did well enough, keep it
+
+  for(uint32_t i=0;i<n;i++) a->rec[i].offset = offset[k*n + i];
+  // move all memory blocks still in use, other blocks have been recycled and
+  // the caller needs to update its copies of the offsets from the records.
+  for(dt_vkmem_t *l=a->used;l;l=l->next)
+    if(l->rec < n) l->offset = l->offset_orig = a->rec[l->rec].offset;
+  a->vmsize = vmsize[k];
+  ret = 1;
+out:
+  free(order);
+  free(placed);
+  free(offset);
+  free(live);
+  return ret;
+}
+
 // perform an (expensive) internal consistency check in O(n^2)
 int
 dt_vkalloc_check(dt_vkalloc_t *a)
 {
+  if(a->tlsf) return tlsf_check(a);
   // check list integrity:
   dt_vkmem_t *l = a->free;
   if(l)
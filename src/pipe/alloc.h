@@ -5,6 +5,16 @@
 // for the node graph. single thread use, not optimised in any sense.
 // employs a free list and an allocation list, both allocation and free
 // are O(n). we hope to afford it because we'll use n~=10 buffers max.
+//
+// since placement depends on the order of alloc/free calls, the heap can
+// optionally record the lifetime of every allocation during one pass (set
+// `plan` and advance `step` along the schedule). dt_vkalloc_plan() then
+// packs these intervals offline, which often needs a lot less than vmsize.
+//
+// heaps with many blocks that live for a long time (such as the thumbnails)
+// should use dt_vkalloc_init_tlsf() instead: the free blocks are then kept in
+// size segregated bins and all blocks know their neighbours in memory, so
+// allocation and free (including coalescing) are O(1).
 
 typedef struct dt_vkmem_t
 {
@@ -14,9 +24,24 @@ typedef struct dt_vkmem_t
   uint64_t size : 48;       // only for us, the gpu will know what they asked for
   struct dt_vkmem_t *prev;  // for alloced/free lists
   struct dt_vkmem_t *next;
+  uint32_t rec;             // index into the lifetime records while in use
+  uint32_t free;            // tlsf: this is a free block in one of the bins
+  struct dt_vkmem_t *left;  // tlsf: neighbouring blocks in memory
+  struct dt_vkmem_t *right;
 }
 dt_vkmem_t;
 
+// lifetime of one allocation in the schedule, for the offline planner
+typedef struct dt_vkalloc_rec_t
+{
+  uint64_t size;
+  uint64_t alignment;
+  uint64_t offset;          // planned offset, valid after dt_vkalloc_plan()
+  uint32_t beg, end;        // first and last step using the memory, inclusive
+  int      persistent;      // feedback memory, lives for the whole schedule
+}
+dt_vkalloc_rec_t;
+
 typedef struct dt_vkalloc_t
 {
   dt_vkmem_t *used;
@@ -31,10 +56,22 @@ typedef struct dt_vkalloc_t
   uint64_t peak_rss;
   uint64_t rss;
   uint64_t vmsize; // <= necessary to stay within limits here!
+
+  // lifetime records for offline planning, if plan is set:
+  int               plan;
+  uint32_t          step;        // current position in the schedule
+  dt_vkalloc_rec_t *rec;
+  uint32_t          rec_cnt, rec_max;
+  int               rec_fail;    // ran out of memory recording, can't plan
+  uint64_t          vmsize_ff;   // first fit vmsize, before planning
+
+  struct dt_vkalloc_tlsf_t *tlsf; // if set, free blocks are binned by size instead of the free list
 }
 dt_vkalloc_t;
 
 void dt_vkalloc_init(dt_vkalloc_t *a, uint64_t pool_size, uint64_t bytesize);
+// same, but use the two level segregated fit allocator. returns non-zero on error.
+int  dt_vkalloc_init_tlsf(dt_vkalloc_t *a, uint64_t pool_size, uint64_t bytesize);
 void dt_vkalloc_cleanup(dt_vkalloc_t *a);
 
 // allocate memory
@@ -47,5 +84,20 @@ void dt_vkfree(dt_vkalloc_t *a, dt_vkmem_t *mem);
 // free all the mallocs!
 void dt_vkalloc_nuke(dt_vkalloc_t *a);
 
+// plan the compaction of a tlsf heap in one pass: the used blocks at the top
+// end are moved down into the free blocks below them, for at most max blocks.
+// for every move i, dst[i] is allocated with the size of src[i]. the caller
+// copies the contents over and frees all src[i] afterwards. returns the number
+// of moves, 0 if nothing can be moved down any more.
+int dt_vkalloc_compact(dt_vkalloc_t *a, uint64_t alignment, dt_vkmem_t **src, dt_vkmem_t **dst, int max);
+
 // perform an (expensive) internal consistency check in O(n^2)
 int dt_vkalloc_check(dt_vkalloc_t *a);
+
+// pack the lifetimes recorded since the last nuke, greedy by size and best
+// fit in the gaps left by buffers with overlapping lifetimes. if this needs
+// less than vmsize, the planned offsets are written to the records and to
+// all still used memory blocks, vmsize is updated, and 1 is returned. the
+// free list is stale after that, nuke before allocating again.
+// returns 0 if the first fit allocation is kept.
+int dt_vkalloc_plan(dt_vkalloc_t *a);
@@ -8,6 +8,7 @@ dt_module_connect_internal(
     dt_graph_t *graph,
     int m0, int c0, int m1, int c1)
 {
+  graph->module_order_valid = 0; // topology changes, traverse again
 #define connect_module
 #define element module
 #define num_elements num_modules
@@ -6,6 +6,7 @@ pipe/graph.o\
 pipe/graph-io.o\
 pipe/graph-export.o\
 pipe/module.o\
+pipe/nodecache.o\
 pipe/raytrace.o
 PIPE_H=\
 core/fs.h\
@@ -25,6 +26,7 @@ pipe/modules/api.h\
 pipe/asciiio.h\
 pipe/module.h\
 pipe/node.h\
+pipe/nodecache.h\
 pipe/params.h\
 pipe/pipe.h\
 pipe/raytrace.h\
@@ -116,6 +116,8 @@ dt_module_so_load(
     mod->check_params   = dlsym(mod->dlhandle, "check_params");
     mod->audio          = dlsym(mod->dlhandle, "audio");
     mod->input          = dlsym(mod->dlhandle, "input");
+    const int *reentrant = dlsym(mod->dlhandle, "read_source_reentrant");
+    mod->read_source_reentrant = reentrant ? *reentrant : 0;
   }
 
   // init callback handles on dso side for windows:
@@ -396,6 +398,7 @@ compare_module_name(const void *a, const void *b)
 int dt_pipe_global_init()
 {
   memset(&dt_pipe, 0, sizeof(dt_pipe));
+  dt_nodecache_init(&dt_pipe.nodecache, 0);
   (void)setlocale(LC_ALL, "C"); // make sure we write and parse floats correctly
   // setup search directory
   fs_basedir(dt_pipe.basedir, sizeof(dt_pipe.basedir));
@@ -439,5 +442,6 @@ void dt_pipe_global_cleanup()
   for(int i=0;i<dt_pipe.num_modules;i++)
     dt_module_so_unload(dt_pipe.module + i);
   free(dt_pipe.module);
+  dt_nodecache_cleanup(&dt_pipe.nodecache);
   memset(&dt_pipe, 0, sizeof(dt_pipe));
 }
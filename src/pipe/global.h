@@ -4,6 +4,7 @@
 #include "params.h"
 #include "connector.h"
 #include "graph-fwd.h"
+#include "nodecache.h"
 #include <limits.h>
 
 // static global structs to keep around for all instances of pipelines.
@@ -100,6 +101,8 @@ typedef struct dt_module_so_t
   dt_module_read_source_t read_source;
   // for sink nodes, will be called once processing ended
   dt_module_write_sink_t  write_sink;
+  // read_source() of different instances may run concurrently (exported as int by the module)
+  int read_source_reentrant;
 
   dt_module_init_t init;
   dt_module_init_t cleanup;
@@ -128,6 +131,7 @@ typedef struct dt_pipe_global_t
   char homedir[PATH_MAX]; // this is normally ${HOME}/.config/vkdt
   dt_module_so_t *module;
   uint32_t num_modules;
+  dt_nodecache_t nodecache; // node outputs in host memory, disabled unless the gui sets the size
 }
 dt_pipe_global_t;
 
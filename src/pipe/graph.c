@@ -6,6 +6,8 @@
 #include "modules/api.h"
 #include "modules/localsize.h"
 #include "core/log.h"
+#include "core/trace.h"
+#include "core/hash.h"
 #include "qvk/qvk.h"
 #include "graph-print.h"
 #ifdef DEBUG_MARKERS
@@ -48,6 +50,7 @@ dt_graph_init(dt_graph_t *g)
   dt_vkalloc_init(&g->heap, 16000, ((uint64_t)1)<<40); // bytesize doesn't matter
   dt_vkalloc_init(&g->heap_ssbo, 8000, ((uint64_t)1)<<40);
   dt_vkalloc_init(&g->heap_staging, 100, ((uint64_t)1)<<40);
+  g->heap.plan = g->heap_ssbo.plan = 1; // pack the big ones offline after each allocation pass
   g->params_max = 16u<<20;
   g->params_end = 0;
   g->params_pool = calloc(sizeof(uint8_t), g->params_max);
@@ -100,6 +103,16 @@ dt_graph_init(dt_graph_t *g)
 
   g->lod_scale = 1;
   g->active_module = -1;
+  g->cache_module = -1;
+}
+
+// release the reference to the cached output of the node, if any
+static void
+nodecache_drop(dt_node_t *node)
+{
+  dt_nodecache_release(&dt_pipe.nodecache, node->cache_data);
+  node->cache_data = 0;
+  node->cache_hit  = 0;
 }
 
 void
@@ -168,6 +181,7 @@ dt_graph_cleanup(dt_graph_t *g)
         c->array_mem = 0;
       }
     }
+    nodecache_drop(g->node + i);
     vkDestroyPipelineLayout     (qvk.device, g->node[i].pipeline_layout,  0);
     vkDestroyPipeline           (qvk.device, g->node[i].pipeline,         0);
     vkDestroyDescriptorSetLayout(qvk.device, g->node[i].dset_layout,      0);
@@ -206,6 +220,11 @@ dt_graph_cleanup(dt_graph_t *g)
   free(g->node);               g->node = 0;
   free(g->params_pool);        g->params_pool = 0;
   free(g->conn_image_pool);    g->conn_image_pool = 0;
+  free(g->module_order);       g->module_order = 0;
+  free(g->node_order);         g->node_order = 0;
+  g->module_order_max = g->node_order_max = 0;
+  g->module_order_valid = g->node_order_valid = 0;
+  dt_graph_traverse_cleanup(&g->traverse);
   for(int i=0;i<2;i++)
   {
     vkDestroyQueryPool(qvk.device, g->query[i].pool, 0);
@@ -474,6 +493,7 @@ allocate_image_array_element(
   assert(img->mem);
   img->offset = img->mem->offset + heap_offset;
   img->size   = img->mem->size;
+  img->rec    = img->mem->rec;
   // reference counting. we can't just do a ref++ here because we will
   // free directly after and wouldn't know which node later on still relies
   // on this buffer. hence we ran a reference counting pass before this, and
@@ -488,6 +508,30 @@ allocate_image_array_element(
   return VK_SUCCESS;
 }
 
+// source arrays are uploaded through a ring in their staging buffer. it holds
+// two batches of elements: read_source() fills one while the gpu copies the other.
+#define DT_GRAPH_UPLOAD_RING_BYTES (64ul<<20)
+
+static inline uint64_t
+array_staging_stride(const dt_connector_t *c)
+{ // aligned such that every element can be the start of a buffer to image copy
+  return (dt_connector_bufsize(c, c->roi.wd, c->roi.ht) + 255) & ~(uint64_t)255;
+}
+
+static inline int
+array_staging_batch(const dt_connector_t *c)
+{ // number of array elements copied in one submission
+  if(c->type != dt_token("source") || c->array_length <= 1) return 1;
+  return CLAMP(DT_GRAPH_UPLOAD_RING_BYTES / (2*array_staging_stride(c)), 1, c->array_length);
+}
+
+static inline int
+array_staging_slots(const dt_connector_t *c)
+{ // no need to double buffer if all elements fit in one batch
+  const int batch = array_staging_batch(c);
+  return batch < c->array_length ? 2*batch : batch;
+}
+
 // allocate output buffers, also create vulkan pipeline and load spir-v portion
 // of the compute shader.
 static inline VkResult
@@ -851,6 +895,7 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         }
         img->offset = img->mem->offset;
         img->size   = size; // for validation layers, this is the smaller of the two sizes.
+        img->rec    = img->mem->rec;
         // set the staging offsets so it'll transparently work with read_source further down
         // when running the graph. this can cause trouble for multiple source ssbo in the
         // same node (as multiple places in the code e.g. using a single read_source call)
@@ -890,13 +935,15 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         dt_vkalloc_init(c->array_alloc, c->array_length * 2, c->array_alloc_size);
       }
 
-      // allocate only one staging buffer for the whole array:
-      if(c->type == dt_token("source"))
+      // allocate only one staging buffer for the whole array, holding the upload ring:
+      if(c->type == dt_token("source") || node->cache_hit)
       {
         // allocate staging buffer for uploading to the just allocated image
+        if(c->staging) vkDestroyBuffer(qvk.device, c->staging, VK_NULL_HANDLE);
+        const int slots = array_staging_slots(c);
         VkBufferCreateInfo buffer_info = {
           .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-          .size        = dt_connector_bufsize(c, c->roi.wd, c->roi.ht),
+          .size        = slots > 1 ? slots * array_staging_stride(c) : dt_connector_bufsize(c, c->roi.wd, c->roi.ht),
           .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
           .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
         };
@@ -926,6 +973,7 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         c->size_staging   = c->mem_staging->size;
         c->mem_staging->ref++; // ref staging memory so we don't overwrite it before the pipe starts (will be written in read_source() in the module)
       }
+      else c->mem_staging = 0; // may be left over from a cache hit in an earlier allocation
     }
     else if(dt_connector_input(c))
     { // point our inputs to their counterparts and allocate staging memory for sinks
@@ -936,6 +984,7 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         if(c->type == dt_token("sink"))
         {
           // allocate staging buffer for downloading from connected input
+          if(c->staging) vkDestroyBuffer(qvk.device, c->staging, VK_NULL_HANDLE);
           VkBufferCreateInfo buffer_info = {
             .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
             .size        = dt_connector_bufsize(c, c->roi.wd, c->roi.ht),
@@ -1308,7 +1357,8 @@ alloc_outputs3(dt_graph_t *graph, dt_node_t *node)
   for(int i=0;i<node->num_connectors;i++)
   { // bind staging memory:
     dt_connector_t *c = node->connector+i;
-    if((!dt_connector_ssbo(c) && (c->type == dt_token("source"))) || c->type == dt_token("sink"))
+    if((!dt_connector_ssbo(c) && (c->type == dt_token("source") || (node->cache_hit && dt_connector_output(c)))) ||
+        c->type == dt_token("sink"))
       vkBindBufferMemory(qvk.device, c->staging, graph->vkmem_staging, c->offset_staging);
   }
 
@@ -1353,7 +1403,10 @@ free_inputs(dt_graph_t *graph, dt_node_t *node)
   for(int i=0;i<node->num_connectors;i++)
   {
     dt_connector_t *c = node->connector+i;
-    if(c->type == dt_token("read") && c->connected_mi >= 0 &&
+    // inputs from clean nodes stay resident, so the next run can start right here:
+    const int keep = graph->cache_intermediate && c->connected_mi >= 0 &&
+      node->module->cache_dirty && !graph->node[c->connected_mi].module->cache_dirty;
+    if(c->type == dt_token("read") && c->connected_mi >= 0 && !keep &&
      !(c->flags & s_conn_feedback) &&
      !(graph->node[c->connected_mi].connector[c->connected_mc].flags & s_conn_dynamic_array))
     { // only free "read", not "sink" which we keep around for display
@@ -1407,6 +1460,30 @@ free_inputs(dt_graph_t *graph, dt_node_t *node)
   return VK_SUCCESS;
 }
 
+// after the heaps have been planned offline, move the outputs of the node
+// to their new offsets. dynamic arrays live inside one protected block, which
+// is still in use and has been moved by the allocator already.
+static inline void
+apply_memory_plan(dt_graph_t *graph, dt_node_t *node, int plan_heap, int plan_ssbo)
+{
+  for(int i=0;i<node->num_connectors;i++)
+  {
+    dt_connector_t *c = node->connector+i;
+    if(!dt_connector_output(c) || (c->flags & s_conn_dynamic_array)) continue;
+    if(dt_connector_ssbo(c) && c->type == dt_token("source")) continue; // staging
+    const int ssbo = dt_connector_ssbo(c);
+    if(( ssbo && !plan_ssbo) || (!ssbo && !plan_heap)) continue;
+    const dt_vkalloc_t *heap = ssbo ? &graph->heap_ssbo : &graph->heap;
+    for(int f=0;f<c->frames;f++) for(int k=0;k<MAX(1,c->array_length);k++)
+    {
+      dt_connector_image_t *img = dt_graph_connector_image(graph, node-graph->node, i, k, f);
+      if(!img || img->rec >= heap->rec_cnt) continue;
+      img->offset = heap->rec[img->rec].offset;
+      if(ssbo) c->offset_staging = img->offset;
+    }
+  }
+}
+
 // propagate full buffer size from source to sink
 static void
 modify_roi_out(dt_graph_t *graph, dt_module_t *module)
@@ -1504,6 +1581,20 @@ modify_roi_out(dt_graph_t *graph, dt_module_t *module)
   }
 }
 
+// copy the roi of the given source output to all inputs connected to it
+static void
+sync_source_roi(dt_graph_t *graph, int mi, int mc)
+{
+  const dt_roi_t *roi = &graph->module[mi].connector[mc].roi;
+  for(int m=0;m<graph->num_modules;m++)
+    for(int i=0;i<graph->module[m].num_connectors;i++)
+    {
+      dt_connector_t *c = graph->module[m].connector+i;
+      if(dt_connector_input(c) && c->connected_mi == mi && c->connected_mc == mc)
+        c->roi = *roi;
+    }
+}
+
 // request input region of interest from sink to source
 static void
 modify_roi_in(dt_graph_t *graph, dt_module_t *module)
@@ -1557,14 +1648,28 @@ modify_roi_in(dt_graph_t *graph, dt_module_t *module)
       // make sure roi is good on the outgoing connector
       if(c->connected_mi >= 0 && c->connected_mc >= 0)
       {
-        dt_roi_t *roi = &graph->module[c->connected_mi].connector[c->connected_mc].roi;
-        if(graph->module[c->connected_mi].connector[c->connected_mc].type == dt_token("source"))
-        { // sources don't negotiate their size, they just give what they have
-          roi->wd = roi->full_wd;
-          roi->ht = roi->full_ht;
-          if(roi->scale <= 0) roi->scale = 1.0; // mark as initialised, we force the resolution now
-          c->roi = *roi; // TODO: this may mean that we need a resample node if the module can't handle it!
-          // TODO: insert manually here
+        dt_module_t *src = graph->module + c->connected_mi;
+        dt_roi_t *roi = &src->connector[c->connected_mc].roi;
+        if(src->connector[c->connected_mc].type == dt_token("source"))
+        { // sources that implement modify_roi_in can deliver less, others give what they have
+          const int scaled = !src->disabled && src->so->modify_roi_in && c->roi.scale > 1.0f;
+          const uint32_t wd = scaled ? c->roi.wd : roi->full_wd, ht = scaled ? c->roi.ht : roi->full_ht;
+          if(roi->scale > 0.0f && roi->wd >= wd && roi->ht >= ht)
+            c->roi = *roi; // an earlier consumer asked for at least as much
+          else
+          {
+            const int late = roi->scale > 0.0f;
+            if(scaled) *roi = c->roi; // ask for a downscaled image
+            else
+            {
+              roi->wd = roi->full_wd;
+              roi->ht = roi->full_ht;
+              roi->scale = 1.0; // mark as initialised, we force the resolution now
+            }
+            c->roi = *roi; // TODO: this may mean that we need a resample node if the module can't handle it!
+            // the consumers before us asked for less, they get the finer image, too:
+            if(late) sync_source_roi(graph, c->connected_mi, c->connected_mc);
+          }
         }
         // if roi->scale > 0 it has been inited before and we're late to the party!
         // in this case, reverse the process:
@@ -1626,7 +1731,25 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
     }
     return VK_SUCCESS;
   }
-  // TODO: extend the runflag to only switch on modules *after* cached input/changed parameters
+
+  if(node->cache_hit)
+  { // computed by an earlier graph, copy the output over from the node cache in staging memory
+    for(int i=0;i<node->num_connectors;i++)
+    {
+      if(!dt_connector_output(node->connector+i)) continue;
+      dt_connector_image_t *img = dt_graph_connector_image(graph, node-graph->node, i, 0, graph->frame);
+      VkBufferImageCopy region = {
+        .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .imageSubresource.layerCount = 1,
+        .imageExtent = { node->connector[i].roi.wd, node->connector[i].roi.ht, 1 },
+      };
+      IMG_LAYOUT(img, UNDEFINED, TRANSFER_DST_OPTIMAL);
+      vkCmdCopyBufferToImage(cmd_buf, node->connector[i].staging, img->image,
+          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+      IMG_LAYOUT(img, TRANSFER_DST_OPTIMAL, SHADER_READ_ONLY_OPTIMAL);
+    }
+    return VK_SUCCESS;
+  }
 
   // special case for end of pipeline and thumbnail creation:
   if(graph->thumbnail_image &&
@@ -1817,7 +1940,7 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
   }
   else if(dt_node_source(node) &&
          !dt_connector_ssbo(node->connector+0) && // ssbo source nodes use staging memory and thus don't need a copy.
-         (node->connector[0].array_length <= 1))  // arrays share the staging buffer, are handled by iterating read_source()
+         (node->connector[0].array_length <= 1))  // arrays are uploaded in batches through their staging ring, see upload_source_array()
   {
     // push profiler start
     if(graph->query[f].cnt < graph->query[f].max)
@@ -2078,12 +2201,392 @@ create_nodes(dt_graph_t *graph, dt_module_t *module, uint64_t *uniform_offset)
   }
 }
 
+// record and submit the copies of one batch of array elements, starting at
+// the given offset in the staging buffer.
+static VkResult
+upload_array_batch(
+    dt_graph_t     *graph,
+    dt_node_t      *node,
+    const uint32_t *elem,     // array indices of the batch
+    int             cnt,      // number of elements in the batch
+    uint64_t        offset,   // staging offset of the first element
+    int            *pending)  // there is a submission in flight we need to wait for
+{
+  const int c = 0, f = graph->frame % 2;
+  const uint64_t stride = array_staging_stride(node->connector+c);
+  const int yuv = node->connector[c].format == dt_token("yuv");
+  VkCommandBuffer cmd_buf = graph->command_buffer[f];
+  if(*pending) // the command buffer and the other half of the ring are free after this:
+    QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, ((uint64_t)1)<<40));
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  QVKR(vkBeginCommandBuffer(cmd_buf, &begin_info));
+  for(int k=0;k<cnt;k++)
+  {
+    const int a = elem[k];
+    dt_connector_image_t *img = dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame);
+    const uint32_t wd = MAX(1, node->connector[c].array_dim ? node->connector[c].array_dim[2*a+0] : node->connector[c].roi.wd);
+    const uint32_t ht = MAX(1, node->connector[c].array_dim ? node->connector[c].array_dim[2*a+1] : node->connector[c].roi.ht);
+    const uint64_t beg = offset + k * stride - node->connector[c].offset_staging; // relative to the staging buffer
+    VkBufferImageCopy regions[] = {{
+      .bufferOffset = beg,
+      .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .imageSubresource.layerCount = 1,
+      .imageExtent = { wd, ht, 1 },
+    },{
+      .bufferOffset = beg,
+      .imageSubresource.aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT,
+      .imageSubresource.layerCount = 1,
+      .imageExtent = { wd, ht, 1 },
+    },{
+      .bufferOffset = beg + img->plane1_offset,
+      .imageSubresource.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT,
+      .imageSubresource.layerCount = 1,
+      .imageExtent = { wd / 2, ht / 2, 1 },
+    }};
+    IMG_LAYOUT(img, UNDEFINED, TRANSFER_DST_OPTIMAL);
+    vkCmdCopyBufferToImage(
+        cmd_buf,
+        node->connector[c].staging,
+        img->image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        yuv ? 2 : 1, yuv ? regions+1 : regions);
+    IMG_LAYOUT(img, TRANSFER_DST_OPTIMAL, SHADER_READ_ONLY_OPTIMAL);
+  }
+  QVKR(vkEndCommandBuffer(cmd_buf));
+  VkSubmitInfo submit = {
+    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers    = &cmd_buf,
+  };
+  vkResetFences(qvk.device, 1, &graph->command_fence[f]);
+  QVKLR(graph->queue_mutex, vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[f]));
+  *pending = 1;
+  return VK_SUCCESS;
+}
+
+// call read_source() on all requested elements of a source array and copy
+// them to their images, a batch per submission. the staging memory is host
+// coherent and stays mapped while the gpu copies.
+static VkResult
+upload_source_array(
+    dt_graph_t *graph,
+    dt_node_t  *node,
+    uint8_t    *mapped)
+{
+  const int c = 0, f = graph->frame % 2;
+  dt_connector_t *conn = node->connector + c;
+  const uint64_t stride = array_staging_stride(conn);
+  const int batch = array_staging_batch(conn);
+  const int halves = array_staging_slots(conn) / batch;
+  uint32_t *elem = alloca(sizeof(uint32_t)*batch);
+  int half = 0, cnt = 0, pending = 0;
+  for(int a=0;a<conn->array_length;a++)
+  {
+    if(conn->array_req)
+    {
+      if(!(conn->array_req[a])) continue;
+      conn->array_req[a] = 0; // clear image load request
+    }
+    const uint64_t offset = conn->offset_staging + stride * (half * batch + cnt);
+    dt_read_source_params_t p = { .node = node, .c = c, .a = a };
+    node->module->so->read_source(node->module, mapped + offset, &p);
+    if(!dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame)->image)
+      continue; // slot will be overwritten by the next one
+    elem[cnt++] = a;
+    if(cnt == batch)
+    {
+      QVKR(upload_array_batch(graph, node, elem, cnt,
+            conn->offset_staging + stride * half * batch, &pending));
+      half = (half + 1) % halves;
+      cnt = 0;
+    }
+  }
+  if(cnt) QVKR(upload_array_batch(graph, node, elem, cnt,
+        conn->offset_staging + stride * half * batch, &pending));
+  if(pending) // the command buffer will be recorded again for the graph
+    QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, ((uint64_t)1)<<40));
+  return VK_SUCCESS;
+}
+
+// read_source jobs for all source nodes that don't go through the array upload ring.
+// one job per module, because modules may keep state across their source nodes (i-vid, v4l2).
+// only modules exporting read_source_reentrant run concurrently, the rest stays serial.
+typedef struct dt_graph_read_source_job_t
+{
+  dt_graph_t  *graph;
+  dt_module_t *module;
+  uint8_t     *mapped;
+  int          run;
+  int          dynamic_array;
+}
+dt_graph_read_source_job_t;
+
+static inline int
+read_source_requested(
+    dt_node_t *node,
+    int        run,
+    int        dynamic_array)
+{
+  const int c = 0;
+  return (node->flags & s_module_request_read_source) ||
+         (run & s_graph_run_upload_source) ||
+         (dynamic_array && (node->connector[c].flags & s_conn_dynamic_array));
+}
+
+static void
+read_source_job(dt_graph_read_source_job_t *j)
+{
+  dt_graph_t *graph = j->graph;
+  for(int n=0;n<graph->num_nodes;n++)
+  {
+    dt_node_t *node = graph->node + n;
+    const int c = 0;
+    if(node->module != j->module || !dt_node_source(node)) continue;
+    if(node->connector[c].array_length > 1) continue; // goes through the upload ring, done serially
+    if(!read_source_requested(node, j->run, j->dynamic_array)) continue;
+    if(node->connector[c].array_req)
+    {
+      if(!(node->connector[c].array_req[0])) continue;
+      node->connector[c].array_req[0] = 0; // clear image load request
+    }
+    double beg = dt_time();
+    dt_read_source_params_t p = { .node = node, .c = c, .a = 0 };
+    node->module->so->read_source(node->module,
+        j->mapped + node->connector[c].offset_staging, &p);
+    double end = dt_time();
+    dt_log(s_log_perf, "read source %"PRItkn"_%"PRItkn":\t%8.3f ms",
+        dt_token_str(node->name), dt_token_str(node->kernel), 1000.0*(end-beg));
+  }
+}
+
+static void
+read_source_range(uint32_t begin, uint32_t end, void *data)
+{
+  dt_graph_read_source_job_t *job = data;
+  for(uint32_t j=begin;j<end;j++) read_source_job(job + j);
+}
+
+// call read_source() on all requested source nodes without array elements.
+// returns when all of them are done.
+static void
+read_source_parallel(
+    dt_graph_t *graph,
+    uint8_t    *mapped,
+    int         run,
+    int         dynamic_array)
+{
+  dt_graph_read_source_job_t *job = malloc(sizeof(job[0])*graph->num_modules);
+  uint32_t cnt = 0, par = 0; // parallel jobs go first, serial ones after
+  for(int m=0;m<graph->num_modules;m++)
+  {
+    dt_module_t *mod = graph->module + m;
+    if(mod->name == 0 || !mod->so || !mod->so->read_source) continue;
+    int need = 0;
+    for(int n=0;n<graph->num_nodes && !need;n++)
+      need = graph->node[n].module == mod && dt_node_source(graph->node+n) &&
+        graph->node[n].connector[0].array_length <= 1 &&
+        read_source_requested(graph->node+n, run, dynamic_array);
+    if(!need) continue;
+    dt_graph_read_source_job_t j = {
+      .graph = graph, .module = mod, .mapped = mapped, .run = run, .dynamic_array = dynamic_array };
+    if(mod->so->read_source_reentrant)
+    {
+      if(par < cnt) job[cnt] = job[par]; // move the first serial job out of the way
+      job[par++] = j;
+      cnt++;
+    }
+    else job[cnt++] = j;
+  }
+  if(par > 1) threads_parallel_for(0, par, 1, read_source_range, job);
+  else read_source_range(0, par, job);
+  read_source_range(par, cnt, job);
+  free(job);
+}
+
+// intermediate cache: flag the cache module and everything depending on it
+// dirty. returns 1 if nothing upstream of it changed since the last run, i.e.
+// only the dirty nodes need to run. a new active module moves the boundary of
+// resident outputs, which requires to allocate (and upload) again.
+static int
+cache_update(
+    dt_graph_t     *graph,
+    const uint32_t *modid,
+    int             cnt,
+    dt_graph_run_t *run)
+{
+  if(graph->active_module != graph->cache_module &&
+     (*run & s_graph_run_record_cmd_buf))
+    *run |= s_graph_run_alloc | s_graph_run_upload_source;
+  if(*run & s_graph_run_alloc)
+    graph->cache_module = graph->active_module;
+
+  int clean = graph->cache_module >= 0 && graph->frame == graph->cache_frame &&
+    !(*run & (s_graph_run_alloc | s_graph_run_upload_source | s_graph_run_before_active));
+  int stale = 0;
+  for(int i=0;i<cnt;i++)
+  {
+    dt_module_t *mod = graph->module + modid[i];
+    const uint64_t hash = dt_hash(dt_hash_init, mod->param, mod->param_size);
+    int dirty = modid[i] == graph->cache_module;
+    for(int c=0;c<mod->num_connectors && !dirty;c++)
+      if(dt_connector_input(mod->connector+c) && mod->connector[c].connected_mi >= 0 &&
+        !(mod->connector[c].flags & s_conn_feedback))
+        dirty = graph->module[mod->connector[c].connected_mi].cache_dirty;
+    if(!dirty && (hash != mod->param_hash || (mod->flags &
+        (s_module_request_read_source | s_module_request_read_geo | s_module_request_dyn_array))))
+      clean = 0; // changed upstream of the cache module
+    if(!dirty && hash != mod->param_hash) stale = 1;
+    mod->cache_dirty = dirty;
+    mod->param_hash  = hash;
+  }
+  // the node hashes are only computed when allocating. if they don't match the
+  // resident outputs any more, move the cache module on the next occasion:
+  if(stale && !(*run & s_graph_run_alloc)) graph->cache_module = -1;
+  return clean;
+}
+
+// content hash of the output of a node, the key into the node cache. stays 0
+// if the output can't be cached: buffers, arrays, feedback, animations, more
+// than one output, or modules requesting input that the params don't know.
+static void
+node_hash(dt_graph_t *graph, dt_node_t *node)
+{
+  node->hash = 0;
+  if(graph->frame_cnt > 1 || node->flags || node->module->flags || dt_node_sink(node)) return;
+  uint64_t h = dt_hash_init;
+  h = dt_hash(h, &node->module->name, sizeof(dt_token_t));
+  h = dt_hash(h, &node->name,   sizeof(dt_token_t));
+  h = dt_hash(h, &node->kernel, sizeof(dt_token_t));
+  h = dt_hash(h, node->module->param, node->module->param_size);
+  h = dt_hash(h, node->push_constant, node->push_constant_size);
+  int inputs = 0, outputs = 0;
+  for(int i=0;i<node->num_connectors;i++)
+  {
+    dt_connector_t *c = node->connector+i;
+    if(dt_connector_ssbo(c) || c->array_length > 1 || c->frames > 1 ||
+       c->format == dt_token("yuv") ||
+       (c->flags & (s_conn_feedback | s_conn_dynamic_array))) return;
+    h = dt_hash(h, &c->roi,    sizeof(c->roi));
+    h = dt_hash(h, &c->chan,   sizeof(c->chan));
+    h = dt_hash(h, &c->format, sizeof(c->format));
+    if(dt_connector_output(c)) outputs++;
+    else
+    {
+      if(c->connected_mi < 0 || !graph->node[c->connected_mi].hash) return;
+      h = dt_hash(h, &graph->node[c->connected_mi].hash, sizeof(uint64_t));
+      h = dt_hash(h, &c->connected_mc, sizeof(c->connected_mc));
+      inputs++;
+    }
+  }
+  if(outputs != 1) return;
+  if(!inputs)
+  { // file names are relative to the search path, and the files may change on disk
+    h = dt_hash(h, graph->searchpath, strlen(graph->searchpath));
+    dt_module_t *mod = node->module;
+    for(int p=0;p<mod->so->num_params;p++)
+    {
+      if(mod->so->param[p]->type != dt_token("string")) continue;
+      char filename[2*PATH_MAX+10];
+      const char *fname = dt_module_param_string(mod, p);
+      struct stat statbuf;
+      if(!fname[0] || dt_graph_get_resource_filename(mod, fname, graph->frame, filename, sizeof(filename)) ||
+         stat(filename, &statbuf)) continue;
+      const int64_t st[] = { statbuf.st_mtime, statbuf.st_size };
+      h = dt_hash(h, st, sizeof(st));
+    }
+  }
+  node->hash = h ? h : 1;
+}
+
+// hash all nodes and find their outputs in the node cache. walking backwards
+// from the sinks, only nodes that feed into something computed need to run.
+// the results are only valid for the run that allocates, as the staging
+// memory for the hits is allocated along with the outputs.
+static void
+nodecache_lookup(dt_graph_t *graph, const uint32_t *nodeid, int cnt)
+{
+  int feedback = 0;
+  for(int i=0;i<cnt;i++)
+  {
+    dt_node_t *node = graph->node + nodeid[i];
+    node_hash(graph, node);
+    nodecache_drop(node);
+    node->cache_need = 0;
+    for(int k=0;k<node->num_connectors;k++)
+      if(node->connector[k].flags & s_conn_feedback) feedback = 1;
+    if(!node->hash || !dt_pipe.nodecache.max_bytes || dt_node_source(node)) continue;
+    if(graph->cache_intermediate && node->module->cache_dirty) continue; // partial runs compute it
+    for(int k=0;k<node->num_connectors;k++)
+      if(dt_connector_output(node->connector+k))
+      { // hold on to the data, other threads may evict the entry until we upload it
+        node->cache_data = dt_nodecache_get(&dt_pipe.nodecache, node->hash,
+            dt_connector_bufsize(node->connector+k, node->connector[k].roi.wd, node->connector[k].roi.ht));
+        node->cache_hit = node->cache_data != 0;
+      }
+  }
+  uint32_t hits = 0, skipped = 0;
+  for(int i=cnt-1;i>=0;i--)
+  {
+    dt_node_t *node = graph->node + nodeid[i];
+    if(feedback) nodecache_drop(node); // the backward walk doesn't see these connections
+    if(feedback || !dt_pipe.nodecache.max_bytes || dt_node_sink(node) || dt_node_source(node))
+      node->cache_need = 1;
+    if(!node->cache_need) { nodecache_drop(node); skipped++; continue; }
+    if(node->cache_hit) { hits++; continue; }
+    for(int k=0;k<node->num_connectors;k++)
+      if(dt_connector_input(node->connector+k) && node->connector[k].connected_mi >= 0)
+        graph->node[node->connector[k].connected_mi].cache_need = 1;
+  }
+  if(dt_pipe.nodecache.max_bytes)
+    dt_log(s_log_perf, "node cache:\t%u hits, %u nodes skipped", hits, skipped);
+}
+
+// grow the cached traversal order to hold at least cnt ids
+static int
+order_reserve(uint32_t **order, uint32_t *max, uint32_t cnt)
+{
+  if(cnt <= *max) return 0;
+  uint32_t *o = realloc(*order, sizeof(uint32_t)*cnt);
+  if(!o) return 1;
+  *order = o;
+  *max = cnt;
+  return 0;
+}
+
+// copy the outputs of cache hits to their staging memory and let go of them
+static VkResult
+nodecache_upload(dt_graph_t *graph, const uint32_t *nodeid, int cnt)
+{
+  uint8_t *mapped = 0;
+  for(int i=0;i<cnt;i++)
+  {
+    dt_node_t *node = graph->node + nodeid[i];
+    if(!node->cache_hit) continue;
+    if(!mapped) QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+    for(int k=0;k<node->num_connectors;k++)
+    {
+      dt_connector_t *c = node->connector+k;
+      if(dt_connector_output(c))
+        memcpy(mapped + c->offset_staging, node->cache_data, dt_connector_bufsize(c, c->roi.wd, c->roi.ht));
+    }
+    dt_nodecache_release(&dt_pipe.nodecache, node->cache_data);
+    node->cache_data = 0; // cache_hit stays set for recording the command buffer
+  }
+  if(mapped) vkUnmapMemory(qvk.device, graph->vkmem_staging);
+  return VK_SUCCESS;
+}
+
 VkResult dt_graph_run(
     dt_graph_t     *graph,
     dt_graph_run_t  run)
 {
   double clock_beg = dt_time();
+  uint64_t trace_beg = dt_trace_now();
   dt_module_flags_t module_flags = 0;
+  int cached = 0; // only run nodes depending on the cache module
   const int f  = graph->frame % 2;     // recording this pipeline now
   const int fp = (graph->frame+1) % 2; // waiting for the previous frame
 
@@ -2093,16 +2596,23 @@ VkResult dt_graph_run(
   QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, ((uint64_t)1)<<40)); // wait for last invocation of our command buffer, just in case
 
 { // module scope
-  // find list of modules in post order
-  uint32_t modid[100];
-  assert(sizeof(modid)/sizeof(modid[0]) >= graph->num_modules);
-
-  int cnt = 0;
-  dt_module_t *const arr = graph->module;
-  const int arr_cnt = graph->num_modules;
+  // find list of modules in post order, only after the connections changed
+  if(!graph->module_order_valid && order_reserve(&graph->module_order, &graph->module_order_max, graph->num_modules))
+    return VK_ERROR_OUT_OF_HOST_MEMORY;
+  uint32_t *modid = graph->module_order;
+  if(!graph->module_order_valid)
+  {
+    int cnt = 0;
+    dt_module_t *const arr = graph->module;
+    const int arr_cnt = graph->num_modules;
+#define TRAVERSE_SCRATCH &graph->traverse
 #define TRAVERSE_POST \
-  modid[cnt++] = curr;
+    modid[cnt++] = curr;
 #include "graph-traverse.inc"
+    graph->module_order_cnt = cnt;
+    graph->module_order_valid = 1;
+  }
+  const int cnt = graph->module_order_cnt;
 
   int main_input_module = -1;
   // find extra module flags
@@ -2117,6 +2627,8 @@ VkResult dt_graph_run(
   // at least one module requested a full rebuild:
   if(module_flags & s_module_request_all) run |= s_graph_run_all;
 
+  if(graph->cache_intermediate) cached = cache_update(graph, modid, cnt, &run);
+
   // if synchronous upload/download is required, we can't interleave frames:
   if((run & (s_graph_run_upload_source | s_graph_run_download_sink)) ||
      (module_flags & (s_module_request_read_source | s_module_request_write_sink)))
@@ -2172,6 +2684,8 @@ VkResult dt_graph_run(
   }
 
 
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("roi"));
+
   // we want to make sure the last output/display is initialised.
   // if the roi out is 0, probably reading some sources went wrong and we need
   // to abort right here!
@@ -2241,6 +2755,7 @@ VkResult dt_graph_run(
         if(c->staging) vkDestroyBuffer(qvk.device, c->staging, VK_NULL_HANDLE);
         c->staging = 0;
       }
+      nodecache_drop(graph->node + i);
       vkDestroyPipelineLayout     (qvk.device, graph->node[i].pipeline_layout,  0);
       vkDestroyPipeline           (qvk.device, graph->node[i].pipeline,         0);
       vkDestroyDescriptorSetLayout(qvk.device, graph->node[i].dset_layout,      0);
@@ -2255,6 +2770,7 @@ VkResult dt_graph_run(
     }
     dt_raytrace_graph_cleanup(graph);
     graph->num_nodes = 0;
+    graph->node_order_valid = 0;
     // we need two uint32, alignment is 64 bytes
     graph->uniform_global_size = qvk.uniform_alignment; // global data, aligned
     uint64_t uniform_offset = graph->uniform_global_size;
@@ -2324,20 +2840,30 @@ VkResult dt_graph_run(
   }
   // one last check:
   if(main_input_module >= 0 && graph->module[main_input_module].connector[0].roi.wd == 0) return VK_INCOMPLETE;
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("nodes"));
 } // end scope, done with modules
 
   // if no more action than generating the output roi was requested, exit now:
   if(run < s_graph_run_create_nodes<<1) return VK_SUCCESS;
 
 { // node scope
-  int cnt = 0;
-  dt_node_t *const arr = graph->node;
-  const int arr_cnt = graph->num_nodes;
-  uint32_t nodeid[2000];
-  assert(sizeof(nodeid)/sizeof(nodeid[0]) >= graph->num_nodes);
+  // find list of nodes in post order, only after they have been created
+  if(!graph->node_order_valid && order_reserve(&graph->node_order, &graph->node_order_max, graph->num_nodes))
+    return VK_ERROR_OUT_OF_HOST_MEMORY;
+  uint32_t *nodeid = graph->node_order;
+  if(!graph->node_order_valid)
+  {
+    int cnt = 0;
+    dt_node_t *const arr = graph->node;
+    const int arr_cnt = graph->num_nodes;
+#define TRAVERSE_SCRATCH &graph->traverse
 #define TRAVERSE_POST \
-  nodeid[cnt++] = curr;
+    nodeid[cnt++] = curr;
 #include "graph-traverse.inc"
+    graph->node_order_cnt = cnt;
+    graph->node_order_valid = 1;
+  }
+  const int cnt = graph->node_order_cnt;
 
   if(cnt == 0)
   {
@@ -2371,11 +2897,21 @@ VkResult dt_graph_run(
     graph->memory_type_bits = ~0u;
     graph->memory_type_bits_ssbo = ~0u;
     graph->memory_type_bits_staging = ~0u;
+    nodecache_lookup(graph, nodeid, cnt);
     for(int i=0;i<cnt;i++)
     {
+      graph->heap.step = graph->heap_ssbo.step = i;
       QVKR(alloc_outputs(graph, graph->node+nodeid[i]));
       QVKR(free_inputs  (graph, graph->node+nodeid[i]));
     }
+    graph->heap.step = graph->heap_ssbo.step = cnt;
+    // first fit placement depends on the traversal order. now that we know
+    // all lifetimes, pack them offline and use that if it needs less memory:
+    const int plan_heap = dt_vkalloc_plan(&graph->heap);
+    const int plan_ssbo = dt_vkalloc_plan(&graph->heap_ssbo);
+    if(plan_heap || plan_ssbo)
+      for(int i=0;i<cnt;i++)
+        apply_memory_plan(graph, graph->node+nodeid[i], plan_heap, plan_ssbo);
   }
 
   if(graph->heap.vmsize > graph->vkmem_size)
@@ -2560,6 +3096,9 @@ VkResult dt_graph_run(
     for(int i=0;i<cnt;i++)
       QVKR(alloc_outputs3(graph, graph->node+nodeid[i]));
 
+  if(run & s_graph_run_alloc)
+    QVKR(nodecache_upload(graph, nodeid, cnt));
+
   // find dynamically allocated connector in node that has array requests set:
   int dynamic_array = 0; // will remain 0 if there are dynamic arrays that did not request changes, triggers upload later
   for(int i=0;i<cnt;i++)
@@ -2618,6 +3157,8 @@ VkResult dt_graph_run(
     for(int i=0;i<cnt;i++) for(int j=0;j<graph->node[nodeid[i]].num_connectors;j++)
       write_descriptor_sets(graph, graph->node+nodeid[i], graph->node[nodeid[i]].connector + j, 1);
 
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("alloc"));
+
   // upload all source data to staging memory
   threads_mutex_t *mutex = 0;// graph->io_mutex; // no speed impact, maybe not needed
   if(mutex) threads_mutex_lock(mutex);
@@ -2628,79 +3169,17 @@ VkResult dt_graph_run(
     double upload_beg = dt_time();
     uint8_t *mapped = 0;
     QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+    // independent source nodes write to disjoint staging memory, read them in parallel:
+    read_source_parallel(graph, mapped, run, dynamic_array);
     for(int n=0;n<graph->num_nodes;n++)
-    { // for all source nodes:
+    { // for all source nodes with arrays:
       dt_node_t *node = graph->node + n;
       if(dt_node_source(node))
       {
         if(node->module->so->read_source)
         {
-          int run_node = (node->flags & s_module_request_read_source) ||
-                         (run & s_graph_run_upload_source);
-          const int c = 0;
-          if(run_node || (dynamic_array && (node->connector[c].flags & s_conn_dynamic_array)))
-          {
-            for(int a=0;a<MAX(1,node->connector[c].array_length);a++)
-            {
-              if(node->connector[c].array_req)
-              {
-                if(!(node->connector[c].array_req[a])) continue;
-                node->connector[c].array_req[a] = 0; // clear image load request
-              }
-              dt_read_source_params_t p = { .node = node, .c = c, .a = a };
-              node->module->so->read_source(node->module,
-                  mapped + node->connector[c].offset_staging, &p);
-              if(node->connector[c].array_length > 1)
-              {
-                if(!dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame)->image)
-                  continue;
-                vkUnmapMemory(qvk.device, graph->vkmem_staging);
-                const uint32_t wd = MAX(1, node->connector[c].array_dim ? node->connector[c].array_dim[2*a+0] : node->connector[c].roi.wd);
-                const uint32_t ht = MAX(1, node->connector[c].array_dim ? node->connector[c].array_dim[2*a+1] : node->connector[c].roi.ht);
-                VkBufferImageCopy regions[] = {{
-                  .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                  .imageSubresource.layerCount = 1,
-                  .imageExtent = { wd, ht, 1 },
-                },{
-                  .imageSubresource.aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT,
-                  .imageSubresource.layerCount = 1,
-                  .imageExtent = { wd, ht, 1 },
-                },{
-                  .bufferOffset = dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame)->plane1_offset,
-                  .imageSubresource.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT,
-                  .imageSubresource.layerCount = 1,
-                  .imageExtent = { wd / 2, ht / 2, 1 },
-                }};
-                const int yuv = node->connector[c].format == dt_token("yuv");
-                VkCommandBuffer cmd_buf = graph->command_buffer[f];
-                QVKR(vkBeginCommandBuffer(cmd_buf, &begin_info));
-                IMG_LAYOUT(
-                    dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame),
-                    UNDEFINED,
-                    TRANSFER_DST_OPTIMAL);
-                vkCmdCopyBufferToImage(
-                    cmd_buf,
-                    node->connector[c].staging,
-                    dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame)->image,
-                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                    yuv ? 2 : 1, yuv ? regions+1 : regions);
-                IMG_LAYOUT(
-                    dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame),
-                    TRANSFER_DST_OPTIMAL,
-                    SHADER_READ_ONLY_OPTIMAL);
-                QVKR(vkEndCommandBuffer(cmd_buf));
-                VkSubmitInfo submit = {
-                  .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                  .commandBufferCount = 1,
-                  .pCommandBuffers    = &cmd_buf,
-                };
-                vkResetFences(qvk.device, 1, &graph->command_fence[f]);
-                QVKLR(graph->queue_mutex, vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[f]));
-                QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, ((uint64_t)1)<<40)); // wait inline on our lock because we share the staging buf
-                QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
-              }
-            }
-          }
+          if(node->connector[0].array_length > 1 && read_source_requested(node, run, dynamic_array))
+            QVKR(upload_source_array(graph, node, mapped));
         }
         else
           dt_log(s_log_err|s_log_pipe, "source node '%"PRItkn"' has no read_source() callback!",
@@ -2712,6 +3191,7 @@ VkResult dt_graph_run(
     dt_log(s_log_perf, "upload source total:\t%8.3f ms", 1000.0*(upload_end-upload_beg));
   }
   if(mutex) threads_mutex_unlock(mutex);
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("upload"));
 
   if(run & s_graph_run_record_cmd_buf)
   {
@@ -2725,8 +3205,17 @@ VkResult dt_graph_run(
     double rt_end = dt_time();
     dt_log(s_log_perf, "create raytrace accel:\t%8.3f ms", 1000.0*(rt_end-rt_beg));
     rt_beg = rt_end;
+    graph->cache_hits = graph->cache_misses = 0;
     for(int i=0;i<cnt;i++)
     {
+      if(cached && !graph->node[nodeid[i]].module->cache_dirty)
+      { // outputs are still resident from the last run
+        graph->cache_hits++;
+        continue;
+      }
+      if((run & s_graph_run_alloc) && !graph->node[nodeid[i]].cache_need)
+        continue; // only feeds into outputs from the node cache
+      graph->cache_misses++;
       VkResult res = record_command_buffer(graph, graph->node+nodeid[i], run_all ||
           (graph->node[nodeid[i]].module->flags & s_module_request_read_source));
       if(res != VK_SUCCESS)
@@ -2736,46 +3225,53 @@ VkResult dt_graph_run(
       }
     }
     rt_end = dt_time();
+    for(int i=0;i<cnt;i++) // from now on compute everything again
+      graph->node[nodeid[i]].cache_hit = 0;
+    graph->cache_frame = graph->frame;
     dt_log(s_log_perf, "record command buffer:\t%8.3f ms", 1000.0*(rt_end-rt_beg));
+    if(graph->cache_intermediate)
+      dt_log(s_log_perf, "intermediate cache:\t%u hits %u misses", graph->cache_hits, graph->cache_misses);
     QVKR(vkEndCommandBuffer(graph->command_buffer[f]));
   }
 } // end scope, done with nodes
 
   if(run & s_graph_run_alloc)
   {
-    dt_log(s_log_mem, "images : peak rss %g MB vmsize %g MB",
+    dt_log(s_log_mem, "images : peak rss %g MB vmsize %g MB planned, %g MB first fit",
         graph->heap.peak_rss/(1024.0*1024.0),
-        graph->heap.vmsize  /(1024.0*1024.0));
-    dt_log(s_log_mem, "buffers: peak rss %g MB vmsize %g MB",
+        graph->heap.vmsize  /(1024.0*1024.0),
+        graph->heap.vmsize_ff/(1024.0*1024.0));
+    dt_log(s_log_mem, "buffers: peak rss %g MB vmsize %g MB planned, %g MB first fit",
         graph->heap_ssbo.peak_rss/(1024.0*1024.0),
-        graph->heap_ssbo.vmsize  /(1024.0*1024.0));
+        graph->heap_ssbo.vmsize  /(1024.0*1024.0),
+        graph->heap_ssbo.vmsize_ff/(1024.0*1024.0));
     dt_log(s_log_mem, "staging: peak rss %g MB vmsize %g MB",
         graph->heap_staging.peak_rss/(1024.0*1024.0),
         graph->heap_staging.vmsize  /(1024.0*1024.0));
   }
 
   // now upload uniform data before submitting command buffer
-{ // module traversal
-  dt_module_t *const arr = graph->module;
-  const int arr_cnt = graph->num_modules;
+{ // module traversal, in the cached post order
   uint8_t *uniform_mem = 0;
   QVKR(vkMapMemory(qvk.device, graph->vkmem_uniform, ((uint64_t)f) * graph->uniform_size,
         graph->uniform_size, 0, (void**)&uniform_mem));
   ((uint32_t *)uniform_mem)[0] = graph->frame;
   ((uint32_t *)uniform_mem)[1] = graph->frame_cnt;
-#define TRAVERSE_POST \
-  dt_module_t *mod = arr+curr;\
-  if(mod->so->commit_params)\
-    mod->so->commit_params(graph, mod);\
-  if(mod->committed_param_size)\
-    memcpy(uniform_mem + mod->uniform_offset, mod->committed_param, mod->committed_param_size);\
-  else if(mod->param_size)\
-    memcpy(uniform_mem + mod->uniform_offset, mod->param, mod->param_size);
-#include "graph-traverse.inc"
+  for(uint32_t i=0;i<graph->module_order_cnt;i++)
+  {
+    dt_module_t *mod = graph->module + graph->module_order[i];
+    if(mod->so->commit_params)
+      mod->so->commit_params(graph, mod);
+    if(mod->committed_param_size)
+      memcpy(uniform_mem + mod->uniform_offset, mod->committed_param, mod->committed_param_size);
+    else if(mod->param_size)
+      memcpy(uniform_mem + mod->uniform_offset, mod->param, mod->param_size);
+  }
   vkUnmapMemory(qvk.device, graph->vkmem_uniform);
 }
 
   double clock_end = dt_time();
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("record"));
   dt_log(s_log_perf, "record cmd buffer:\t%8.3f ms", 1000.0*(clock_end - clock_beg));
 
   VkSubmitInfo submit = {
@@ -2787,13 +3283,15 @@ VkResult dt_graph_run(
   if(run & s_graph_run_record_cmd_buf)
   {
     vkResetFences(qvk.device, 1, &graph->command_fence[f]);
+    graph->query[f].submit_time = dt_trace_now();
     QVKLR(graph->queue_mutex, vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[f]));
     if(run & s_graph_run_wait_done) // timeout in nanoseconds, 30 is about 1s
       QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, ((uint64_t)1)<<30)); // wait for our command buffer
     else
       QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[fp], VK_TRUE, ((uint64_t)1)<<30)); // wait for previous command buffer
   }
-  
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("submit"));
+
   // XXX FIXME: this is a race condition for multi-frames. we'll need to wait until download is complete before starting the other command buffer!
   // XXX FIXME: maybe lock the queue mutex around the whole block?
   // XXX FIXME: may need an entirely different logic block for single frame?
@@ -2820,7 +3318,9 @@ VkResult dt_graph_run(
     }
   }
 
-  if(dt_log_global.mask & s_log_perf)
+  dt_trace_phase(&trace_beg, dt_token("graph"), dt_token("download"));
+
+  if((dt_log_global.mask & s_log_perf) || dt_trace_enabled())
   {
     int q = fp;
     if(run & s_graph_run_wait_done) q = f; // if we're synchronous, use the one we just waited for
@@ -2856,7 +3356,15 @@ VkResult dt_graph_run(
           8, 8, dt_token_str(graph->query[q].kernel[i]),
           (graph->query[q].pool_results[i+1]-
           graph->query[q].pool_results[i])* 1e-6 * qvk.ticks_to_nanoseconds);
+      if(dt_trace_enabled() && graph->query[q].submit_time)
+      { // the gpu clock is not ours, start the first kernel at submit time
+        const uint64_t *res = graph->query[q].pool_results;
+        dt_trace_event(graph->query[q].name[i], graph->query[q].kernel[i],
+            graph->query[q].submit_time + (uint64_t)((res[i]  -res[0]) * qvk.ticks_to_nanoseconds),
+            graph->query[q].submit_time + (uint64_t)((res[i+1]-res[0]) * qvk.ticks_to_nanoseconds), 1);
+      }
     }
+    graph->query[q].submit_time = 0; // don't trace the same results twice
     if(graph->query[q].cnt)
     {
       graph->query[q].last_frame_duration = (graph->query[q].pool_results[graph->query[q].cnt-1]-graph->query[q].pool_results[0])*1e-6 * qvk.ticks_to_nanoseconds;
@@ -2869,6 +3377,104 @@ VkResult dt_graph_run(
   return VK_SUCCESS;
 }
 
+// download one output image of a node and put it into the node cache
+static VkResult
+nodecache_download(dt_graph_t *graph, dt_node_t *node, int c)
+{
+  dt_connector_t *cn = node->connector + c;
+  dt_connector_image_t *img = dt_graph_connector_image(graph, node-graph->node, c, 0, graph->frame);
+  if(!img || !img->image) return VK_SUCCESS;
+  const uint64_t size = dt_connector_bufsize(cn, cn->roi.wd, cn->roi.ht);
+  VkBuffer buffer = 0;
+  VkDeviceMemory vkmem = 0;
+  VkBufferCreateInfo buffer_info = {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size        = size,
+    .usage       = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  QVKR(vkCreateBuffer(qvk.device, &buffer_info, 0, &buffer));
+  VkMemoryRequirements mem_req;
+  vkGetBufferMemoryRequirements(qvk.device, buffer, &mem_req);
+  VkMemoryAllocateInfo mem_alloc_info = {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = mem_req.size,
+    .memoryTypeIndex = qvk_get_memory_type(mem_req.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+  };
+  VkResult res = vkAllocateMemory(qvk.device, &mem_alloc_info, 0, &vkmem);
+  if(res == VK_SUCCESS) res = vkBindBufferMemory(qvk.device, buffer, vkmem, 0);
+  if(res == VK_SUCCESS)
+  {
+    VkCommandBuffer cmd_buf = graph->command_buffer[0];
+    VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    VkBufferImageCopy region = {
+      .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .imageSubresource.layerCount = 1,
+      .imageExtent = { cn->roi.wd, cn->roi.ht, 1 },
+    };
+    vkBeginCommandBuffer(cmd_buf, &begin_info);
+    IMG_LAYOUT(img, SHADER_READ_ONLY_OPTIMAL, TRANSFER_SRC_OPTIMAL);
+    vkCmdCopyImageToBuffer(cmd_buf, img->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1, &region);
+    IMG_LAYOUT(img, TRANSFER_SRC_OPTIMAL, SHADER_READ_ONLY_OPTIMAL);
+    vkEndCommandBuffer(cmd_buf);
+    VkSubmitInfo submit = {
+      .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers    = &cmd_buf,
+    };
+    vkResetFences(qvk.device, 1, &graph->command_fence[0]);
+    if(graph->queue_mutex) threads_mutex_lock(graph->queue_mutex);
+    res = vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[0]);
+    if(graph->queue_mutex) threads_mutex_unlock(graph->queue_mutex);
+    if(res == VK_SUCCESS)
+      res = vkWaitForFences(qvk.device, 1, &graph->command_fence[0], VK_TRUE, ((uint64_t)1)<<40);
+  }
+  void *mapped = 0;
+  if(res == VK_SUCCESS) res = vkMapMemory(qvk.device, vkmem, 0, size, 0, &mapped);
+  if(res == VK_SUCCESS)
+  {
+    dt_nodecache_write(&dt_pipe.nodecache, node->hash, mapped, size);
+    vkUnmapMemory(qvk.device, vkmem);
+  }
+  vkDestroyBuffer(qvk.device, buffer, 0);
+  if(vkmem) vkFreeMemory(qvk.device, vkmem, 0);
+  return res;
+}
+
+VkResult
+dt_graph_evict_nodecache(dt_graph_t *graph)
+{
+  if(!dt_pipe.nodecache.max_bytes || !graph->cache_intermediate ||
+     graph->cache_module < 0 || graph->cache_frame != graph->frame)
+    return VK_SUCCESS;
+  QVKLR(&qvk.queue_mutex, vkDeviceWaitIdle(qvk.device));
+  int cnt = 0;
+  for(int n=0;n<graph->num_nodes;n++)
+  { // the inputs dirty nodes read from clean ones are what we kept resident
+    dt_node_t *node = graph->node + n;
+    if(!node->module->cache_dirty) continue;
+    for(int i=0;i<node->num_connectors;i++)
+    {
+      dt_connector_t *c = node->connector + i;
+      if(!dt_connector_input(c) || c->connected_mi < 0) continue;
+      dt_node_t *src = graph->node + c->connected_mi;
+      dt_connector_t *out = src->connector + c->connected_mc;
+      if(!src->hash || src->module->cache_dirty || dt_node_source(src) ||
+          dt_nodecache_has(&dt_pipe.nodecache, src->hash, dt_connector_bufsize(out, out->roi.wd, out->roi.ht)))
+        continue;
+      QVKR(nodecache_download(graph, src, c->connected_mc));
+      cnt++;
+    }
+  }
+  dt_log(s_log_perf, "node cache:\t%d outputs stored, %.1f MB in use", cnt,
+      dt_pipe.nodecache.bytes/(1024.0*1024.0));
+  return VK_SUCCESS;
+}
+
 dt_node_t *
 dt_graph_get_display(
     dt_graph_t *g,
@@ -2918,6 +3524,8 @@ void dt_graph_reset(dt_graph_t *g)
   g->gui_attached = 0;
   g->gui_msg = 0;
   g->active_module = 0;
+  g->cache_intermediate = 0;
+  g->cache_module = -1;
   g->lod_scale = 0;
   g->runflags = 0;
   g->frame = 0;
@@ -2952,6 +3560,7 @@ void dt_graph_reset(dt_graph_t *g)
         c->array_mem = 0;
       }
     }
+    nodecache_drop(g->node + i);
     vkDestroyPipelineLayout     (qvk.device, g->node[i].pipeline_layout,  0);
     vkDestroyPipeline           (qvk.device, g->node[i].pipeline,         0);
     vkDestroyDescriptorSetLayout(qvk.device, g->node[i].dset_layout,      0);
@@ -2966,6 +3575,8 @@ void dt_graph_reset(dt_graph_t *g)
   g->conn_image_end = 0;
   g->num_nodes = 0;
   g->num_modules = 0;
+  g->module_order_valid = 0;
+  g->node_order_valid = 0;
 }
 
 void
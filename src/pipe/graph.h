@@ -3,6 +3,8 @@
 #include "module.h"
 #include "alloc.h"
 #include "raytrace.h"
+#include <stdlib.h>
+#include <string.h>
 #ifdef DEBUG_MARKERS
 #include "db/db.h"         // for string pool type
 #endif
@@ -16,6 +18,7 @@ typedef struct dt_connector_image_t
   uint64_t      plane1_offset;  // yuv buffers need the offset to the chroma plane
   uint32_t      wd, ht;         // if non zero, these are the varying dimensions of image arrays
   dt_vkmem_t   *mem;            // used for alloc/free during graph traversal
+  uint32_t      rec;            // lifetime record of mem in the heap, to apply the memory plan
   VkImage       image;          // vulkan image object
   VkImageView   image_view;
   VkImageLayout layout;
@@ -32,9 +35,61 @@ typedef struct dt_graph_query_t
   dt_token_t  *name;
   dt_token_t  *kernel;
   float        last_frame_duration; // for convenience the last frame time in milliseconds
+  uint64_t     submit_time;         // cpu time the command buffer was submitted, to place the gpu events in the trace
 }
 dt_graph_query_t;
 
+// scratch memory for graph-traverse.inc, grown on demand and kept around
+// between traversals so we don't depend on the size of the graph.
+typedef struct dt_graph_traverse_t
+{
+  uint32_t *stack;          // node/module ids to work on
+  uint32_t *feedback_stack; // feedback node/module ids
+  uint8_t  *done;           // size is stack size
+  uint8_t  *mark;           // size is number of nodes/modules
+  uint32_t  max_stack, max_arr;
+}
+dt_graph_traverse_t;
+
+// make sure the scratch memory can hold a traversal of arr_cnt elements with
+// at most stack_cnt stack entries. returns non-zero on allocation failure.
+static inline int
+dt_graph_traverse_alloc(
+    dt_graph_traverse_t *t,
+    uint32_t             arr_cnt,
+    uint32_t             stack_cnt)
+{
+  if(stack_cnt > t->max_stack)
+  {
+    uint32_t *s  = (uint32_t *)realloc(t->stack,          sizeof(uint32_t)*stack_cnt);
+    if(s)  t->stack = s;
+    uint32_t *fs = (uint32_t *)realloc(t->feedback_stack, sizeof(uint32_t)*stack_cnt);
+    if(fs) t->feedback_stack = fs;
+    uint8_t  *d  = (uint8_t  *)realloc(t->done,           sizeof(uint8_t)*stack_cnt);
+    if(d)  t->done = d;
+    if(!s || !fs || !d) return 1;
+    t->max_stack = stack_cnt;
+  }
+  if(arr_cnt > t->max_arr)
+  {
+    uint8_t *m = (uint8_t *)realloc(t->mark, sizeof(uint8_t)*arr_cnt);
+    if(!m) return 1;
+    t->mark = m;
+    t->max_arr = arr_cnt;
+  }
+  return 0;
+}
+
+static inline void
+dt_graph_traverse_cleanup(dt_graph_traverse_t *t)
+{
+  free(t->stack);
+  free(t->feedback_stack);
+  free(t->done);
+  free(t->mark);
+  memset(t, 0, sizeof(*t));
+}
+
 // the graph is stored as list of modules and list of nodes.
 // these have connectors with detailed buffer information which
 // also hold the id to the other connected module or node. thus,
@@ -100,6 +155,14 @@ typedef struct dt_graph_t
 
   dt_graph_query_t      query[2];            // for odd and even command buffers, starting at half query_max
 
+  dt_graph_traverse_t   traverse;            // scratch memory for graph-traverse.inc
+  uint32_t             *module_order;        // cached post order of modules, as found by the last traversal
+  uint32_t             *node_order;          // cached post order of nodes
+  uint32_t              module_order_cnt, module_order_max;
+  uint32_t              node_order_cnt,   node_order_max;
+  int                   module_order_valid;  // reset when connecting/adding/removing modules
+  int                   node_order_valid;    // reset when creating nodes
+
   uint32_t              dset_cnt_image_read,  dset_cnt_image_read_alloc;
   uint32_t              dset_cnt_image_write, dset_cnt_image_write_alloc;
   uint32_t              dset_cnt_buffer,      dset_cnt_buffer_alloc;
@@ -109,6 +172,15 @@ typedef struct dt_graph_t
   int                   lod_scale;     // scale output down by this factor. default = 1.
   int                   active_module; // currently active module, relevant for runflags
 
+  // intermediate cache: when allocating, keep the outputs upstream of the
+  // active module resident. parameter changes at or after it then only
+  // re-record and dispatch the nodes depending on it.
+  int                   cache_intermediate; // enable the above, the gui does that
+  int                   cache_module;  // module the memory was allocated for, or -1
+  int                   cache_frame;   // the resident outputs are valid for this frame only
+  uint32_t              cache_hits;    // nodes skipped in the last run
+  uint32_t              cache_misses;  // nodes recorded in the last run
+
   int                   frame;
   int                   frame_cnt;     // number of frames to compute
   double                frame_rate;    // frame rate (frames per second)
@@ -141,6 +213,11 @@ VkResult dt_graph_run(
     dt_graph_t     *graph,
     dt_graph_run_t  run);
 
+// before tearing down a graph, store the outputs it keeps resident for the
+// intermediate cache in the host memory node cache (dt_pipe.nodecache), so a
+// later graph computing the same can start from there.
+VkResult dt_graph_evict_nodecache(dt_graph_t *graph);
+
 void dt_token_print(dt_token_t t);
 
 VkResult dt_graph_create_shader_module(
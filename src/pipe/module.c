@@ -40,7 +40,10 @@ int dt_module_add(
   mod->committed_param_size = 0;
   mod->committed_param = 0;
   mod->flags = 0;
+  mod->param_hash = 0;
+  mod->cache_dirty = 1;
   mod->keyframe_cnt = 0;
+  graph->module_order_valid = 0;
 
   // copy over initial info from module class:
   for(int i=0;i<dt_pipe.num_modules;i++)
@@ -133,6 +136,7 @@ int dt_module_remove(
   graph->module[modid].name = 0;
   graph->module[modid].inst = 0;
   graph->module[modid].connector[0].type = 0; // to avoid being detected as sink
+  graph->module_order_valid = 0;
   graph->module[modid].flags = 0;
   graph->module[modid].num_connectors = 0;
   free(graph->module[modid].keyframe);
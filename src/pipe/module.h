@@ -119,6 +119,9 @@ typedef struct dt_module_t
 
   dt_module_flags_t flags; // flags to signal special requests during graph processing
 
+  uint64_t param_hash;     // hash of param during the last run, to detect changes
+  int      cache_dirty;    // depends on the graph's cache module, i.e. is re-run
+
   // this is useful for instance for a cpu caching of
   // input data decoded from disk inside a module:
   void *data; // if you indeed must store your own data.
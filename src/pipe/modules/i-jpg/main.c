@@ -13,6 +13,7 @@ typedef struct jpginput_buf_t
   char errormsg[256];
   uint32_t frame;
   uint32_t width, height;
+  uint32_t denom;  // dct scaling: decode at 1/denom of the full resolution
   struct jpeg_decompress_struct dinfo;
   FILE *f;
 }
@@ -107,7 +108,7 @@ read_plain(
   int ac = jpg->dinfo.out_color_components;
   row_pointer[0] = malloc(jpg->dinfo.output_width * (uint64_t)ac);
   uint8_t *tmp = out;
-  while(jpg->dinfo.output_scanline < jpg->dinfo.image_height)
+  while(jpg->dinfo.output_scanline < jpg->dinfo.output_height)
   {
     if(jpeg_read_scanlines(&(jpg->dinfo), row_pointer, 1) != 1)
     {
@@ -118,12 +119,12 @@ read_plain(
       jpg->filename[0] = 0;
       return 1;
     }
-    for(unsigned int i = 0; i < jpg->dinfo.image_width; i++)
+    for(unsigned int i = 0; i < jpg->dinfo.output_width; i++)
     {
       for(int k = 0; k < 3; k++) tmp[4 * i + k] = row_pointer[0][ac * i + MIN(k,ac-1)];
       tmp[4*i+3] = 255;
     }
-    tmp += 4 * jpg->width;
+    tmp += 4 * jpg->dinfo.output_width;
   }
   free(row_pointer[0]);
   return 0;
@@ -157,6 +158,9 @@ jpeg_read(
   return 0;
 }
 
+// all state lives in mod->data, instances may read in parallel
+int read_source_reentrant = 1;
+
 int init(dt_module_t *mod)
 {
   jpginput_buf_t *dat = malloc(sizeof(*dat));
@@ -196,6 +200,56 @@ void modify_roi_out(
   mod->connector[0].roi.full_ht = jpg->height;
 }
 
+// pick the largest dct scale factor that still delivers at least the requested resolution
+void modify_roi_in(
+    dt_graph_t  *graph,
+    dt_module_t *mod)
+{
+  jpginput_buf_t *jpg = mod->data;
+  dt_roi_t *r = &mod->connector[0].roi;
+  if(r->scale <= 0.0f)
+  { // nobody asked for anything specific, give what we have
+    r->wd = r->full_wd;
+    r->ht = r->full_ht;
+    r->scale = 1.0f;
+  }
+  jpg->denom = 1;
+  for(int d=8;d>1;d/=2)
+  {
+    if((r->full_wd+d-1)/d >= r->wd && (r->full_ht+d-1)/d >= r->ht)
+    {
+      jpg->denom = d;
+      break;
+    }
+  }
+}
+
+// decode at reduced resolution and resample to what has been requested, if needed
+void create_nodes(
+    dt_graph_t  *graph,
+    dt_module_t *module)
+{
+  jpginput_buf_t *jpg = module->data;
+  const int d = MAX(1, jpg->denom);
+  dt_roi_t roi_dec = module->connector[0].roi;
+  roi_dec.wd = (roi_dec.full_wd + d - 1) / d; // same rounding as libjpeg
+  roi_dec.ht = (roi_dec.full_ht + d - 1) / d;
+  roi_dec.scale = d;
+  const int id_dec = dt_node_add(graph, module, "i-jpg", "main", roi_dec.wd, roi_dec.ht, 1, 0, 0, 1,
+      "output", "source", "rgba", "ui8", &roi_dec);
+  if(roi_dec.wd == module->connector[0].roi.wd && roi_dec.ht == module->connector[0].roi.ht)
+  {
+    dt_connector_copy(graph, module, 0, id_dec, 0);
+    return;
+  }
+  const int id_res = dt_node_add(graph, module, "shared", "resample",
+      module->connector[0].roi.wd, module->connector[0].roi.ht, 1, 0, 0, 2,
+      "input",  "read",  "rgba", "*",   dt_no_roi,
+      "output", "write", "rgba", "ui8", &module->connector[0].roi);
+  CONN(dt_node_connect(graph, id_dec, 0, id_res, 0));
+  dt_connector_copy(graph, module, 0, id_res, 1);
+}
+
 int read_source(
     dt_module_t             *mod,
     void                    *mapped,
@@ -205,6 +259,8 @@ int read_source(
   const char *filename = dt_module_param_string(mod, 0);
   if(read_header(mod, id+mod->graph->frame, filename)) return 1;
   jpginput_buf_t *jpg = mod->data;
+  jpg->dinfo.scale_num   = 1;
+  jpg->dinfo.scale_denom = MAX(1, jpg->denom);
   jpeg_read(jpg, mapped);
   return 0;
 }
@@ -1,11 +1,23 @@
 #include "modules/api.h"
+#include "core/fs.h"
+#include "core/hash.h"
+#ifndef VKDT_DSO_BUILD
+#include "core/threads.h"
+#endif
 
 #include <jpeglib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <setjmp.h>
+#include <sys/stat.h>
+
+#define JPGLST_PREFETCH_MAX   64         // max number of images decoded ahead of time
+#define JPGLST_PREFETCH_BYTES (256ul<<20) // max memory used for this
+#define JPGLST_DIMCACHE_MAGIC 0x326d646a // 'jdm2'
 
 typedef struct lst_t
 {
@@ -13,6 +25,12 @@ typedef struct lst_t
   const char **filename; // pointers to lines
   int          cnt;      // number of files in list
   uint32_t    *dim;      // dimensions of the images
+
+  uint8_t     *pf_buf;   // images decoded ahead of time, in parallel
+  uint64_t     pf_size;  // allocation size of pf_buf
+  int          pf_cnt;   // number of images in pf_buf
+  int          pf_idx[JPGLST_PREFETCH_MAX]; // array index of the prefetched image
+  uint64_t     pf_off[JPGLST_PREFETCH_MAX]; // and its offset in pf_buf
 }
 lst_t;
 
@@ -23,6 +41,25 @@ typedef struct jpgerr_t
 }
 jpgerr_t;
 
+// header of the dimension cache file, followed by 2*cnt uint32_t dimensions
+// and cnt stamps of the image files
+typedef struct dimcache_t
+{
+  uint32_t magic;
+  uint32_t cnt;      // number of files in the list
+  int64_t  mtime;    // modification time of the list file
+  uint64_t size;     // size of the list file
+}
+dimcache_t;
+
+// identifies the version of an image file the dimensions have been read from
+typedef struct stamp_t
+{
+  int64_t  mtime;
+  uint64_t size;
+}
+stamp_t;
+
 static void
 error_exit(j_common_ptr cinfo)
 {
@@ -31,15 +68,29 @@ error_exit(j_common_ptr cinfo)
   longjmp(myerr->setjmp_buffer, 1);
 }
 
+static void
+read_stamp(
+    FILE    *f,
+    stamp_t *stamp)
+{
+  struct stat sb = {0};
+  fstat(fileno(f), &sb);
+  stamp->mtime = sb.st_mtime;
+  stamp->size  = sb.st_size;
+}
+
 static void
 read_header(
     dt_module_t *mod,
     uint32_t    *dim,
+    stamp_t     *stamp,
     const char  *filename)
 {
   dim[0] = dim[1] = 0;
+  *stamp = (stamp_t){0};
   FILE *f = dt_graph_open_resource(mod->graph, 0, filename, "rb");
   if(!f) return;
+  read_stamp(f, stamp);
 
   struct jpeg_decompress_struct dinfo;
   jpgerr_t err;
@@ -58,28 +109,54 @@ error:
   fclose(f);
 }
 
+// decode the image to rgba in out, which holds exactly wd x ht pixels. if the
+// file doesn't have these dimensions (any more), out is cleared instead.
 static void
 read_full(
-    dt_module_t *mod,
-    const char  *filename,
-    uint8_t     *out)
+    dt_module_t    *mod,
+    const char     *filename,
+    const uint32_t *dim,
+    uint8_t        *out)
 {
   FILE *f = dt_graph_open_resource(mod->graph, 0, filename, "rb");
-  if(!f) return;
+  if(!f)
+  {
+    memset(out, 0, 4 * (uint64_t)dim[0] * dim[1]);
+    return;
+  }
 
   struct jpeg_decompress_struct dinfo;
   jpgerr_t err;
+  JSAMPROW row_pointer[16];
   dinfo.err = jpeg_std_error(&err.pub);
   err.pub.error_exit = error_exit;
   if(setjmp(err.setjmp_buffer)) goto error;
   jpeg_create_decompress(&dinfo);
   jpeg_stdio_src(&dinfo, f);
   jpeg_read_header(&dinfo, TRUE);
+  if(dinfo.image_width != dim[0] || dinfo.image_height != dim[1])
+  {
+    fprintf(stderr, "[i-jpglst] %s changed size, reload the list!\n", filename);
+    memset(out, 0, 4 * (uint64_t)dim[0] * dim[1]);
+    goto error;
+  }
+#ifdef JCS_ALPHA_EXTENSIONS
+  // libjpeg-turbo writes rgba directly to our buffer, a couple of rows at a time
+  dinfo.out_color_space = JCS_EXT_RGBA;
+  (void)jpeg_start_decompress(&dinfo);
+  while(dinfo.output_scanline < dinfo.output_height)
+  {
+    const int rows = MIN(16, dinfo.output_height - dinfo.output_scanline);
+    for(int j=0;j<rows;j++)
+      row_pointer[j] = out + 4 * dinfo.output_width * (uint64_t)(dinfo.output_scanline + j);
+    if(jpeg_read_scanlines(&dinfo, row_pointer, rows) == 0) goto error;
+  }
+#else
   dinfo.out_color_space = JCS_RGB;
   dinfo.out_color_components = 3;
 
   (void)jpeg_start_decompress(&dinfo);
-  JSAMPROW row_pointer[1] = { malloc(dinfo.output_width * (uint64_t)dinfo.num_components) };
+  row_pointer[0] = malloc(dinfo.output_width * (uint64_t)dinfo.num_components);
   uint8_t *tmp = out;
   while(dinfo.output_scanline < dinfo.image_height)
   {
@@ -92,6 +169,7 @@ read_full(
     tmp += 4 * dinfo.image_width;
   }
   free(row_pointer[0]);
+#endif
   (void)jpeg_finish_decompress(&dinfo);
 error:
   jpeg_destroy_decompress(&dinfo);
@@ -99,6 +177,124 @@ error:
   return;
 }
 
+typedef struct jpglst_job_t
+{
+  dt_module_t *mod;
+  lst_t       *lst;
+  stamp_t     *stamp;   // of every image when reading the headers
+  int          dirty;   // headers have been read, need to update the cache
+  int          idx[JPGLST_PREFETCH_MAX];
+  uint8_t     *out[JPGLST_PREFETCH_MAX];
+}
+jpglst_job_t;
+
+static void
+header_work(uint32_t b, uint32_t e, void *data)
+{
+  jpglst_job_t *j = data;
+  for(uint32_t i=b;i<e;i++)
+    read_header(j->mod, j->lst->dim + 2*i, j->stamp + i, j->lst->filename[i]);
+}
+
+// the cached dimensions are only good for the same version of the file
+static void
+check_work(uint32_t b, uint32_t e, void *data)
+{
+  jpglst_job_t *j = data;
+  for(uint32_t i=b;i<e;i++)
+  {
+    stamp_t stamp = {0};
+    FILE *f = dt_graph_open_resource(j->mod->graph, 0, j->lst->filename[i], "rb");
+    if(f)
+    {
+      read_stamp(f, &stamp);
+      fclose(f);
+    }
+    if(stamp.mtime == j->stamp[i].mtime && stamp.size == j->stamp[i].size) continue;
+    read_header(j->mod, j->lst->dim + 2*i, j->stamp + i, j->lst->filename[i]);
+    __atomic_store_n(&j->dirty, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void
+full_work(uint32_t b, uint32_t e, void *data)
+{
+  jpglst_job_t *j = data;
+  for(uint32_t i=b;i<e;i++)
+    read_full(j->mod, j->lst->filename[j->idx[i]], j->lst->dim + 2*j->idx[i], j->out[i]);
+}
+
+// the dimensions of all images in a list are cached in
+// ~/.cache/vkdt/jpglst/<hash>.dim, valid as long as the list file is unchanged.
+// the entries of images that changed on disk are read again.
+static void
+dimcache_filename(
+    dt_module_t *mod,
+    const char  *listname,
+    char        *filename,
+    size_t       maxlen)
+{
+  uint64_t hash = dt_hash_init;
+  if(listname[0] != '/') hash = dt_hash(hash, mod->graph->searchpath, strlen(mod->graph->searchpath));
+  hash = dt_hash(hash, listname, strlen(listname));
+  fs_cachedir(filename, maxlen);
+  size_t len = strlen(filename);
+  snprintf(filename + len, maxlen - len, "/jpglst");
+  fs_mkdir_p(filename, 0755);
+  len = strlen(filename);
+  snprintf(filename + len, maxlen - len, "/%016"PRIx64".dim", hash);
+}
+
+static int // returns zero if the dimensions have been read from the cache
+dimcache_read(
+    const char       *filename,
+    const dimcache_t *key,
+    uint32_t         *dim,
+    stamp_t          *stamp)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 1;
+  dimcache_t hdr = {0};
+  int err = fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+    hdr.magic != key->magic || hdr.cnt   != key->cnt ||
+    hdr.mtime != key->mtime || hdr.size  != key->size ||
+    fread(dim, sizeof(uint32_t)*2, key->cnt, f) != key->cnt ||
+    fread(stamp, sizeof(stamp_t), key->cnt, f) != key->cnt;
+  fclose(f);
+  return err;
+}
+
+static void
+dimcache_write(
+    const char       *filename,
+    const dimcache_t *key,
+    const uint32_t   *dim,
+    const stamp_t    *stamp)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f) return;
+  fwrite(key, sizeof(*key), 1, f);
+  fwrite(dim, sizeof(uint32_t)*2, key->cnt, f);
+  fwrite(stamp, sizeof(stamp_t), key->cnt, f);
+  fclose(f);
+}
+
+static int // next array element the graph will ask for, or cnt
+next_requested(const lst_t *lst, const uint8_t *req, int a)
+{
+  for(a++;a<lst->cnt;a++) if(!req || req[a]) break;
+  return a;
+}
+
+static void
+prefetch_free(lst_t *lst)
+{
+  free(lst->pf_buf);
+  lst->pf_buf  = 0;
+  lst->pf_size = 0;
+  lst->pf_cnt  = 0;
+}
+
 int init(dt_module_t *mod)
 {
   lst_t *lst = calloc(sizeof(lst_t), 1);
@@ -113,6 +309,7 @@ void cleanup(dt_module_t *mod)
   if(lst->data)     free(lst->data);
   if(lst->dim)      free(lst->dim);
   if(lst->filename) free(lst->filename);
+  prefetch_free(lst);
   free(lst);
   mod->data = 0;
 }
@@ -126,14 +323,18 @@ void modify_roi_out(
   lst_t *lst = mod->data;
   // load list of images, keep number of files and the dimension of their images.
   const char *filename = dt_module_param_string(mod, 0);
+  const int   dimcache = dt_module_param_int(mod, 1)[0];
   FILE *f = dt_graph_open_resource(mod->graph, 0, filename, "rb");
   if(!f) return;
+  struct stat sb = {0};
+  fstat(fileno(f), &sb);
   fseek(f, 0, SEEK_END);
   uint64_t size = ftell(f);
   fseek(f, 0, SEEK_SET);
   if(lst->data)     free(lst->data);
   if(lst->dim)      free(lst->dim);
   if(lst->filename) free(lst->filename);
+  prefetch_free(lst);
   lst->data = malloc(size);
   fread(lst->data, size, 1, f);
   fclose(f);
@@ -150,9 +351,31 @@ void modify_roi_out(
     if(lst->data[i] == 0)
       lst->filename[++cnt] = lst->data + i + 1;
 
-  // for each one image, open the header and find the size of the image
-  for(int i=0;i<lst->cnt;i++)
-    read_header(mod, lst->dim + 2*i, lst->filename[i]);
+  // for each one image, open the header and find the size of the image.
+  // try the cache first and only read the ones that changed, else read all
+  // the headers in parallel:
+  char cachefile[PATH_MAX];
+  dimcache_t key = {
+    .magic = JPGLST_DIMCACHE_MAGIC,
+    .cnt   = lst->cnt,
+    .mtime = sb.st_mtime,
+    .size  = size,
+  };
+  jpglst_job_t job = { .mod = mod, .lst = lst, .stamp = calloc(sizeof(stamp_t), lst->cnt+1) };
+  if(dimcache) dimcache_filename(mod, filename, cachefile, sizeof(cachefile));
+  void (*work)(uint32_t, uint32_t, void *) = check_work;
+  if(!dimcache || dimcache_read(cachefile, &key, lst->dim, job.stamp))
+  {
+    work = header_work;
+    job.dirty = 1;
+  }
+#ifndef VKDT_DSO_BUILD // no access to the thread pool from windows dlls
+  threads_parallel_for(0, lst->cnt, 8, work, &job);
+#else
+  work(0, lst->cnt, &job);
+#endif
+  if(dimcache && job.dirty) dimcache_write(cachefile, &key, lst->dim, job.stamp);
+  free(job.stamp);
 
   uint32_t max_wd = 0, max_ht = 0;
   for(int i=0;i<lst->cnt;i++)
@@ -178,12 +401,60 @@ void modify_roi_out(
   mod->img_param.filters = 0;
 }
 
+// the array elements are requested one after another. decode the requested
+// one directly to the staging memory, and in parallel a couple of the ones
+// that will be asked for next.
 int read_source(
     dt_module_t             *mod,
     void                    *mapped,
     dt_read_source_params_t *p)
 {
   lst_t *lst = mod->data;
-  read_full(mod, lst->filename[p->a], mapped);
+  const uint64_t bytes = 4 * (uint64_t)lst->dim[2*p->a] * lst->dim[2*p->a+1];
+  const uint8_t *req = p->node->connector[p->c].array_req;
+  for(int i=0;i<lst->pf_cnt;i++) if(lst->pf_idx[i] == p->a)
+  {
+    memcpy(mapped, lst->pf_buf + lst->pf_off[i], bytes);
+    if(next_requested(lst, req, p->a) == lst->cnt) prefetch_free(lst); // all done
+    return 0;
+  }
+
+#ifndef VKDT_DSO_BUILD // no access to the thread pool from windows dlls
+  const int max_cnt = MIN(JPGLST_PREFETCH_MAX, 2*threads_num());
+#else
+  const int max_cnt = 1; // no prefetching without the threads
+#endif
+  jpglst_job_t job = { .mod = mod, .lst = lst };
+  job.idx[0] = p->a;
+  job.out[0] = mapped;
+  int cnt = 1;
+  uint64_t pf_size = 0;
+  lst->pf_cnt = 0;
+  for(int a=next_requested(lst, req, p->a);a<lst->cnt && cnt<max_cnt;a=next_requested(lst, req, a))
+  { // the same elements the graph will ask for
+    const uint64_t sz = 4 * (uint64_t)lst->dim[2*a] * lst->dim[2*a+1];
+    if(pf_size + sz > JPGLST_PREFETCH_BYTES) break;
+    lst->pf_idx[lst->pf_cnt] = a;
+    lst->pf_off[lst->pf_cnt++] = pf_size;
+    job.idx[cnt++] = a;
+    pf_size += sz;
+  }
+  if(pf_size > lst->pf_size)
+  {
+    free(lst->pf_buf);
+    lst->pf_buf  = malloc(pf_size);
+    lst->pf_size = lst->pf_buf ? pf_size : 0;
+  }
+  if(!lst->pf_buf)
+  { // out of memory, decode just the one we need
+    cnt = 1;
+    lst->pf_cnt = 0;
+  }
+  for(int i=1;i<cnt;i++) job.out[i] = lst->pf_buf + lst->pf_off[i-1];
+#ifndef VKDT_DSO_BUILD
+  threads_parallel_for(0, cnt, 1, full_work, &job);
+#else
+  full_work(0, cnt, &job);
+#endif
   return 0;
 }
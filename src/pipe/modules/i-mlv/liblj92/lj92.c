@@ -35,6 +35,12 @@ typedef uint32_t u32;
 //#define SLOW_HUFF
 //#define DEBUG
 
+// number of bits looked up at once in the huffman decoder. most codes for
+// ssss are shorter than this, so are many code + difference bit pairs.
+#ifndef LJ92_LUT_BITS
+#define LJ92_LUT_BITS 11
+#endif
+
 typedef struct _ljp {
     u8* data;
     u8* dataend;
@@ -60,12 +66,21 @@ typedef struct _ljp {
     int* huffsize;
     int* huffcode;
 #else
-    u16* hufflut;
-    int huffbits;
+    u32* hufflut;   // LJ92_LUT_BITS prefix table, see parseHuff
+    u8* huffval;    // symbols in code order, points into data
+    int maxcode[18];// canonical code tables for codes longer than the lut
+    int mincode[17];
+    int valptr[17];
 #endif
     // Parse state
-    int cnt;
+    int cnt;        // number of valid bits in b
+#ifdef SLOW_HUFF
     u32 b;
+#else
+    uint64_t b;     // bit reservoir, the lowest cnt bits are valid
+    int zeros;      // number of padding bits after the end of the entropy coded data
+    int badcode;    // ran into an invalid huffman code
+#endif
     u16* image;
     u16* rowcache;
     u16* outrow[2];
@@ -214,51 +229,50 @@ static int parseHuff(ljp* self) {
     self->huffcode = NULL;
     ret = LJ92_ERROR_NONE;
 #else
-    /* Calculate huffman direct lut */
-    // How many bits in the table - find highest entry
+    /* Canonical huffman code: per code length the first code, the last
+     * code and the index of the first symbol */
     u8* huffvals = &self->data[self->ix+19];
-    int maxbits = 16;
-    while (maxbits>0) {
-        if (bits[maxbits]) break;
-        maxbits--;
+    int nvals = 0;
+    for (int len=1;len<=16;len++) nvals += bits[len];
+    if (nvals > hufflen-19) return ret;
+    self->huffval = huffvals;
+    self->ix += hufflen;
+    int code = 0, k = 0;
+    for (int len=1;len<=16;len++) {
+        self->valptr[len] = k;
+        self->mincode[len] = code;
+        code += bits[len];
+        k += bits[len];
+        self->maxcode[len] = bits[len] ? code-1 : -1;
+        if (code > (1<<len)) return ret; // over-subscribed code
+        code <<= 1;
     }
-    self->huffbits = maxbits;
-    /* Now fill the lut */
-    u16* hufflut = malloc((1<<maxbits) * sizeof(u16));
+    self->maxcode[17] = 0x7fffffff; // sentinel, stops the search in slowdiff
+    /* Prefix table. Every entry is indexed by the next LJ92_LUT_BITS bits:
+     * - bits  0..7 number of bits to consume
+     * - bits  8..12 the ssss symbol
+     * - bit  15 set if the difference bits fit in the lut, too. Then bits 0..7
+     *   count code and difference bits and bits 16..31 hold the difference.
+     * Zero means the code is longer than the lut, use the canonical tables. */
+    u32* hufflut = calloc(1<<LJ92_LUT_BITS, sizeof(u32));
     if (hufflut == NULL) return LJ92_ERROR_NO_MEMORY;
     self->hufflut = hufflut;
-    int i = 0;
-    int hv = 0;
-    int rv = 0;
-    int vl = 0; // i
-    int hcode;
-    int bitsused = 1;
-#ifdef DEBUG
-    printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-#endif
-    while (i<1<<maxbits) {
-        if (bitsused>maxbits) {
-            break; // Done. Should never get here!
-        }
-        if (vl >= bits[bitsused]) {
-            bitsused++;
-            vl = 0;
-            continue;
-        }
-        if (rv == 1 << (maxbits-bitsused)) {
-            rv = 0;
-            vl++;
-            hv++;
-#ifdef DEBUG
-            printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-#endif
-            continue;
+    k = 0;
+    for (int len=1;len<=LJ92_LUT_BITS;len++) {
+        for (int c=self->mincode[len];c<=self->maxcode[len];c++,k++) {
+            const int t = huffvals[k];
+            if (t > 16) return ret;
+            const int shift = LJ92_LUT_BITS - len;
+            for (int r=0;r<(1<<shift);r++) {
+                u32 e = (t<<8) | len;
+                if (t < 16 && len + t <= LJ92_LUT_BITS) {
+                    int diff = t ? r >> (shift - t) : 0;
+                    if (t && diff < (1<<(t-1))) diff -= (1 << t) - 1;
+                    e = ((u32)(diff & 0xffff) << 16) | 0x8000 | (t<<8) | (len + t);
+                }
+                hufflut[(c << shift) | r] = e;
+            }
         }
-        hcode = huffvals[hv];
-        hufflut[i] = hcode<<8 | bitsused;
-        //printf("%d %d %d\n",i,bitsused,hcode);
-        i++;
-        rv++;
     }
     ret = LJ92_ERROR_NONE;
 #endif
@@ -337,73 +351,98 @@ static int extend(ljp* self,int v,int t) {
 }
 #endif
 
+#ifndef SLOW_HUFF
+// top up the bit reservoir to more than 56 bits. byte stuffing (0xff 0x00)
+// is removed on the way. at a marker or the end of the data we shift in
+// zeros and count them, so running past the end can be detected.
+static inline void fillbits(ljp* self) {
+    uint64_t b = self->b;
+    int cnt = self->cnt;
+    int ix = self->ix;
+    const u8* data = self->data;
+    const int len = self->datalen;
+    if (!self->zeros && ix + 8 < len) {
+        // fast path: no 0xff in the next 7 bytes, shift them all in at once
+        uint64_t next;
+        memcpy(&next, data + ix, 8);
+        next = __builtin_bswap64(next);
+        const uint64_t t = ~next & 0xffffffffffffff00ull;
+        // any 0xff byte becomes a zero byte in t, detect those
+        if (!((t - 0x0101010101010100ull) & ~t & 0x8080808080808000ull)) {
+            const int nbytes = (64 - cnt) >> 3;
+            b = (b << (nbytes*8)) | (next >> (64 - nbytes*8));
+            self->b = b;
+            self->cnt = cnt + nbytes*8;
+            self->ix = ix + nbytes;
+            return;
+        }
+    }
+    while (cnt <= 56) {
+        u32 byte = 0;
+        if (self->zeros || ix >= len) self->zeros += 8;
+        else if ((byte = data[ix]) != 0xff) ix++;
+        else if (ix + 1 < len && data[ix+1] == 0) ix += 2;
+        else { byte = 0; self->zeros += 8; } // marker, stay in front of it
+        b = (b << 8) | byte;
+        cnt += 8;
+    }
+    self->b = b;
+    self->cnt = cnt;
+    self->ix = ix;
+}
+
+// decode codes longer than the lut, using the canonical code tables
+static int slowdiff(ljp* self, int* t) {
+    const int code16 = (self->b >> (self->cnt - 16)) & 0xffff;
+    int len = LJ92_LUT_BITS + 1;
+    while (len <= 16 && (code16 >> (16 - len)) > self->maxcode[len]) len++;
+    if (len > 16) { // not a valid code
+        self->badcode = 1;
+        *t = 0;
+        return 16;
+    }
+    const int code = code16 >> (16 - len);
+    *t = self->huffval[self->valptr[len] + code - self->mincode[len]];
+    return len;
+}
+#endif
+
 inline static int nextdiff(ljp* self) {
 #ifdef SLOW_HUFF
     int t = decode(self);
     int diff = receive(self,t);
     diff = extend(self,diff,t);
 #else
-    u32 b = self->b;
-    int cnt = self->cnt;
-    int huffbits = self->huffbits;
-    int ix = self->ix;
-    int next;
-    while (cnt < huffbits) {
-        next = *(u16*)&self->data[ix];
-        int one = next&0xFF;
-        int two = next>>8;
-        b = (b<<16)|(one<<8)|two;
-        cnt += 16;
-        ix += 2;
-        if (one==0xFF) {
-            //printf("%x %x %x %x %d\n",one,two,b,b>>8,cnt);
-            b >>= 8;
-            cnt -= 8;
-        } else if (two==0xFF) ix++;
+    // a code and its difference bits are at most 32 bits
+    if (self->cnt < 32) fillbits(self);
+    const u32 e = self->hufflut[(self->b >> (self->cnt - LJ92_LUT_BITS)) & ((1<<LJ92_LUT_BITS)-1)];
+    if (e & 0x8000) { // fast path: code and difference bits decoded in one go
+        self->cnt -= e & 0xff;
+        return (int32_t)e >> 16;
     }
-    int index = b >> (cnt - huffbits);
-    u16 ssssused = self->hufflut[index];
-    int usedbits = ssssused&0xFF;
-    int t = ssssused>>8;
-    self->sssshist[t]++;
-    cnt -= usedbits;
-    int keepbitsmask = (1 << cnt)-1;
-    b &= keepbitsmask;
-    int diff;
-    if (t == 16) {
-        diff = 1 << 15;
+    int t;
+    if (e) {
+        t = (e >> 8) & 0x1f;
+        self->cnt -= e & 0xff;
     } else {
-        while (cnt < t) {
-            next = *(u16*)&self->data[ix];
-            int one = next&0xFF;
-            int two = next>>8;
-            b = (b<<16)|(one<<8)|two;
-            cnt += 16;
-            ix += 2;
-            if (one==0xFF) {
-                b >>= 8;
-                cnt -= 8;
-            } else if (two==0xFF) ix++;
-        }
-        cnt -= t;
-        diff = b >> cnt;
-        int vt = 1<<(t-1);
-        if (diff < vt) {
-            vt = (-1 << t) + 1;
-            diff += vt;
-        }
+        self->cnt -= slowdiff(self, &t);
     }
-    keepbitsmask = (1 << cnt)-1;
-    self->b = b & keepbitsmask;
-    self->cnt = cnt;
-    self->ix = ix;
-    //printf("%d %d\n",t,diff);
-#ifdef DEBUG
-#endif
+    if (t == 0 || t == 16) return t ? 1 << 15 : 0;
+    self->cnt -= t;
+    int diff = (self->b >> self->cnt) & ((1u << t) - 1);
+    // negative differences have a leading zero bit, do it without a branch
+    diff -= ((diff >> (t-1)) - 1) & ((1 << t) - 1);
 #endif
     return diff;
 }
 
+// true if the decoder consumed more bits than the scan has
+#ifdef SLOW_HUFF
+#define EXHAUSTED(self) ((self)->ix >= (self)->datalen)
+#else
+#define EXHAUSTED(self) ((self)->cnt < (self)->zeros || (self)->badcode)
+#endif
+
 static int parsePred6(ljp* self) {
     int ret = LJ92_ERROR_CORRUPT;
     self->ix = self->scanstart;
@@ -411,6 +450,10 @@ static int parsePred6(ljp* self) {
     self->ix += BEH(self->data[self->ix]);
     self->cnt = 0;
     self->b = 0;
+#ifndef SLOW_HUFF
+    self->zeros = 0;
+    self->badcode = 0;
+#endif
     int write = self->writelen;
     // Now need to decode huffman coded values
     int c = 0;
@@ -439,7 +482,7 @@ static int parsePred6(ljp* self) {
         linear = left;
     thisrow[col++] = left;
     out[c++] = linear;
-    if (self->ix >= self->datalen) return ret;
+    if (EXHAUSTED(self)) return ret;
     --write;
     int rowcount = self->x-1;
     while (rowcount--) {
@@ -454,7 +497,7 @@ static int parsePred6(ljp* self) {
         thisrow[col++] = left;
         out[c++] = linear;
         //printf("%d %d %d %d %x\n",col-1,diff,left,thisrow[col-1],&thisrow[col-1]);
-        if (self->ix >= self->datalen) return ret;
+        if (EXHAUSTED(self)) return ret;
         if (--write==0) {
             out += self->skiplen;
             write = self->writelen;
@@ -479,7 +522,7 @@ static int parsePred6(ljp* self) {
         thisrow[col++] = left;
         //printf("%d %d %d %d\n",col,diff,left,lastrow[col]);
         out[c++] = linear;
-        if (self->ix >= self->datalen) break;
+        if (EXHAUSTED(self)) break;
         rowcount = self->x-1;
         if (--write==0) {
             out += self->skiplen;
@@ -506,7 +549,7 @@ static int parsePred6(ljp* self) {
         temprow = lastrow;
         lastrow = thisrow;
         thisrow = temprow;
-        if (self->ix >= self->datalen) break;
+        if (EXHAUSTED(self)) break;
     }
     if (c >= pixels) ret = LJ92_ERROR_NONE;
     return ret;
@@ -516,13 +559,19 @@ static int parseScan(ljp* self) {
     int ret = LJ92_ERROR_CORRUPT;
     memset(self->sssshist,0,sizeof(self->sssshist));
     self->ix = self->scanstart;
+    if (self->ix + 2 >= self->datalen) return ret;
     int compcount = self->data[self->ix+2];
+    if (self->ix + 3 + 2*compcount >= self->datalen) return ret;
     int pred = self->data[self->ix+3+2*compcount];
     if (pred<0 || pred>7) return ret;
     if (pred==6) return parsePred6(self); // Fast path
     self->ix += BEH(self->data[self->ix]);
     self->cnt = 0;
     self->b = 0;
+#ifndef SLOW_HUFF
+    self->zeros = 0;
+    self->badcode = 0;
+#endif
     u16* out = self->image;
     u16* thisrow = self->outrow[0];
     u16* lastrow = self->outrow[1];
@@ -1,6 +1,8 @@
 #include "modules/api.h"
 #include "connector.h"
 #include "core/core.h"
+#include "core/fs.h"
+#include "db/hash.h"
 #include "adobe_coeff.h"
 
 #include <stdio.h>
@@ -8,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -15,14 +18,52 @@
 #include <sys/ioctl.h>
 
 #include "video_mlv.c"
+#include "modules/prefetch.h"
+
+#include <pthread.h>
 
 typedef struct buf_t
 {
-  char         filename[256]; // opened mlv if any
-  mlv_header_t video;
+  char            filename[256]; // opened mlv if any
+  mlv_header_t    video;
+  pthread_mutex_t io;            // protects the file handles of the clip
+  dt_prefetch_t  *prefetch;      // decodes the next frames during playback
 }
 buf_t;
 
+// reading the compressed data from the chunk files is serialised by the io
+// mutex, the lj92 decoding runs in parallel.
+static void *
+decode_frame(
+    void       *user,
+    int64_t     frame,
+    const char *filename,
+    uint64_t   *size)
+{
+  buf_t *dat = user;
+  mlv_header_t *video = &dat->video;
+  mlv_vidf_hdr_t vidf;
+  uint8_t *raw_frame = malloc(mlv_frame_data_size(video, frame));
+  pthread_mutex_lock(&dat->io);
+  int err = mlv_read_frame(video, frame, raw_frame, &vidf);
+  pthread_mutex_unlock(&dat->io);
+  *size = sizeof(uint16_t) * video->RAWI.xRes * video->RAWI.yRes;
+  uint16_t *buf = err ? 0 : malloc(*size);
+  if(buf && mlv_unpack_frame(video, frame, raw_frame, buf))
+  { // failed frames are left to read_source, it will try again and complain
+    free(buf);
+    buf = 0;
+  }
+  free(raw_frame);
+  return buf;
+}
+
+static void
+release_frame(void *user, void *data)
+{
+  free(data);
+}
+
 int mat3inv(float *const dst, const float *const src)
 {
 #define A(y, x) src[(y - 1) * 3 + (x - 1)]
@@ -81,9 +122,30 @@ open_file(
     fclose(f);
   }
 
-  if(mlv_open_clip(&dat->video, filename, 0))//MLV_OPEN_PREVIEW)
+  if(dat->filename[0])
+  { // switching clips
+    dt_prefetch_destroy(dat->prefetch);
+    dat->prefetch = 0;
+    mlv_header_cleanup(&dat->video);
+    dat->filename[0] = 0;
+  }
+
+  // the block index of the clip is kept in the cache directory
+  char index_filename[PATH_MAX];
+  fs_cachedir(index_filename, sizeof(index_filename));
+  size_t len = strlen(index_filename);
+  snprintf(index_filename + len, sizeof(index_filename) - len, "/mlv");
+  fs_mkdir_p(index_filename, 0755);
+  len = strlen(index_filename);
+  snprintf(index_filename + len, sizeof(index_filename) - len, "/%"PRIx64".idx", hash64(filename));
+
+  if(mlv_open_clip(&dat->video, filename, index_filename, 0))//MLV_OPEN_PREVIEW)
+  {
+    mlv_header_cleanup(&dat->video);
     return 1;
+  }
 
+  dat->prefetch = dt_prefetch_create(decode_frame, release_frame, dat);
   snprintf(dat->filename, sizeof(dat->filename), "%s", fname);
   return 0;
 }
@@ -94,15 +156,31 @@ read_frame(
     void        *mapped)
 {
   buf_t *dat = mod->data;
-  int frame = MIN(mod->graph->frame, dat->video.MLVI.videoFrameCount-1);
-  return mlv_get_frame(
-    &dat->video, frame, mapped);
+  const int last  = dat->video.MLVI.videoFrameCount-1;
+  const int frame = MIN(mod->graph->frame, last);
+  int err = 0;
+  uint64_t size = 0;
+  uint16_t *buf = dt_prefetch_take(dat->prefetch, frame, 0, &size);
+  if(buf)
+  {
+    memcpy(mapped, buf, size);
+    free(buf);
+  }
+  else
+  { // not prefetched, read it ourselves
+    pthread_mutex_lock(&dat->io);
+    err = mlv_get_frame(&dat->video, frame, mapped);
+    pthread_mutex_unlock(&dat->io);
+  }
+  dt_prefetch_ahead(dat->prefetch, mod, 0, frame, last, dt_module_param_int(mod, 1)[0], 0);
+  return err;
 }
 
 int init(dt_module_t *mod)
 {
   buf_t *dat = malloc(sizeof(*dat));
   memset(dat, 0, sizeof(*dat));
+  pthread_mutex_init(&dat->io, 0);
   mod->data = dat;
   mod->flags = s_module_request_read_source;
   return 0;
@@ -114,9 +192,12 @@ void cleanup(dt_module_t *mod)
   buf_t *dat= mod->data;
   if(dat->filename[0])
   {
+    dt_prefetch_destroy(dat->prefetch);
+    dat->prefetch = 0;
     mlv_header_cleanup(&dat->video);
     dat->filename[0] = 0;
   }
+  pthread_mutex_destroy(&dat->io);
   free(dat);
   mod->data = 0;
 }
@@ -6,6 +6,13 @@
 #include <math.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN64
+#include <sys/mman.h>
+#endif
 
 #include "video_mlv.h"
 
@@ -170,95 +177,208 @@ static void close_all_chunks(FILE ** files, int entries)
   if(files) free(files);
 }
 
-// TODO: replace by qsort
+static int frame_index_compare(const void *a, const void *b)
+{
+  const mlv_frame_index_t *fa = a, *fb = b;
+  if(fa->frame_time   != fb->frame_time)   return fa->frame_time   < fb->frame_time   ? -1 : 1;
+  /* Keep the order of the file for equal time stamps */
+  if(fa->chunk_num    != fb->chunk_num)    return fa->chunk_num    < fb->chunk_num    ? -1 : 1;
+  if(fa->block_offset != fb->block_offset) return fa->block_offset < fb->block_offset ? -1 : 1;
+  return 0;
+}
+
 static void frame_index_sort(mlv_frame_index_t *frame_index, uint32_t entries)
 {
   if (!entries) return;
+  qsort(frame_index, entries, sizeof(mlv_frame_index_t), frame_index_compare);
+}
+
+/* Index sidecar: the parsed headers and the sorted block indices, so we
+ * don't have to walk all block headers of all chunks again. It is only
+ * valid for the exact same chunk files, which we check by mtime and size. */
+#define MLV_INDEX_VERSION 1
+#define MLV_INDEX_MAX_CHUNKS 101 /* .MLV + .M00 .. .M99 */
 
-  uint32_t n = entries;
-  do
+typedef struct
+{
+  char     magic[8];     /* "vkdtmlvi" */
+  uint32_t version;
+  uint32_t header_size;  /* sizeof(mlv_header_t), protects against layout changes */
+  uint32_t filenum;
+  uint32_t frames, audios, vers_blocks;
+  uint32_t pad;
+  uint64_t chunk_size [MLV_INDEX_MAX_CHUNKS];
+  int64_t  chunk_mtime[MLV_INDEX_MAX_CHUNKS];
+}
+mlv_index_file_t;
+
+static int mlv_index_stat_chunks(mlv_header_t *video, mlv_index_file_t *idx)
+{
+  if(video->filenum > MLV_INDEX_MAX_CHUNKS) return 1;
+  for(int i = 0; i < video->filenum; i++)
   {
-    uint32_t new_n = 1;
-    for (uint32_t i = 0; i < n-1; ++i)
-    {
-      if (frame_index[i].frame_time > frame_index[i+1].frame_time)
-      {
-        mlv_frame_index_t tmp = frame_index[i+1];
-        frame_index[i+1] = frame_index[i];
-        frame_index[i] = tmp;
-        new_n = i + 1;
-      }
-    }
-    n = new_n;
-  } while (n > 1);
+    struct stat sb;
+    if(fstat(fileno(video->file[i]), &sb)) return 1;
+    idx->chunk_size[i]  = sb.st_size;
+    idx->chunk_mtime[i] = sb.st_mtime;
+  }
+  return 0;
 }
 
-/* Unpack or decompress original raw data */
-int mlv_get_frame(
-    mlv_header_t *video,
-    uint64_t      frame_index,
-    uint16_t     *unpackedFrame)
+/* Try to use the index sidecar, returns zero on success */
+static int mlv_index_load(mlv_header_t *video, const char *index_filename)
 {
-  int bitdepth  = video->RAWI.raw_info.bits_per_pixel;
-  int width     = video->RAWI.xRes;
-  int height    = video->RAWI.yRes;
-  int pixel_cnt = width * height;
+#ifdef _WIN64
+  return 1;
+#else
+  mlv_index_file_t cur = {{0}};
+  if(!index_filename || mlv_index_stat_chunks(video, &cur)) return 1;
+  int fd = open(index_filename, O_RDONLY);
+  if(fd == -1) return 1;
+  struct stat sb;
+  if(fstat(fd, &sb) || sb.st_size < (off_t)(sizeof(mlv_index_file_t) + sizeof(mlv_header_t)))
+  {
+    close(fd);
+    return 1;
+  }
+  uint8_t *map = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return 1;
+
+  const mlv_index_file_t *idx = (const mlv_index_file_t *)map;
+  const uint64_t size = sizeof(mlv_index_file_t) + sizeof(mlv_header_t)
+    + ((uint64_t)idx->frames + idx->audios + idx->vers_blocks) * sizeof(mlv_frame_index_t);
+  if(memcmp(idx->magic, "vkdtmlvi", 8) ||
+     idx->version     != MLV_INDEX_VERSION ||
+     idx->header_size != sizeof(mlv_header_t) ||
+     idx->filenum     != video->filenum ||
+     size             != (uint64_t)sb.st_size ||
+     memcmp(idx->chunk_size,  cur.chunk_size,  sizeof(uint64_t)*video->filenum) ||
+     memcmp(idx->chunk_mtime, cur.chunk_mtime, sizeof(int64_t) *video->filenum))
+  { /* stale or not ours */
+    munmap(map, sb.st_size);
+    return 1;
+  }
 
+  FILE **file = video->file;
+  int filenum = video->filenum;
+  memcpy(video, map + sizeof(mlv_index_file_t), sizeof(mlv_header_t));
+  video->file           = file;
+  video->filenum        = filenum;
+  video->index_map      = map;
+  video->index_map_size = sb.st_size;
+  mlv_frame_index_t *index = (mlv_frame_index_t *)(map + sizeof(mlv_index_file_t) + sizeof(mlv_header_t));
+  video->video_index = idx->frames      ? index : 0; index += idx->frames;
+  video->audio_index = idx->audios      ? index : 0; index += idx->audios;
+  video->vers_index  = idx->vers_blocks ? index : 0;
+  return 0;
+#endif
+}
+
+/* Write the index sidecar after a full scan of the clip */
+static void mlv_index_store(mlv_header_t *video, const char *index_filename)
+{
+#ifndef _WIN64
+  mlv_index_file_t idx = {{0}};
+  if(!index_filename || mlv_index_stat_chunks(video, &idx)) return;
+  memcpy(idx.magic, "vkdtmlvi", 8);
+  idx.version     = MLV_INDEX_VERSION;
+  idx.header_size = sizeof(mlv_header_t);
+  idx.filenum     = video->filenum;
+  idx.frames      = video->frames;
+  idx.audios      = video->audios;
+  idx.vers_blocks = video->vers_blocks;
+
+  /* No pointers in the file */
+  mlv_header_t hdr = *video;
+  hdr.file        = 0;
+  hdr.video_index = hdr.audio_index = hdr.vers_index = 0;
+  hdr.audio_data  = 0;
+  hdr.audio_size  = hdr.audio_buffer_size = 0;
+  hdr.index_map   = 0;
+  hdr.index_map_size = 0;
+
+  char tmp[PATH_MAX+10];
+  snprintf(tmp, sizeof(tmp), "%s.%d", index_filename, (int)getpid());
+  FILE *f = fopen(tmp, "wb");
+  if(!f) return;
+  int ok = fwrite(&idx, sizeof(idx), 1, f) == 1 && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  if(ok && idx.frames)      ok = fwrite(video->video_index, sizeof(mlv_frame_index_t), idx.frames,      f) == idx.frames;
+  if(ok && idx.audios)      ok = fwrite(video->audio_index, sizeof(mlv_frame_index_t), idx.audios,      f) == idx.audios;
+  if(ok && idx.vers_blocks) ok = fwrite(video->vers_index,  sizeof(mlv_frame_index_t), idx.vers_blocks, f) == idx.vers_blocks;
+  ok &= fclose(f) == 0;
+  /* Rename so concurrent readers never see a partial file */
+  if(!ok || rename(tmp, index_filename)) unlink(tmp);
+#endif
+}
+
+/* Size of the buffer mlv_read_frame needs for the given frame */
+uint64_t mlv_frame_data_size(
+    const mlv_header_t *video,
+    uint64_t            frame_index)
+{
+  uint64_t raw_frame_size = (uint64_t)video->RAWI.xRes * video->RAWI.yRes * video->RAWI.raw_info.bits_per_pixel / 8;
+  if((video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) &&
+      video->video_index[frame_index].frame_size > raw_frame_size)
+    raw_frame_size = video->video_index[frame_index].frame_size;
+  return raw_frame_size + 4; // additional 4 bytes for safety
+}
+
+/* Read the original raw data of a frame, compressed or packed */
+int mlv_read_frame(
+    mlv_header_t   *video,
+    uint64_t        frame_index,
+    uint8_t        *raw_frame,
+    mlv_vidf_hdr_t *vidf)
+{
   int chunk = video->video_index[frame_index].chunk_num;
   uint32_t frame_size = video->video_index[frame_index].frame_size;
   uint64_t frame_offset = video->video_index[frame_index].frame_offset;
   uint64_t frame_header_offset = video->video_index[frame_index].block_offset;
-
   /* How many bytes is RAW frame */
-  int raw_frame_size = (width * height * bitdepth) / 8;
-  /* Memory buffer for original RAW data */
-  uint8_t *raw_frame = malloc(raw_frame_size + 4); // additional 4 bytes for safety
+  int raw_frame_size = (video->RAWI.xRes * video->RAWI.yRes * video->RAWI.raw_info.bits_per_pixel) / 8;
 
   FILE *file = video->file[chunk];
 
   fseek(file, frame_header_offset, SEEK_SET);
-  if(fread(&video->VIDF, sizeof(mlv_vidf_hdr_t), 1, file) != 1)
-  {
-    free(raw_frame);
+  if(fread(vidf, sizeof(mlv_vidf_hdr_t), 1, file) != 1)
     return 1;
-  }
 
   fseek(file, frame_offset, SEEK_SET);
+  if(video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
+    raw_frame_size = frame_size;
+  if(fread(raw_frame, raw_frame_size, 1, file) != 1)
+    return 1; // frame data read error
+  return 0;
+}
+
+/* Unpack or decompress raw data read by mlv_read_frame */
+int mlv_unpack_frame(
+    const mlv_header_t *video,
+    uint64_t            frame_index,
+    uint8_t            *raw_frame,
+    uint16_t           *unpackedFrame)
+{
+  int bitdepth  = video->RAWI.raw_info.bits_per_pixel;
+  int width     = video->RAWI.xRes;
+  int height    = video->RAWI.yRes;
+  int pixel_cnt = width * height;
+  uint32_t frame_size = video->video_index[frame_index].frame_size;
+
   if (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
   {
-    if(fread(raw_frame, frame_size, 1, file) != 1)
-    { // frame data read error
-      free(raw_frame);
-      return 1;
-    }
-
     int components = 1;
     lj92 decoder_object;
     int ret = lj92_open(&decoder_object, raw_frame, frame_size, &width, &height, &bitdepth, &components);
     if(ret != LJ92_ERROR_NONE)
-    { // lj92 decoding failed
-      free(raw_frame);
-      return 1;
-    }
-    else
-    {
-      ret = lj92_decode(decoder_object, unpackedFrame, width * height * components, 0, NULL, 0);
-      if(ret != LJ92_ERROR_NONE)
-      { // lj92 failure
-        free(raw_frame);
-        return 1;
-      }
-    }
+      return 1; // lj92 decoding failed
+    ret = lj92_decode(decoder_object, unpackedFrame, width * height * components, 0, NULL, 0);
     lj92_close(decoder_object);
+    if(ret != LJ92_ERROR_NONE)
+      return 1; // lj92 failure
   }
   else /* If not compressed just unpack to 16bit */
   {
-    if(fread(raw_frame, raw_frame_size, 1, file) != 1)
-    { // can't read frame data
-      free(raw_frame);
-      return 1;
-    }
-
     uint32_t mask = (1 << bitdepth) - 1;
 #pragma omp parallel for
     for (int i = 0; i < pixel_cnt; ++i)
@@ -272,9 +392,21 @@ int mlv_get_frame(
       unpackedFrame[i] = ((uint16_t)(data & mask));
     }
   }
+  return 0;
+}
 
+/* Unpack or decompress original raw data */
+int mlv_get_frame(
+    mlv_header_t *video,
+    uint64_t      frame_index,
+    uint16_t     *unpackedFrame)
+{
+  /* Memory buffer for original RAW data */
+  uint8_t *raw_frame = malloc(mlv_frame_data_size(video, frame_index));
+  int err = mlv_read_frame(video, frame_index, raw_frame, &video->VIDF);
+  if(!err) err = mlv_unpack_frame(video, frame_index, raw_frame, unpackedFrame);
   free(raw_frame);
-  return 0;
+  return err;
 }
 
 void mlv_header_init(mlv_header_t *video)
@@ -288,9 +420,15 @@ void mlv_header_cleanup(mlv_header_t *video)
   /* Close all MLV file chunks */
   if(video->file) close_all_chunks(video->file, video->filenum);
   /* Free all memory */
-  free(video->video_index);
-  free(video->audio_index);
-  free(video->vers_index);
+#ifndef _WIN64
+  if(video->index_map) munmap(video->index_map, video->index_map_size);
+  else
+#endif
+  {
+    free(video->video_index);
+    free(video->audio_index);
+    free(video->vers_index);
+  }
   free(video->audio_data);
   memset(video, 0, sizeof(*video));
 }
@@ -298,11 +436,18 @@ void mlv_header_cleanup(mlv_header_t *video)
 int mlv_open_clip(
     mlv_header_t *video,
     const char   *filename,
+    const char   *index_filename,
     int           open_mode)
 {
   video->file = load_all_chunks(filename, &video->filenum);
   if(!video->file) return MLV_ERR_OPEN; // can not open file
 
+  if(!mlv_index_load(video, index_filename))
+  {
+    if(open_mode != MLV_OPEN_PREVIEW) mlv_read_audio(video);
+    goto preview_out;
+  }
+
   uint64_t block_num = 0; /* Number of blocks in file */
   mlv_hdr_t block_header; /* Basic MLV block header */
   uint64_t video_frames = 0; /* Number of frames in video */
@@ -619,6 +764,8 @@ int mlv_open_clip(
   /* Set VERS block count in video object */
   video->vers_blocks = vers_blocks;
 
+  mlv_index_store(video, index_filename);
+
   /* Reads MLV audio into buffer (video->audio_data) and sync it,
    * set full audio buffer size (video->audio_buffer_size) and
    * aligned usable audio data size (video->audio_size) */
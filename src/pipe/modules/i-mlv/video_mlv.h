@@ -78,18 +78,43 @@ typedef struct
 
   /* Restricted lossless raw data bit depth */
   int lossless_bpp;
+
+  /* Index sidecar mapping, the indices above point into it if set */
+  void    *index_map;
+  uint64_t index_map_size;
 }
 mlv_header_t;
 
 enum mlv_err { MLV_ERR_NONE, MLV_ERR_OPEN, MLV_ERR_IO, MLV_ERR_CORRUPTED, MLV_ERR_INVALID };
 enum mlv_open_mode { MLV_OPEN_FULL, MLV_OPEN_MAPP, MLV_OPEN_PREVIEW };
 
+/* index_filename is optional. If given, the block index is loaded from there
+ * if it is still valid for the clip, or written there after a full scan. */
 int mlv_open_clip(
     mlv_header_t *video,
     const char   *filename,
+    const char   *index_filename,
     int           open_mode);
 
 void mlv_header_init(mlv_header_t *video);
+
+/* Reading a frame is split in two steps so the decoding can run on other
+ * threads: mlv_read_frame seeks in the shared chunk files and is not thread
+ * safe, mlv_unpack_frame only reads the clip headers. */
+uint64_t mlv_frame_data_size(
+    const mlv_header_t *video,
+    uint64_t            frame_index);
+int mlv_read_frame(
+    mlv_header_t   *video,
+    uint64_t        frame_index,
+    uint8_t        *raw_frame,  /* mlv_frame_data_size() bytes */
+    mlv_vidf_hdr_t *vidf);
+int mlv_unpack_frame(
+    const mlv_header_t *video,
+    uint64_t            frame_index,
+    uint8_t            *raw_frame,
+    uint16_t           *unpackedFrame);
+
 void mlv_header_cleanup(mlv_header_t *video);
 int mlv_get_frame(
     mlv_header_t *video,
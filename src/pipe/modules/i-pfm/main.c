@@ -108,6 +108,9 @@ read_plain(
   return 0;
 }
 
+// all state lives in mod->data, instances may read in parallel
+int read_source_reentrant = 1;
+
 int init(dt_module_t *mod)
 {
   pfminput_buf_t *dat = malloc(sizeof(*dat));
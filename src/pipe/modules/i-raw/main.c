@@ -1,6 +1,8 @@
 #include "modules/api.h"
 #include "mat3.h"
 #include "rawloader-c/rawloader.h"
+#include "rawmeta.h"
+#include "modules/prefetch.h"
 #include "core/log.h"
 
 #include <stdio.h>
@@ -13,8 +15,43 @@ typedef struct rawinput_buf_t
   char filename[PATH_MAX];
   int frame;
   int ox, oy;
+  dt_prefetch_t *prefetch; // look-ahead decoding for timelapses
 }
 rawinput_buf_t;
+
+typedef struct rawinput_decoded_t
+{ // a full image as decoded on the prefetch threads
+  rawimage_t img;
+  uint64_t len;
+}
+rawinput_decoded_t;
+
+static void *
+decode_raw(
+    void       *user,
+    int64_t     frame,
+    const char *filename,
+    uint64_t   *size)
+{
+  rawinput_decoded_t *d = malloc(sizeof(*d));
+  memset(&d->img, 0, sizeof(d->img));
+  d->len = rl_decode_file(filename, &d->img);
+  if(!d->len)
+  {
+    free(d);
+    return 0;
+  }
+  *size = d->len * (d->img.data_type ? sizeof(float) : sizeof(uint16_t));
+  return d;
+}
+
+static void
+release_raw(void *user, void *data)
+{
+  rawinput_decoded_t *d = data;
+  rl_deallocate(d->img.data, d->len);
+  free(d);
+}
   
 void
 free_raw(dt_module_t *mod)
@@ -39,9 +76,23 @@ load_raw(
   char fname[2*PATH_MAX+10];
   if(dt_graph_get_resource_filename(mod, filename, frame, fname, sizeof(fname)))
     goto error;
-  mod_data->len = rl_decode_file(fname, &mod_data->img);
+  uint64_t size = 0;
+  rawinput_decoded_t *d = dt_prefetch_take(mod_data->prefetch, frame, fname, &size);
+  if(d)
+  {
+    mod_data->img = d->img;
+    mod_data->len = d->len;
+    free(d);
+  }
+  else
+  {
+    mod_data->len = rl_decode_file(fname, &mod_data->img);
+    size = mod_data->len * (mod_data->img.data_type ? sizeof(float) : sizeof(uint16_t));
+    dt_prefetch_frame_size(mod_data->prefetch, size);
+  }
   end = clock();
-  dt_log(s_log_perf, "[rawloader] load %s in %3.0fms", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  dt_log(s_log_perf, "[rawloader] load %s in %3.0fms%s", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC,
+      d ? " (prefetched)" : "");
   snprintf(mod_data->filename, sizeof(mod_data->filename), "%s", filename);
   mod_data->frame = frame;
   return 0;
@@ -52,9 +103,39 @@ error:
   return 1;
 }
 
+// read only what modify_roi_out needs to know from the file header. if the
+// full image has already been decoded, use that one instead.
+static int
+probe_raw(
+    dt_module_t *mod,
+    int          frame,
+    const char  *filename,
+    rawimage_t  *img)
+{
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  if(!strcmp(mod_data->filename, filename) && mod_data->frame == frame)
+  {
+    *img = mod_data->img;
+    return 0;
+  }
+  clock_t end, beg = clock();
+  char fname[2*PATH_MAX+10];
+  memset(img, 0, sizeof(*img));
+  if(dt_graph_get_resource_filename(mod, filename, frame, fname, sizeof(fname)) ||
+     rl_probe_file(fname, img))
+  {
+    dt_log(s_log_err, "[i-raw] failed to probe raw file %s!\n", fname);
+    return 1;
+  }
+  end = clock();
+  dt_log(s_log_perf, "[rawloader] probe %s in %3.0fms", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  return 0;
+}
+
 int init(dt_module_t *mod)
 {
   rawinput_buf_t *dat = calloc(1, sizeof(*dat));
+  dat->prefetch = dt_prefetch_create(decode_raw, release_raw, 0);
   mod->data = dat;
   return 0;
 }
@@ -64,6 +145,7 @@ void cleanup(dt_module_t *mod)
   if(!mod->data) return;
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
   free_raw(mod);
+  dt_prefetch_destroy(mod_data->prefetch);
   free(mod_data);
   mod->data = 0;
 }
@@ -86,6 +168,73 @@ check_params(
   return s_graph_run_record_cmd_buf;
 }
 
+// set the output dimensions and everything we know from the file, except the
+// noise model, on the module
+static void
+meta_from_image(
+    dt_module_t      *mod,
+    const rawimage_t *img)
+{
+  // we know we only have one connector called "output" (see our "connectors" file)
+  mod->connector[0].roi.full_wd = img->width;
+  mod->connector[0].roi.full_ht = img->height;
+
+  for(int k=0;k<9;k++)
+    mod->img_param.cam_to_rec2020[k] = 0.0f/0.0f; // mark as uninitialised
+
+  // set a bit of metadata from rawspeed, overwrite exiv2 because this one is more consistent:
+  snprintf(mod->img_param.maker, sizeof(mod->img_param.maker), "%s", img->clean_maker);
+  snprintf(mod->img_param.model, sizeof(mod->img_param.model), "%s", img->clean_model);
+  mod->img_param.iso = img->iso;
+  mod->img_param.aperture = img->aperture;
+  mod->img_param.exposure = img->exposure;
+  mod->img_param.focal_length = img->focal_length;
+  mod->img_param.orientation = img->orientation;
+  size_t r = snprintf(mod->img_param.datetime, sizeof(mod->img_param.datetime), "%s", img->datetime);
+  if(r >= sizeof(mod->img_param.datetime)) mod->img_param.datetime[sizeof(mod->img_param.datetime)-1] = 0;
+
+  for(int k=0;k<4;k++)
+  {
+    mod->img_param.black[k]        = img->blacklevels[k];
+    mod->img_param.white[k]        = img->whitelevels[k];
+    mod->img_param.whitebalance[k] = img->wb_coeffs[k];
+    mod->img_param.crop_aabb[k]    = img->crop_aabb[k];
+  }
+  // normalise wb
+  mod->img_param.whitebalance[0] /= mod->img_param.whitebalance[1];
+  mod->img_param.whitebalance[2] /= mod->img_param.whitebalance[1];
+  mod->img_param.whitebalance[3] /= mod->img_param.whitebalance[1];
+  mod->img_param.whitebalance[1] = 1.0f;
+  mod->img_param.filters = img->filters;
+
+  if(isnanf(mod->img_param.cam_to_rec2020[0]))
+  { // camera matrix not found in exif or compiled without exiv2
+    float xyz_to_cam[12], mat[9] = {0};
+    // get d65 camera matrix from rawloader
+    for(int j=0;j<3;j++) for(int i=0;i<3;i++)
+      xyz_to_cam[3*j+i] = img->xyz_to_cam[j][i];
+    mat3inv(mat, xyz_to_cam);
+
+    // compute matrix camrgb -> rec2020 d65
+    double cam_to_xyz[] = {
+      mat[0], mat[1], mat[2],
+      mat[3], mat[4], mat[5],
+      mat[6], mat[7], mat[8]};
+
+    const float xyz_to_rec2020[] = {
+       1.7166511880, -0.3556707838, -0.2533662814,
+      -0.6666843518,  1.6164812366,  0.0157685458,
+       0.0176398574, -0.0427706133,  0.9421031212
+    };
+    float cam_to_rec2020[9] = {0.0f};
+    for(int j=0;j<3;j++) for(int i=0;i<3;i++) for(int k=0;k<3;k++)
+      cam_to_rec2020[3*j+i] +=
+        xyz_to_rec2020[3*j+k] * cam_to_xyz[3*k+i];
+    for(int k=0;k<9;k++)
+      mod->img_param.cam_to_rec2020[k] = cam_to_rec2020[k];
+  }
+}
+
 // this callback is responsible to set the full_{wd,ht} dimensions on the
 // regions of interest on all "write"|"source" channels
 void modify_roi_out(
@@ -103,25 +252,17 @@ void modify_roi_out(
     mod->flags = s_module_request_read_source;
   }
   
-  if(load_raw(mod, id + graph->frame, filename)) return;
-  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
-  // we know we only have one connector called "output" (see our "connectors" file)
-  mod->connector[0].roi.full_wd = mod_data->img.width;
-  mod->connector[0].roi.full_ht = mod_data->img.height;
-
-  for(int k=0;k<9;k++)
-    mod->img_param.cam_to_rec2020[k] = 0.0f/0.0f; // mark as uninitialised
+  rawinput_meta_t m;
+  if(rawinput_meta_key(filename, &m) || rawinput_meta_find(&m))
+  { // not cached, need to look into the file
+    rawimage_t img;
+    if(probe_raw(mod, id + graph->frame, filename, &img)) return;
+    meta_from_image(mod, &img);
+    rawinput_meta_store(mod, img.cfa_off_x, img.cfa_off_y, &m);
+    rawinput_meta_insert(&m);
+  }
+  else rawinput_meta_apply(mod, &m);
 
-  // set a bit of metadata from rawspeed, overwrite exiv2 because this one is more consistent:
-  snprintf(mod->img_param.maker, sizeof(mod->img_param.maker), "%s", mod_data->img.clean_maker);
-  snprintf(mod->img_param.model, sizeof(mod->img_param.model), "%s", mod_data->img.clean_model);
-  mod->img_param.iso = mod_data->img.iso;
-  mod->img_param.aperture = mod_data->img.aperture;
-  mod->img_param.exposure = mod_data->img.exposure;
-  mod->img_param.focal_length = mod_data->img.focal_length;
-  mod->img_param.orientation = mod_data->img.orientation;
-  size_t r = snprintf(mod->img_param.datetime, sizeof(mod->img_param.datetime), "%s", mod_data->img.datetime);
-  if(r >= sizeof(mod->img_param.datetime)) mod->img_param.datetime[sizeof(mod->img_param.datetime)-1] = 0;
   float *noise_a = (float*)dt_module_param_float(mod, 1);
   float *noise_b = (float*)dt_module_param_float(mod, 2);
   if(noise_a[0] == 0.0f && noise_b[0] == 0.0f)
@@ -149,47 +290,6 @@ void modify_roi_out(
     mod->img_param.noise_a = noise_a[0];
     mod->img_param.noise_b = noise_b[0];
   }
-
-  for(int k=0;k<4;k++)
-  {
-    mod->img_param.black[k]        = mod_data->img.blacklevels[k];
-    mod->img_param.white[k]        = mod_data->img.whitelevels[k];
-    mod->img_param.whitebalance[k] = mod_data->img.wb_coeffs[k];
-    mod->img_param.crop_aabb[k]    = mod_data->img.crop_aabb[k];
-  }
-  // normalise wb
-  mod->img_param.whitebalance[0] /= mod->img_param.whitebalance[1];
-  mod->img_param.whitebalance[2] /= mod->img_param.whitebalance[1];
-  mod->img_param.whitebalance[3] /= mod->img_param.whitebalance[1];
-  mod->img_param.whitebalance[1] = 1.0f;
-  mod->img_param.filters = mod_data->img.filters;
-
-  if(isnanf(mod->img_param.cam_to_rec2020[0]))
-  { // camera matrix not found in exif or compiled without exiv2
-    float xyz_to_cam[12], mat[9] = {0};
-    // get d65 camera matrix from rawloader
-    for(int j=0;j<3;j++) for(int i=0;i<3;i++)
-      xyz_to_cam[3*j+i] = mod_data->img.xyz_to_cam[j][i];
-    mat3inv(mat, xyz_to_cam);
-
-    // compute matrix camrgb -> rec2020 d65
-    double cam_to_xyz[] = {
-      mat[0], mat[1], mat[2],
-      mat[3], mat[4], mat[5],
-      mat[6], mat[7], mat[8]};
-
-    const float xyz_to_rec2020[] = {
-       1.7166511880, -0.3556707838, -0.2533662814,
-      -0.6666843518,  1.6164812366,  0.0157685458,
-       0.0176398574, -0.0427706133,  0.9421031212
-    };
-    float cam_to_rec2020[9] = {0.0f};
-    for(int j=0;j<3;j++) for(int i=0;i<3;i++) for(int k=0;k<3;k++)
-      cam_to_rec2020[3*j+i] +=
-        xyz_to_rec2020[3*j+k] * cam_to_xyz[3*k+i];
-    for(int k=0;k<9;k++)
-      mod->img_param.cam_to_rec2020[k] = cam_to_rec2020[k];
-  }
 }
 
 int read_source(
@@ -204,6 +304,10 @@ int read_source(
     return 1;
   int err = load_raw(mod, id + mod->graph->frame, filename);
   if(err) return 1;
+  if(strstr(fname, "%")) // timelapse: decode the next frames while the gpu is busy with this one
+    dt_prefetch_ahead(((rawinput_buf_t *)mod->data)->prefetch, mod, fname,
+        id + mod->graph->frame, id + mod->graph->frame_cnt - 1,
+        dt_module_param_int(mod, 4)[0], (uint64_t)dt_module_param_int(mod, 5)[0] << 20);
   // TODO: if img.data_type == 1 it's a f32 buffer instead.
   uint16_t *buf = (uint16_t *)mapped;
 
@@ -16,6 +16,8 @@
 extern "C" {
 #include "modules/api.h"
 #include "core/log.h"
+#include "rawmeta.h"
+#include "modules/prefetch.h"
 
 static rawspeed::CameraMetaData *meta = 0;
 
@@ -35,6 +37,7 @@ typedef struct rawinput_buf_t
   std::unique_ptr<rawspeed::RawDecoder> d;
   char filename[PATH_MAX] = {0};
   int ox, oy;
+  dt_prefetch_t *prefetch = 0; // look-ahead decoding for timelapses
 }
 rawinput_buf_t;
 
@@ -86,68 +89,98 @@ free_raw(dt_module_t *mod)
   if(mod_data->d.get()) mod_data->d.reset();
 }
 
-int
-load_raw(
-    dt_module_t *mod,
-    const char *filename)
+// decode the full raw, returns a rawspeed::RawDecoder or 0 on failure.
+// this is also called on the prefetch threads.
+void *
+decode_raw(
+    void       *user,
+    int64_t     frame,
+    const char *filename,
+    uint64_t   *size)
 {
-  clock_t beg = clock();
-  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
-  if(mod_data)
-  {
-    if(!strcmp(mod_data->filename, filename))
-      return 0; // already loaded
-    else free_raw(mod); // maybe loaded the wrong one
-  }
-  else
-  {
-    assert(0); // this should be inited in init()
-  }
-
+  if(!meta) return 0;
+  std::unique_ptr<rawspeed::RawDecoder> d;
   rawspeed::FileReader f(filename);
 
   try
   {
-    rawspeed_load_meta(mod);
-
     auto [storage, storageBuf] = f.readFile();
 
     rawspeed::RawParser t(storageBuf);
-    mod_data->d = t.getDecoder(meta);
+    d = t.getDecoder(meta);
 
-    if(!mod_data->d.get()) return 1;
+    if(!d.get()) return 0;
 
-    mod_data->d->failOnUnknown = true;
-    mod_data->d->checkSupport(meta);
-    mod_data->d->decodeRaw();
-    mod_data->d->decodeMetaData(meta);
-    rawspeed::RawImage r = mod_data->d->mRaw;
+    d->failOnUnknown = true;
+    d->checkSupport(meta);
+    d->decodeRaw();
+    d->decodeMetaData(meta);
+    rawspeed::RawImage r = d->mRaw;
 
     const auto errors = r->getErrors();
     for(const auto &error : errors) dt_log(s_log_err, "[i-raw] (%s) %s\n", filename, error.c_str());
 
     // TODO: do some corruption detection and support for esoteric formats/fails here
     // the data type doesn't seem to be inited on hdrmerge raws:
-    // if(mod_data->d->mRaw->getDataType() == rawspeed::TYPE_FLOAT32)
+    // if(d->mRaw->getDataType() == rawspeed::TYPE_FLOAT32)
     if(sizeof(uint16_t) != r->getBpp())
     {
       dt_log(s_log_err, "[i-raw] unhandled pixel format: %s\n", filename);
-      return 1;
+      return 0;
     }
+    *size = (uint64_t)r->pitch * r->getUncroppedDim().y;
   }
   catch(const std::exception &exc)
   {
     dt_log(s_log_err, "[i-raw] (%s) %s\n", filename, exc.what());
-    return 1;
+    return 0;
   }
   catch(...)
   {
     dt_log(s_log_err, "[i-raw] unhandled exception");
-    return 1;
+    return 0;
+  }
+  return d.release();
+}
+
+void
+release_raw(void *user, void *d)
+{
+  delete (rawspeed::RawDecoder *)d;
+}
+
+int
+load_raw(
+    dt_module_t *mod,
+    int          frame,
+    const char  *filename)
+{
+  clock_t beg = clock();
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  if(mod_data)
+  {
+    if(!strcmp(mod_data->filename, filename))
+      return 0; // already loaded
+    else free_raw(mod); // maybe loaded the wrong one
   }
+  else
+  {
+    assert(0); // this should be inited in init()
+  }
+
+  rawspeed_load_meta(mod);
+  uint64_t size = 0;
+  void *d = dt_prefetch_take(mod_data->prefetch, frame, filename, &size);
+  const int prefetched = d != 0;
+  if(!d) d = decode_raw(0, frame, filename, &size);
+  if(!d) return 1;
+  if(!prefetched) dt_prefetch_frame_size(mod_data->prefetch, size);
+  mod_data->d.reset((rawspeed::RawDecoder *)d);
+
   clock_t end = clock();
   snprintf(mod_data->filename, sizeof(mod_data->filename), "%s", filename);
-  dt_log(s_log_perf, "[rawspeed] load %s in %3.0fms", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  dt_log(s_log_perf, "[rawspeed] load %s in %3.0fms%s", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC,
+      prefetched ? " (prefetched)" : "");
   return 0;
 }
 
@@ -156,6 +189,7 @@ load_raw(
 int init(dt_module_t *mod)
 {
   rawinput_buf_t *dat = new rawinput_buf_t();
+  dat->prefetch = dt_prefetch_create(decode_raw, release_raw, 0);
   mod->data = dat;
   return 0;
 }
@@ -172,6 +206,7 @@ void cleanup(dt_module_t *mod)
   if(!mod->data) return;
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
   free_raw(mod);
+  dt_prefetch_destroy(mod_data->prefetch);
   delete mod_data;
   mod->data = 0;
 }
@@ -194,24 +229,15 @@ check_params(
   return s_graph_run_record_cmd_buf;
 }
 
-// this callback is responsible to set the full_{wd,ht} dimensions on the
-// regions of interest on all "write"|"source" channels
-void modify_roi_out(
-    dt_graph_t  *graph,
-    dt_module_t *mod)
+// decode the raw and set the output dimensions and everything we know from
+// the file, except the noise model, on the module
+static int
+meta_from_raw(
+    dt_module_t *mod,
+    int          frame,
+    const char  *filename)
 {
-  // load image if not happened yet
-  const int   id    = dt_module_param_int(mod, 3)[0];
-  const char *fname = dt_module_param_string(mod, 0);
-  char        filename[2*PATH_MAX+10];
-  if(dt_graph_get_resource_filename(mod, fname, id, filename, sizeof(filename))) return;
-
-  if(strstr(fname, "%"))
-  { // reading a sequence of raws as a timelapse animation
-    mod->flags = s_module_request_read_source;
-  }
-  
-  if(load_raw(mod, filename)) return;
+  if(load_raw(mod, frame, filename)) return 1;
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
   rawspeed::iPoint2D dim_uncropped = mod_data->d->mRaw->getUncroppedDim();
   // we know we only have one connector called "output" (see our "connectors" file)
@@ -224,8 +250,6 @@ void modify_roi_out(
   // parse it more quickly.
   // put the real matrix in there directly, so we don't have to juggle
   // chromatic adaptation here.
-  float *noise_a = (float*)dt_module_param_float(mod, 1);
-  float *noise_b = (float*)dt_module_param_float(mod, 2);
   for(int k=0;k<9;k++)
   mod->img_param.cam_to_rec2020[k] = 0.0f/0.0f; // mark as uninitialised
 #ifdef VKDT_USE_EXIV2 // now essentially only for exposure time/aperture value
@@ -235,31 +259,6 @@ void modify_roi_out(
   snprintf(mod->img_param.maker, sizeof(mod->img_param.maker), "%s", mod_data->d->mRaw->metadata.canonical_make.c_str());
   snprintf(mod->img_param.model, sizeof(mod->img_param.model), "%s", mod_data->d->mRaw->metadata.canonical_model.c_str());
   mod->img_param.iso = mod_data->d->mRaw->metadata.isoSpeed;
-  if(noise_a[0] == 0.0f && noise_b[0] == 0.0f)
-  {
-    char pname[512];
-    snprintf(pname, sizeof(pname), "nprof/%s-%s-%d.nprof",
-        mod->img_param.maker,
-        mod->img_param.model,
-        (int)mod->img_param.iso);
-    FILE *f = dt_graph_open_resource(graph, id, pname, "rb");
-    if(f)
-    {
-      float a = 0.0f, b = 0.0f;
-      int num = fscanf(f, "%g %g", &a, &b);
-      if(num == 2)
-      {
-        noise_a[0] = mod->img_param.noise_a = a;
-        noise_b[0] = mod->img_param.noise_b = b;
-      }
-      fclose(f);
-    }
-  }
-  else
-  {
-    mod->img_param.noise_a = noise_a[0];
-    mod->img_param.noise_b = noise_b[0];
-  }
 
   // dimensions of cropped image (cut away black borders for noise estimation)
   rawspeed::iPoint2D dimCropped = mod_data->d->mRaw->dim;
@@ -398,6 +397,68 @@ void modify_roi_out(
   // round down to full block size:
   ro->full_wd = (ro->full_wd/block)*block;
   ro->full_ht = (ro->full_ht/block)*block;
+  return 0;
+}
+
+// this callback is responsible to set the full_{wd,ht} dimensions on the
+// regions of interest on all "write"|"source" channels
+void modify_roi_out(
+    dt_graph_t  *graph,
+    dt_module_t *mod)
+{
+  // load image if not happened yet
+  const int   id    = dt_module_param_int(mod, 3)[0];
+  const char *fname = dt_module_param_string(mod, 0);
+  char        filename[2*PATH_MAX+10];
+  if(dt_graph_get_resource_filename(mod, fname, id, filename, sizeof(filename))) return;
+
+  if(strstr(fname, "%"))
+  { // reading a sequence of raws as a timelapse animation
+    mod->flags = s_module_request_read_source;
+  }
+  
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  rawinput_meta_t m;
+  if(rawinput_meta_key(filename, &m) || rawinput_meta_find(&m))
+  { // not cached. rawspeed can't do much without decoding, so keep the decoder around for read_source
+    if(meta_from_raw(mod, id, filename)) return;
+    rawinput_meta_store(mod, mod_data->ox, mod_data->oy, &m);
+    rawinput_meta_insert(&m);
+  }
+  else
+  {
+    rawinput_meta_apply(mod, &m);
+    mod_data->ox = m.ox;
+    mod_data->oy = m.oy;
+  }
+
+  float *noise_a = (float*)dt_module_param_float(mod, 1);
+  float *noise_b = (float*)dt_module_param_float(mod, 2);
+  if(noise_a[0] == 0.0f && noise_b[0] == 0.0f)
+  {
+    char pname[512];
+    snprintf(pname, sizeof(pname), "nprof/%s-%s-%d.nprof",
+        mod->img_param.maker,
+        mod->img_param.model,
+        (int)mod->img_param.iso);
+    FILE *f = dt_graph_open_resource(graph, id, pname, "rb");
+    if(f)
+    {
+      float a = 0.0f, b = 0.0f;
+      int num = fscanf(f, "%g %g", &a, &b);
+      if(num == 2)
+      {
+        noise_a[0] = mod->img_param.noise_a = a;
+        noise_b[0] = mod->img_param.noise_b = b;
+      }
+      fclose(f);
+    }
+  }
+  else
+  {
+    mod->img_param.noise_a = noise_a[0];
+    mod->img_param.noise_b = noise_b[0];
+  }
 }
 
 int read_source(
@@ -410,12 +471,16 @@ int read_source(
   char        filename[2*PATH_MAX+10];
   if(dt_graph_get_resource_filename(mod, fname, id + mod->graph->frame, filename, sizeof(filename)))
     return 1;
-  int err = load_raw(mod, filename);
+  int err = load_raw(mod, id + mod->graph->frame, filename);
   if(err) return 1;
   uint16_t *buf = (uint16_t *)mapped;
 
   // dimensions of uncropped image
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  if(strstr(fname, "%")) // timelapse: decode the next frames while the gpu is busy with this one
+    dt_prefetch_ahead(mod_data->prefetch, mod, fname,
+        id + mod->graph->frame, id + mod->graph->frame_cnt - 1,
+        dt_module_param_int(mod, 4)[0], (uint64_t)dt_module_param_int(mod, 5)[0] << 20);
   rawspeed::iPoint2D dim_uncropped = mod_data->d->mRaw->getUncroppedDim();
   int wd = dim_uncropped.x;
   int ht = dim_uncropped.y;
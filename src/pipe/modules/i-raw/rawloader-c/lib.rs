@@ -68,35 +68,8 @@ unsafe fn copy_metadata(path : &str, rawimg : *mut c_rawimage) -> Result<()>
   Ok(())
 }
 
-#[no_mangle]
-pub unsafe extern "C" fn rl_decode_file(
-    filename: *mut c_char,
-    rawimg  : *mut c_rawimage,
-    ) -> u64
+unsafe fn copy_image(path : &str, image : &rawler::RawImage, rawimg : *mut c_rawimage) -> Result<()>
 {
-  let c_str: &CStr = CStr::from_ptr(filename);
-  let strn : &str = c_str.to_str().unwrap();
-  let mut image = rawler::decode_file(strn).unwrap();
-  let mut len = 0 as usize;
-  if let rawler::RawImageData::Integer(ref mut vdat) = image.data
-  {
-    len = vdat.len();
-    (*rawimg).data = vdat.as_mut_ptr() as *mut c_void;
-    std::mem::forget(image.data);
-    (*rawimg).data_type = 0;
-  }
-  else if let rawler::RawImageData::Float(ref mut vdat) = image.data
-  {
-    len = vdat.len();
-    (*rawimg).data = vdat.as_mut_ptr() as *mut c_void;
-    std::mem::forget(image.data);
-    (*rawimg).data_type = 1;
-  }
-  else
-  {
-    return len as u64;
-  }
-
   (*rawimg).width  = image.width  as u64;
   (*rawimg).stride = image.width  as u32;
   (*rawimg).height = image.height as u64;
@@ -111,7 +84,7 @@ pub unsafe extern "C" fn rl_decode_file(
     None    => for j in 0..3 { for i in 0..4 { (*rawimg).xyz_to_cam[i][j] = image.xyz_to_cam[i][j]; } }
   }
 
-  copy_metadata(strn, rawimg).unwrap();
+  copy_metadata(path, rawimg)?;
 
   copy_string(&image.make,  &mut (*rawimg).maker);
   copy_string(&image.model, &mut (*rawimg).model);
@@ -120,7 +93,7 @@ pub unsafe extern "C" fn rl_decode_file(
 
   // store aabb (x y X Y)
   // if let Rect ref cr = image.crop_area
-  match image.crop_area
+  match &image.crop_area
   {
     Some(cr) =>
     {
@@ -221,9 +194,61 @@ pub unsafe extern "C" fn rl_decode_file(
       (*rawimg).filters = 0; // no cfa
     },
   }
+  Ok(())
+}
+
+fn probe_file(path : &str) -> Result<rawler::RawImage>
+{
+  let input = BufReader::new(File::open(&path).map_err(|e| rawler::RawlerError::with_io_error("load into buffer", &path, e))?);
+  let mut rawfile = rawler::RawFile::new(&path, input);
+  let decoder = rawler::get_decoder(&mut rawfile)?;
+  // dummy decode: parse all the headers but leave the pixel data alone
+  decoder.raw_image(&mut rawfile, RawDecodeParams::default(), true)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn rl_decode_file(
+    filename: *mut c_char,
+    rawimg  : *mut c_rawimage,
+    ) -> u64
+{
+  let c_str: &CStr = CStr::from_ptr(filename);
+  let strn : &str = c_str.to_str().unwrap();
+  let mut image = rawler::decode_file(strn).unwrap();
+  copy_image(strn, &image, rawimg).unwrap();
+  let mut len = 0 as usize;
+  if let rawler::RawImageData::Integer(ref mut vdat) = image.data
+  {
+    len = vdat.len();
+    (*rawimg).data = vdat.as_mut_ptr() as *mut c_void;
+    std::mem::forget(image.data);
+    (*rawimg).data_type = 0;
+  }
+  else if let rawler::RawImageData::Float(ref mut vdat) = image.data
+  {
+    len = vdat.len();
+    (*rawimg).data = vdat.as_mut_ptr() as *mut c_void;
+    std::mem::forget(image.data);
+    (*rawimg).data_type = 1;
+  }
   len as u64
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn rl_probe_file(
+    filename: *const c_char,
+    rawimg  : *mut c_rawimage,
+    ) -> i32
+{
+  let c_str: &CStr = CStr::from_ptr(filename);
+  let strn = match c_str.to_str() { Ok(s) => s, Err(_) => return 1 };
+  let image = match probe_file(strn) { Ok(i) => i, Err(_) => return 1 };
+  if copy_image(strn, &image, rawimg).is_err() { return 1; }
+  (*rawimg).data = std::ptr::null_mut();
+  (*rawimg).data_type = if let rawler::RawImageData::Float(_) = image.data { 1 } else { 0 };
+  0
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn rl_deallocate(ptr: *mut c_void, len: u64)
 {
@@ -33,6 +33,12 @@ uint64_t rl_decode_file(
     const char *filename,
     rawimage_t *rawimg);
 
+// fill in everything but the pixel data, reading only the headers of the file.
+// returns zero on success.
+int rl_probe_file(
+    const char *filename,
+    rawimage_t *rawimg);
+
 void rl_deallocate(
     void    *data,
     uint64_t size);
@@ -0,0 +1,111 @@
+#pragma once
+// small process wide cache of everything modify_roi_out needs to know about a
+// raw file: output dimensions, cfa offset and the raw/exif part of the image
+// params. it is keyed by the filename and the mtime and size of the file, so
+// creating another graph for the same image (thumbnails, export, switching
+// back to darkroom) does not touch the raw file at all. the pixels are only
+// decoded in read_source.
+#include "db/hash.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct rawinput_meta_t
+{
+  uint64_t hash;      // hash64() of the filename
+  int64_t  mtime;     // of the raw file
+  uint64_t size;      // of the raw file in bytes
+  uint32_t wd, ht;    // full_wd and full_ht of the output connector
+  int      ox, oy;    // offset to align the buffer to the cfa pattern
+  dt_image_params_t p;
+}
+rawinput_meta_t;
+
+#define RAWINPUT_META_CNT 64
+static pthread_mutex_t rawinput_meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rawinput_meta_t rawinput_meta_entry[RAWINPUT_META_CNT];
+static uint32_t        rawinput_meta_next = 0;
+
+// initialise the key of the given entry. returns non-zero if the file
+// could not be stat'ed, the entry shall not go to the cache then.
+static inline int
+rawinput_meta_key(
+    const char      *filename,
+    rawinput_meta_t *m)
+{
+  memset(m, 0, sizeof(*m));
+  struct stat sb;
+  if(stat(filename, &sb)) return 1;
+  m->hash  = hash64(filename);
+  m->mtime = sb.st_mtime;
+  m->size  = sb.st_size;
+  return 0;
+}
+
+// look up the entry with the same key as m, returns zero on success.
+static inline int
+rawinput_meta_find(rawinput_meta_t *m)
+{
+  int err = 1;
+  pthread_mutex_lock(&rawinput_meta_mutex);
+  for(int i=0;i<RAWINPUT_META_CNT;i++)
+  {
+    const rawinput_meta_t *e = rawinput_meta_entry + i;
+    if(e->hash == m->hash && e->mtime == m->mtime && e->size == m->size && e->wd)
+    {
+      *m = *e;
+      err = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&rawinput_meta_mutex);
+  return err;
+}
+
+// remember a fully initialised entry, replacing the oldest one.
+static inline void
+rawinput_meta_insert(const rawinput_meta_t *m)
+{
+  if(!m->hash) return;
+  pthread_mutex_lock(&rawinput_meta_mutex);
+  rawinput_meta_entry[rawinput_meta_next] = *m;
+  rawinput_meta_entry[rawinput_meta_next].p.meta = 0; // owned by the module instance
+  rawinput_meta_next = (rawinput_meta_next + 1) % RAWINPUT_META_CNT;
+  pthread_mutex_unlock(&rawinput_meta_mutex);
+}
+
+// take a snapshot of what modify_roi_out computed for the module.
+static inline void
+rawinput_meta_store(
+    const dt_module_t *mod,
+    int ox, int oy,
+    rawinput_meta_t   *m)
+{
+  m->wd = mod->connector[0].roi.full_wd;
+  m->ht = mod->connector[0].roi.full_ht;
+  m->ox = ox;
+  m->oy = oy;
+  m->p  = mod->img_param;
+}
+
+// set the output dimensions and image params from the cache. leaves the
+// noise model, audio and the other fields not coming from the raw file alone.
+static inline void
+rawinput_meta_apply(
+    dt_module_t           *mod,
+    const rawinput_meta_t *m)
+{
+  const dt_image_params_t keep = mod->img_param;
+  mod->connector[0].roi.full_wd = m->wd;
+  mod->connector[0].roi.full_ht = m->ht;
+  mod->img_param = m->p;
+  mod->img_param.snd_format     = keep.snd_format;
+  mod->img_param.snd_channels   = keep.snd_channels;
+  mod->img_param.snd_samplerate = keep.snd_samplerate;
+  mod->img_param.noise_a        = keep.noise_a;
+  mod->img_param.noise_b        = keep.noise_b;
+  mod->img_param.input_name     = keep.input_name;
+  mod->img_param.meta           = keep.meta;
+}
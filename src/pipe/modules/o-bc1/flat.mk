@@ -1,3 +1,2 @@
 MOD_LDFLAGS=-lz
-# actually unused currently:
-#MOD_CFLAGS=-fopenmp
+MOD_DEPS=pipe/modules/o-bc1/bc1.h
@@ -3,6 +3,7 @@
 #include "core/fs.h"
 #define STB_DXT_IMPLEMENTATION
 #include "stb_dxt.h"
+#include "bc1.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,51 +11,51 @@
 #include <string.h>
 #include <zlib.h>
 
+void cleanup(dt_module_t *mod)
+{
+  free(mod->data);
+  mod->data = 0;
+}
+
 // called after pipeline finished up to here.
 // our input buffer will come in memory mapped.
+// with an empty filename, no file is written. the header and blocks are kept
+// in module->data instead, for the thumbnail cache to append to its archive.
 void write_sink(
     dt_module_t *module,
     void *buf)
 {
   const char *filename = dt_module_param_string(module, 0);
+  const int hq = dt_module_param_int(module, dt_module_get_param(module->so, dt_token("quality")))[0];
   // fprintf(stderr, "[o-bc1] writing '%s'\n", filename);
 
   const uint32_t wd = module->connector[0].roi.wd;
   const uint32_t ht = module->connector[0].roi.ht;
   const uint8_t *in = (const uint8_t *)buf;
 
-  // go through all 4x4 blocks
-  // parallelise via our thread pool or openmp or what?
-  // probably usually bc1 thumbnails are too small to warrant a good speedup.
+  // go through all 4x4 blocks, rows of blocks in parallel on our thread pool
   const int bx = wd/4, by = ht/4;
   size_t num_blocks = bx * (uint64_t)by;
-  uint8_t *out = (uint8_t *)malloc(sizeof(uint8_t)*8*num_blocks);
-// #pragma omp parallel for collapse(2) schedule(static)
-  for(int j=0;j<4*by;j+=4)
-  {
-    for(int i=0;i<4*bx;i+=4)
-    { // swizzle block data together:
-      uint8_t block[64];
-      for(int jj=0;jj<4;jj++)
-        for(int ii=0;ii<4;ii++)
-          for(int c=0;c<4;c++)
-            block[4*(4*jj+ii)+c] = in[4*(wd*(j+jj)+(i+ii))+c];
+  // magic, version, width, height
+  const uint32_t header[4] = { dt_token("bc1z"), 1, bx*4, by*4 };
+  uint8_t *mem = (uint8_t *)malloc(sizeof(header) + sizeof(uint8_t)*8*num_blocks);
+  uint8_t *out = mem + sizeof(header);
+  memcpy(mem, header, sizeof(header));
+  bc1_compress(out, in, wd, ht, hq, 0);
 
-      stb_compress_dxt_block(
-          out + 8*(bx*(j/4)+(i/4)), block, 0,
-          0); // or slower: STB_DXT_HIGHQUAL
-    }
+  if(!filename[0])
+  {
+    free(module->data);
+    module->data = mem;
+    return;
   }
 
   char tmpfile[1024];
   snprintf(tmpfile, sizeof(tmpfile), "%s.temp", filename);
   gzFile f = gzopen(tmpfile, "wb");
-  // write magic, version, width, height
-  uint32_t header[4] = { dt_token("bc1z"), 1, bx*4, by*4 };
-  gzwrite(f, header, sizeof(uint32_t)*4);
-  gzwrite(f, out, sizeof(uint8_t)*8*num_blocks);
+  gzwrite(f, mem, sizeof(header) + sizeof(uint8_t)*8*num_blocks);
   gzclose(f);
-  free(out);
+  free(mem);
   // atomically create filename only when we're quite done writing:
   unlink(filename); // just to be sure the link will work
   fs_link(tmpfile, filename);
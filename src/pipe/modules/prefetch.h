@@ -0,0 +1,309 @@
+#pragma once
+// look-ahead decoding for input modules which play back sequences (i-raw
+// timelapses, i-mlv clips). while the gpu processes frame n, frames n+1..n+k
+// are decoded on the thread pool. the number of frames in flight is bounded by
+// a memory budget. when the user scrubs, everything outside the new look-ahead
+// window is cancelled: queued frames are dropped, frames that are being
+// decoded are discarded as soon as the decoder returns.
+//
+// the decoded frames are opaque to this code, the backend passes a decode and
+// a release callback. decode runs on several frames concurrently.
+#include "core/threads.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DT_PREFETCH_MAX 16
+
+// decode the given frame, filename is empty if the backend didn't pass a
+// pattern to dt_prefetch_ahead(). returns 0 on failure.
+typedef void *(*dt_prefetch_decode_t)(void *user, int64_t frame, const char *filename, uint64_t *size);
+typedef void  (*dt_prefetch_release_t)(void *user, void *data);
+
+typedef enum dt_prefetch_state_t
+{
+  s_prefetch_empty = 0,  // unused slot
+  s_prefetch_queued,     // job pushed to the thread pool
+  s_prefetch_decoding,   // a worker is decoding this frame
+  s_prefetch_cancelled,  // decoding, but the result is not wanted any more
+  s_prefetch_done,       // data is ready to be taken
+  s_prefetch_failed,     // could not decode, read_source will try again
+}
+dt_prefetch_state_t;
+
+typedef struct dt_prefetch_slot_t
+{
+  dt_prefetch_state_t state;
+  int64_t  frame;      // frame number as passed to dt_prefetch_ahead()
+  uint32_t gen;        // incremented whenever a queued job is cancelled
+  uint64_t size;       // bytes held by data
+  void    *data;       // decoded frame as returned by the decode callback
+  char     filename[2*PATH_MAX+10];
+}
+dt_prefetch_slot_t;
+
+typedef struct dt_prefetch_t
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;      // signalled whenever a job finishes
+  int             ref;       // one for the module plus one per job in flight
+  int             decoding;  // number of jobs in the decode callback right now
+  uint64_t        used;      // bytes held by done slots
+  uint64_t        frame_size;// size of the last decoded frame, to estimate memory use
+  dt_prefetch_slot_t slot[DT_PREFETCH_MAX];
+  dt_prefetch_decode_t  decode;
+  dt_prefetch_release_t release;
+  void                 *user; // passed to the callbacks
+}
+dt_prefetch_t;
+
+typedef struct dt_prefetch_job_t
+{
+  dt_prefetch_t *pf;
+  int            slot;
+  uint32_t       gen;
+}
+dt_prefetch_job_t;
+
+static inline dt_prefetch_t *
+dt_prefetch_create(
+    dt_prefetch_decode_t  decode,
+    dt_prefetch_release_t release,
+    void                 *user)
+{
+  dt_prefetch_t *pf = (dt_prefetch_t *)calloc(1, sizeof(*pf));
+  pthread_mutex_init(&pf->mutex, 0);
+  pthread_cond_init(&pf->cond, 0);
+  pf->ref     = 1;
+  pf->decode  = decode;
+  pf->release = release;
+  pf->user    = user;
+  return pf;
+}
+
+// cancel the slot, needs to hold the mutex.
+static inline void
+dt_prefetch_cancel_slot(
+    dt_prefetch_t      *pf,
+    dt_prefetch_slot_t *s)
+{
+  switch(s->state)
+  {
+  case s_prefetch_queued:
+    s->gen++; // the job will notice and do nothing
+    // fallthrough
+  case s_prefetch_failed:
+    s->state = s_prefetch_empty;
+    break;
+  case s_prefetch_decoding:
+    s->state = s_prefetch_cancelled; // the job will clean up
+    break;
+  case s_prefetch_done:
+    pf->release(pf->user, s->data);
+    pf->used -= s->size;
+    s->data  = 0;
+    s->size  = 0;
+    s->state = s_prefetch_empty;
+    break;
+  default:
+    break;
+  }
+}
+
+static inline void
+dt_prefetch_unref(dt_prefetch_t *pf)
+{ // needs to hold the mutex, will release it
+  const int ref = --pf->ref;
+  pthread_mutex_unlock(&pf->mutex);
+  if(ref) return;
+  pthread_mutex_destroy(&pf->mutex);
+  pthread_cond_destroy(&pf->cond);
+  free(pf);
+}
+
+// cancel everything, wait for the jobs that are decoding right now and drop
+// the module's reference. the user data can go away after this returns,
+// queued jobs will free the struct.
+static inline void
+dt_prefetch_destroy(dt_prefetch_t *pf)
+{
+  if(!pf) return;
+  pthread_mutex_lock(&pf->mutex);
+  for(int i=0;i<DT_PREFETCH_MAX;i++)
+    dt_prefetch_cancel_slot(pf, pf->slot + i);
+  while(pf->decoding)
+    pthread_cond_wait(&pf->cond, &pf->mutex);
+  dt_prefetch_unref(pf);
+}
+
+static inline void
+dt_prefetch_work(uint32_t item, void *arg)
+{
+  dt_prefetch_job_t  *j  = (dt_prefetch_job_t *)arg;
+  dt_prefetch_t      *pf = j->pf;
+  dt_prefetch_slot_t *s  = pf->slot + j->slot;
+  char filename[sizeof(s->filename)];
+  pthread_mutex_lock(&pf->mutex);
+  if(s->gen != j->gen || s->state != s_prefetch_queued)
+  { // cancelled before we even started
+    pthread_mutex_unlock(&pf->mutex);
+    return;
+  }
+  s->state = s_prefetch_decoding;
+  pf->decoding++;
+  const int64_t frame = s->frame;
+  memcpy(filename, s->filename, sizeof(filename));
+  pthread_mutex_unlock(&pf->mutex);
+
+  uint64_t size = 0;
+  void *data = pf->decode(pf->user, frame, filename, &size);
+
+  pthread_mutex_lock(&pf->mutex);
+  if(s->state == s_prefetch_decoding)
+  {
+    s->data  = data;
+    s->size  = size;
+    s->state = data ? s_prefetch_done : s_prefetch_failed;
+    pf->used += size;
+    if(size) pf->frame_size = size;
+  }
+  else
+  { // scrubbed away while we were busy
+    if(data) pf->release(pf->user, data);
+    s->state = s_prefetch_empty;
+  }
+  pf->decoding--;
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->mutex);
+}
+
+static inline void
+dt_prefetch_free(void *arg)
+{
+  dt_prefetch_job_t *j = (dt_prefetch_job_t *)arg;
+  dt_prefetch_t *pf = j->pf;
+  free(j);
+  pthread_mutex_lock(&pf->mutex);
+  dt_prefetch_unref(pf);
+}
+
+// let the prefetcher know how big a frame is, to respect the memory budget
+// before it has decoded anything itself.
+static inline void
+dt_prefetch_frame_size(
+    dt_prefetch_t *pf,
+    uint64_t       size)
+{
+  if(!pf) return;
+  pthread_mutex_lock(&pf->mutex);
+  pf->frame_size = size;
+  pthread_mutex_unlock(&pf->mutex);
+}
+
+// take the decoded frame if it has been prefetched. waits if it is currently
+// being decoded. the caller owns the data afterwards. returns 0 if the caller
+// needs to decode the frame itself. if filename is given, it has to match the
+// one the frame has been decoded from, too.
+static inline void *
+dt_prefetch_take(
+    dt_prefetch_t *pf,
+    int64_t        frame,
+    const char    *filename,
+    uint64_t      *size)
+{
+  if(!pf) return 0;
+  void *data = 0;
+  pthread_mutex_lock(&pf->mutex);
+  for(int i=0;i<DT_PREFETCH_MAX;i++)
+  {
+    dt_prefetch_slot_t *s = pf->slot + i;
+    if(s->state == s_prefetch_empty || s->frame != frame) continue;
+    if(filename && strcmp(s->filename, filename)) continue;
+    if(s->state == s_prefetch_queued)
+    { // not started yet, the pool is busy. faster to do it ourselves
+      dt_prefetch_cancel_slot(pf, s);
+      break;
+    }
+    while(s->state == s_prefetch_decoding)
+      pthread_cond_wait(&pf->cond, &pf->mutex);
+    if(s->state == s_prefetch_done)
+    { // transfer ownership to the caller
+      data = s->data;
+      *size = s->size;
+      pf->used -= s->size;
+      s->data  = 0;
+      s->size  = 0;
+      s->state = s_prefetch_empty;
+    }
+    else dt_prefetch_cancel_slot(pf, s);
+    break;
+  }
+  pthread_mutex_unlock(&pf->mutex);
+  return data;
+}
+
+// we just delivered `frame`. queue up to `ahead` of the following frames
+// without exceeding `budget` bytes (0 means no limit), and cancel everything
+// outside this window. if fname is a filename pattern with %d, it is resolved
+// for every frame and passed on to the decode callback.
+static inline void
+dt_prefetch_ahead(
+    dt_prefetch_t *pf,
+    dt_module_t   *mod,
+    const char    *fname,
+    int64_t        frame,
+    int64_t        last,      // last valid frame of the sequence
+    int            ahead,
+    uint64_t       budget)
+{
+#ifndef VKDT_DSO_BUILD // no access to the thread pool from windows dlls
+  if(!pf) return;
+  ahead = ahead < DT_PREFETCH_MAX ? ahead : DT_PREFETCH_MAX;
+  if(ahead < 0) ahead = 0;
+  if(frame + ahead > last) ahead = frame < last ? last - frame : 0;
+  pthread_mutex_lock(&pf->mutex);
+  int busy = 0;
+  for(int i=0;i<DT_PREFETCH_MAX;i++)
+  {
+    dt_prefetch_slot_t *s = pf->slot + i;
+    if(s->state == s_prefetch_empty) continue;
+    if(s->frame <= frame || s->frame > frame + ahead)
+      dt_prefetch_cancel_slot(pf, s);
+    if(s->state != s_prefetch_empty) busy++;
+  }
+  for(int64_t f=frame+1;f<=frame+ahead;f++)
+  {
+    // before we know the size of a frame, only risk one
+    if(budget && (pf->frame_size ? (busy+1) * pf->frame_size > budget : busy > 0)) break;
+    int have = 0, free_slot = -1;
+    for(int i=0;i<DT_PREFETCH_MAX;i++)
+    {
+      if(pf->slot[i].state == s_prefetch_empty) { if(free_slot < 0) free_slot = i; }
+      else if(pf->slot[i].frame == f) have = 1;
+    }
+    if(have) continue;
+    if(free_slot < 0) break;
+    dt_prefetch_slot_t *s = pf->slot + free_slot;
+    s->filename[0] = 0;
+    if(fname && dt_graph_get_resource_filename(mod, fname, f, s->filename, sizeof(s->filename))) break;
+    dt_prefetch_job_t *j = (dt_prefetch_job_t *)malloc(sizeof(*j));
+    j->pf   = pf;
+    j->slot = free_slot;
+    j->gen  = s->gen;
+    s->frame = f;
+    s->state = s_prefetch_queued;
+    pf->ref++;
+    if(threads_task("prefetch", 1, -1, j, dt_prefetch_work, dt_prefetch_free) < 0)
+    { // pool is full, try again next frame
+      pf->ref--;
+      s->state = s_prefetch_empty;
+      free(j);
+      break;
+    }
+    busy++;
+  }
+  pthread_mutex_unlock(&pf->mutex);
+#endif
+}
@@ -2,15 +2,27 @@
 #include <math.h>
 #include <stdlib.h>
 
-// request everything
+// request everything, or only what we need if a source module feeds us directly
 void modify_roi_in(
     dt_graph_t *graph,
     dt_module_t *module)
 {
+  dt_roi_t *ri = &module->connector[0].roi;
+  const dt_roi_t *ro = &module->connector[1].roi;
+  const dt_connector_t *c = module->connector;
+  if(ro->scale > 1.0f && c->connected_mi >= 0 && c->connected_mc >= 0 &&
+     graph->module[c->connected_mi].connector[c->connected_mc].type == dt_token("source"))
+  { // sources that can decode at lower resolution (i-jpg) will pick this up,
+    // all others are forced to full resolution by the graph anyways.
+    ri->wd = ceilf(ri->full_wd / ro->scale);
+    ri->ht = ceilf(ri->full_ht / ro->scale);
+    ri->scale = ro->scale;
+    return;
+  }
   // request the full thing, we'll rescale
-  module->connector[0].roi.wd = module->connector[0].roi.full_wd;
-  module->connector[0].roi.ht = module->connector[0].roi.full_ht;
-  module->connector[0].roi.scale = 1.0f;
+  ri->wd = ri->full_wd;
+  ri->ht = ri->full_ht;
+  ri->scale = 1.0f;
 }
 
 void
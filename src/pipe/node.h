@@ -46,6 +46,11 @@ typedef struct dt_node_t
 
   uint32_t push_constant[64];  // GTX1080 has size == 256 as max anyways
   size_t   push_constant_size;
+
+  uint64_t hash;        // identifies the content of the output, 0 if it can't be cached (see nodecache.h)
+  int      cache_hit;   // output is uploaded from the node cache instead of computed in this run
+  const void *cache_data; // reference to the cached output from lookup until upload
+  int      cache_need;  // output is read by a node that runs
 }
 dt_node_t;
 
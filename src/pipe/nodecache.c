@@ -0,0 +1,136 @@
+#include "nodecache.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+// one reference for the table plus one per dt_nodecache_get()
+typedef struct dt_nodecache_blob_t
+{
+  uint64_t ref;
+  uint8_t  data[];
+}
+dt_nodecache_blob_t;
+
+// call with the lock held
+static void
+unref(dt_nodecache_blob_t *b)
+{
+  if(!--b->ref) free(b);
+}
+
+void
+dt_nodecache_init(dt_nodecache_t *c, uint64_t max_bytes)
+{
+  memset(c, 0, sizeof(*c));
+  threads_mutex_init(&c->mutex, 0);
+  c->max_bytes = max_bytes;
+}
+
+void
+dt_nodecache_cleanup(dt_nodecache_t *c)
+{
+  for(uint32_t i=0;i<c->cnt;i++) unref(c->entry[i].data);
+  threads_mutex_destroy(&c->mutex);
+  memset(c, 0, sizeof(*c));
+}
+
+// call with the lock held
+static dt_nodecache_entry_t *
+find(dt_nodecache_t *c, uint64_t hash, uint64_t size)
+{
+  for(uint32_t i=0;i<c->cnt;i++)
+    if(c->entry[i].hash == hash && c->entry[i].size == size)
+      return c->entry + i;
+  return 0;
+}
+
+// call with the lock held
+static void
+evict_lru(dt_nodecache_t *c)
+{
+  uint32_t lru = 0;
+  for(uint32_t i=1;i<c->cnt;i++)
+    if(c->entry[i].used < c->entry[lru].used) lru = i;
+  unref(c->entry[lru].data);
+  c->bytes -= c->entry[lru].size;
+  c->entry[lru] = c->entry[--c->cnt];
+}
+
+int
+dt_nodecache_has(dt_nodecache_t *c, uint64_t hash, uint64_t size)
+{
+  threads_mutex_lock(&c->mutex);
+  const int res = find(c, hash, size) != 0;
+  threads_mutex_unlock(&c->mutex);
+  return res;
+}
+
+int
+dt_nodecache_read(dt_nodecache_t *c, uint64_t hash, void *dst, uint64_t size)
+{
+  threads_mutex_lock(&c->mutex);
+  dt_nodecache_entry_t *e = find(c, hash, size);
+  if(e)
+  {
+    memcpy(dst, e->data->data, size);
+    e->used = ++c->clock;
+  }
+  threads_mutex_unlock(&c->mutex);
+  return e == 0;
+}
+
+const void *
+dt_nodecache_get(dt_nodecache_t *c, uint64_t hash, uint64_t size)
+{
+  threads_mutex_lock(&c->mutex);
+  dt_nodecache_entry_t *e = find(c, hash, size);
+  const void *data = 0;
+  if(e)
+  {
+    e->data->ref++;
+    e->used = ++c->clock;
+    data = e->data->data;
+  }
+  threads_mutex_unlock(&c->mutex);
+  return data;
+}
+
+void
+dt_nodecache_release(dt_nodecache_t *c, const void *data)
+{
+  if(!data) return;
+  threads_mutex_lock(&c->mutex);
+  unref((dt_nodecache_blob_t *)((const uint8_t *)data - offsetof(dt_nodecache_blob_t, data)));
+  threads_mutex_unlock(&c->mutex);
+}
+
+int
+dt_nodecache_write(dt_nodecache_t *c, uint64_t hash, const void *src, uint64_t size)
+{
+  if(size > c->max_bytes) return 1;
+  dt_nodecache_blob_t *data = malloc(sizeof(*data) + size); // copy outside the lock
+  if(!data) return 1;
+  data->ref = 1;
+  memcpy(data->data, src, size);
+  threads_mutex_lock(&c->mutex);
+  dt_nodecache_entry_t *e = find(c, hash, size);
+  if(e)
+  { // same content, just touch it
+    e->used = ++c->clock;
+    threads_mutex_unlock(&c->mutex);
+    free(data);
+    return 0;
+  }
+  while(c->cnt && (c->bytes + size > c->max_bytes || c->cnt >= DT_NODECACHE_MAX_ENTRIES))
+    evict_lru(c);
+  c->entry[c->cnt++] = (dt_nodecache_entry_t){
+    .hash = hash,
+    .size = size,
+    .used = ++c->clock,
+    .data = data,
+  };
+  c->bytes += size;
+  threads_mutex_unlock(&c->mutex);
+  return 0;
+}
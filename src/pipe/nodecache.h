@@ -0,0 +1,55 @@
+#pragma once
+#include "core/threads.h"
+#include <stdint.h>
+
+// host memory cache for node outputs across graph re-creations. an output is
+// identified by the hash of everything that went into computing it (module,
+// kernel, parameters, roi and the hashes of the inputs, or the time stamp and
+// size of the files a source reads, see dt_node_t.hash).
+// before a graph is torn down, the outputs it keeps resident are downloaded
+// here. a later graph computing the same node uploads them instead of running
+// everything before it. the total size is bounded, least recently used
+// entries are evicted first. max_bytes == 0 disables the cache.
+// all functions are thread safe. the data of an entry is reference counted, so
+// a graph can hold on to it from lookup to upload even if it is evicted by
+// another thread in the meantime.
+
+#define DT_NODECACHE_MAX_ENTRIES 64
+
+typedef struct dt_nodecache_entry_t
+{
+  uint64_t hash;
+  uint64_t size;
+  uint64_t used;     // time stamp of last access, for lru eviction
+  struct dt_nodecache_blob_t *data;
+}
+dt_nodecache_entry_t;
+
+typedef struct dt_nodecache_t
+{
+  threads_mutex_t      mutex;
+  uint64_t             max_bytes;
+  uint64_t             bytes;
+  uint64_t             clock;
+  uint32_t             cnt;
+  dt_nodecache_entry_t entry[DT_NODECACHE_MAX_ENTRIES];
+}
+dt_nodecache_t;
+
+void dt_nodecache_init(dt_nodecache_t *c, uint64_t max_bytes);
+void dt_nodecache_cleanup(dt_nodecache_t *c);
+
+// returns 1 if an entry with this hash and size exists
+int dt_nodecache_has(dt_nodecache_t *c, uint64_t hash, uint64_t size);
+
+// copy the cached data to dst, returns non-zero if not found
+int dt_nodecache_read(dt_nodecache_t *c, uint64_t hash, void *dst, uint64_t size);
+
+// grab a reference to the data of the entry with this hash and size, or return
+// 0 if there is none. the data stays valid until dt_nodecache_release().
+const void *dt_nodecache_get(dt_nodecache_t *c, uint64_t hash, uint64_t size);
+void dt_nodecache_release(dt_nodecache_t *c, const void *data);
+
+// insert a copy of the data, evicting old entries as needed.
+// returns non-zero if it does not fit or we're out of memory.
+int dt_nodecache_write(dt_nodecache_t *c, uint64_t hash, const void *src, uint64_t size);
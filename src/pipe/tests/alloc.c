@@ -2,12 +2,126 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <time.h>
 
-int main(int argc, char *arg[])
+// run a random schedule through the first fit allocator while recording
+// lifetimes, then plan offline and make sure nothing that is alive at the
+// same time overlaps.
+static void
+test_plan(uint32_t seed)
+{
+  dt_vkalloc_t a;
+  dt_vkalloc_init(&a, 1000, ((uint64_t)1)<<40);
+  a.plan = 1;
+  srand(seed);
+
+  const int steps = 100;
+  dt_vkmem_t *mem[100][4] = {{0}};
+  int free_at[100][4] = {{0}};
+  for(int s=0;s<steps;s++)
+  {
+    a.step = s;
+    const int cnt = 1 + rand() % 4;
+    for(int i=0;i<cnt;i++)
+    {
+      uint64_t size  = 1000 + rand() % 100000;
+      uint64_t align = 1ul << (rand() % 10);
+      if(rand() % 20 == 0) mem[s][i] = dt_vkalloc_feedback(&a, size, align);
+      else                 mem[s][i] = dt_vkalloc(&a, size, align);
+      free_at[s][i] = s + rand() % 10;
+      if(rand() % 10 == 0) free_at[s][i] = steps; // lives until the end
+    }
+    for(int t=0;t<=s;t++) for(int i=0;i<4;i++)
+      if(mem[t][i] && free_at[t][i] == s)
+      {
+        dt_vkfree(&a, mem[t][i]);
+        mem[t][i] = 0;
+      }
+    int err = dt_vkalloc_check(&a);
+    assert(!err);
+  }
+  const uint64_t vmsize_ff = a.vmsize;
+  const int planned = dt_vkalloc_plan(&a);
+  assert(a.vmsize_ff == vmsize_ff);
+  if(planned) assert(a.vmsize < vmsize_ff);
+  else        assert(a.vmsize == vmsize_ff);
+
+  if(planned)
+  { // check the planned offsets
+    uint64_t vmsize = 0;
+    for(uint32_t i=0;i<a.rec_cnt;i++)
+    {
+      const dt_vkalloc_rec_t *r = a.rec + i;
+      assert(!(r->offset & (r->alignment-1)));
+      vmsize = r->offset + r->size > vmsize ? r->offset + r->size : vmsize;
+      for(uint32_t j=i+1;j<a.rec_cnt;j++)
+      {
+        const dt_vkalloc_rec_t *q = a.rec + j;
+        if(q->beg > r->end || r->beg > q->end) continue;
+        assert(q->offset >= r->offset + r->size || r->offset >= q->offset + q->size);
+      }
+    }
+    assert(vmsize == a.vmsize);
+    for(dt_vkmem_t *l=a.used;l;l=l->next)
+      assert(l->offset == a.rec[l->rec].offset);
+  }
+  fprintf(stderr, "[plan %u] %u allocations, first fit vmsize %"PRIu64" planned %"PRIu64"%s\n",
+      seed, a.rec_cnt, vmsize_ff, a.vmsize, planned ? "" : " (kept first fit)");
+
+  dt_vkalloc_cleanup(&a);
+}
+
+// a small buffer filling the hole of a big one makes first fit append the
+// next big buffer at the end, the planner gets the lower bound here.
+static void
+test_plan_hole()
 {
+  const uint64_t big = 1000, small = 10;
   dt_vkalloc_t a;
-  dt_vkalloc_init(&a);
-  // alloc a few test things with known outcome
+  dt_vkalloc_init(&a, 100, ((uint64_t)1)<<40);
+  a.plan = 1;
+  a.step = 0;
+  dt_vkmem_t *A = dt_vkalloc(&a, big, 1);
+  a.step = 1;
+  dt_vkmem_t *B = dt_vkalloc(&a, big, 1);
+  dt_vkalloc(&a, small, 1); // lives until the end
+  dt_vkfree(&a, A);
+  a.step = 2;
+  dt_vkmem_t *c = dt_vkalloc(&a, small, 1);
+  dt_vkfree(&a, B);
+  a.step = 3;
+  dt_vkmem_t *D = dt_vkalloc(&a, big, 1);
+  dt_vkmem_t *E = dt_vkalloc(&a, big, 1);
+  a.step = 4;
+  dt_vkfree(&a, c);
+  dt_vkfree(&a, D);
+  dt_vkfree(&a, E);
+  assert(a.vmsize == 3*big + small);
+  int planned = dt_vkalloc_plan(&a);
+  assert(planned);
+  assert(a.vmsize_ff == 3*big + small);
+  assert(a.vmsize == 2*big + 2*small);
+  dt_vkalloc_cleanup(&a);
+}
+
+static void
+init(dt_vkalloc_t *a, int tlsf, uint64_t pool_size, uint64_t bytesize)
+{
+  if(tlsf)
+  {
+    int err = dt_vkalloc_init_tlsf(a, pool_size, bytesize);
+    assert(!err);
+  }
+  else dt_vkalloc_init(a, pool_size, bytesize);
+}
+
+// alloc a few test things with known outcome
+static void
+test_basic(int tlsf)
+{
+  dt_vkalloc_t a;
+  init(&a, tlsf, 1000, ((uint64_t)1)<<40);
 
   dt_vkmem_t *test[70] = {0};
 
@@ -22,7 +136,6 @@ int main(int argc, char *arg[])
     err = dt_vkalloc_check(&a);
     assert(!err);
   }
-  // TODO: random order!
   for(int i=0;i<70;i+=2)
   {
     dt_vkfree(&a, test[i]);
@@ -35,7 +148,146 @@ int main(int argc, char *arg[])
     err = dt_vkalloc_check(&a);
     assert(!err);
   }
+  assert(a.rss == 0);
 
   dt_vkalloc_cleanup(&a);
+}
+
+// random order alloc, feedback alloc and free with alignment, check
+// consistency after every step. the heap is small so we run out of memory.
+static void
+test_random(int tlsf, uint32_t seed)
+{
+  dt_vkalloc_t a;
+  const uint64_t heap_size = 1<<22;
+  init(&a, tlsf, 500, heap_size);
+  srand(seed);
+  dt_vkmem_t *mem[200] = {0};
+  for(int it=0;it<2000;it++)
+  {
+    const int i = rand() % 200;
+    if(mem[i])
+    {
+      dt_vkfree(&a, mem[i]);
+      mem[i] = 0;
+    }
+    else
+    {
+      const uint64_t size  = 1 + rand() % 50000;
+      const uint64_t align = 1ul << (rand() % 13);
+      if(!tlsf && a.rss + size + align > heap_size/2) continue; // first fit asserts when out of memory
+      if(rand() % 50 == 0) mem[i] = dt_vkalloc_feedback(&a, size, align);
+      else                 mem[i] = dt_vkalloc(&a, size, align);
+      if(!tlsf) assert(mem[i]);
+      if(mem[i])
+      {
+        assert(!(mem[i]->offset & (align-1)));
+        assert(mem[i]->offset + size <= heap_size);
+      }
+    }
+    int err = dt_vkalloc_check(&a);
+    if(err) fprintf(stderr, "[%s %u] check failed with %d in iteration %d\n", tlsf ? "tlsf" : "first fit", seed, err, it);
+    assert(!err);
+  }
+  for(int i=0;i<200;i++) if(mem[i]) dt_vkfree(&a, mem[i]);
+  assert(a.rss == 0);
+  assert(!dt_vkalloc_check(&a));
+  dt_vkalloc_cleanup(&a);
+}
+
+// fragment a small tlsf heap so a big block doesn't fit any more, then
+// compact until it does.
+static void
+test_compact()
+{
+  dt_vkalloc_t a;
+  const uint64_t block = 10000;
+  int err = dt_vkalloc_init_tlsf(&a, 300, 100*block);
+  assert(!err);
+  dt_vkmem_t *mem[100];
+  for(int i=0;i<100;i++)
+    mem[i] = dt_vkalloc(&a, block-(i&7), 8);
+  for(int i=0;i<100;i++)
+    if(mem[i] && (i & 1))
+    {
+      dt_vkfree(&a, mem[i]);
+      mem[i] = 0;
+    }
+  assert(!dt_vkalloc(&a, 5*block, 8)); // fragmented
+  int moves = 0, cnt = 0;
+  dt_vkmem_t *big = 0, *dst[16], *src[16];
+  while(!(big = dt_vkalloc(&a, 5*block, 8)) && (cnt = dt_vkalloc_compact(&a, 8, src, dst, 16)))
+  {
+    for(int m=0;m<cnt;m++)
+    {
+      assert(dst[m]->offset + dst[m]->size <= src[m]->offset_orig);
+      assert(dst[m]->size == src[m]->size);
+      for(int i=0;i<100;i++) if(mem[i] == src[m]) mem[i] = dst[m];
+    }
+    for(int m=0;m<cnt;m++) dt_vkfree(&a, src[m]);
+    err = dt_vkalloc_check(&a);
+    assert(!err);
+    moves += cnt;
+  }
+  assert(big);
+  fprintf(stderr, "[compact] %d moves to fit a block of %"PRIu64" bytes\n", moves, 5*block);
+  dt_vkalloc_cleanup(&a);
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// many long lived blocks like in the thumbnail cache: replace random blocks
+// with new ones of similar sizes and measure speed and how far vmsize grows
+// beyond the live set because of fragmentation.
+static void
+test_stress(int tlsf)
+{
+  const int live = 3000, ops = 100000;
+  dt_vkalloc_t a;
+  init(&a, tlsf, 3*live, ((uint64_t)1)<<40);
+  dt_vkmem_t **mem = calloc(sizeof(dt_vkmem_t*), live);
+  srand(666);
+  double beg = now();
+  for(int i=0;i<live;i++)
+    mem[i] = dt_vkalloc(&a, 4096*(1 + rand() % 32), 4096);
+  for(int it=0;it<ops;it++)
+  {
+    const int i = rand() % live;
+    dt_vkfree(&a, mem[i]);
+    mem[i] = dt_vkalloc(&a, 4096*(1 + rand() % 32), 4096);
+    assert(mem[i]);
+  }
+  double end = now();
+  assert(!dt_vkalloc_check(&a));
+  fprintf(stderr, "[stress %-9s] %d blocks, %d ops: %7.3f us/op, vmsize %6.1f MB, %5.3fx peak rss\n",
+      tlsf ? "tlsf" : "first fit", live, ops, 1e6*(end-beg)/(live+2*ops),
+      a.vmsize/(1024.0*1024.0), a.vmsize/(double)a.peak_rss);
+  free(mem);
+  dt_vkalloc_cleanup(&a);
+}
+
+int main(int argc, char *arg[])
+{
+  for(int tlsf=0;tlsf<2;tlsf++)
+  {
+    test_basic(tlsf);
+    for(uint32_t seed=1;seed<=3;seed++)
+      test_random(tlsf, seed);
+  }
+
+  test_compact();
+
+  test_plan_hole();
+  for(uint32_t seed=1;seed<=20;seed++)
+    test_plan(seed);
+
+  test_stress(0);
+  test_stress(1);
   exit(0);
 }
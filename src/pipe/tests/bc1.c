@@ -0,0 +1,98 @@
+// micro benchmark for the bc1 encoders in o-bc1:
+// compares throughput (MB/s of rgba input) and psnr of the stb encoder
+// and the fast bounding box encoder, single threaded and on the thread pool.
+#define STB_DXT_IMPLEMENTATION
+#include "../modules/o-bc1/stb_dxt.h"
+#include "../modules/o-bc1/bc1.h"
+#include "core/core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+static void
+decode_block(const uint8_t *blk, uint8_t *rgb, int stride)
+{ // decode one bc1 block (four colour mode only, that's all we write for opaque input)
+  const uint16_t c0 = blk[0] | (blk[1]<<8), c1 = blk[2] | (blk[3]<<8);
+  const uint32_t mask = blk[4] | (blk[5]<<8) | (blk[6]<<16) | ((uint32_t)blk[7]<<24);
+  int p[4][3];
+  bc1_unpack565(c0, p[0]);
+  bc1_unpack565(c1, p[1]);
+  for(int c=0;c<3;c++)
+  {
+    if(c0 > c1)
+    {
+      p[2][c] = (2*p[0][c] + p[1][c])/3;
+      p[3][c] = (p[0][c] + 2*p[1][c])/3;
+    }
+    else
+    {
+      p[2][c] = (p[0][c] + p[1][c])/2;
+      p[3][c] = 0;
+    }
+  }
+  for(int k=0;k<16;k++)
+    for(int c=0;c<3;c++)
+      rgb[(k/4)*stride + 4*(k%4) + c] = p[(mask >> (2*k)) & 3][c];
+}
+
+static double
+psnr(const uint8_t *ref, const uint8_t *bc1, int wd, int ht)
+{
+  uint8_t *dec = malloc(4*(size_t)wd*ht);
+  for(int j=0;j<ht/4;j++) for(int i=0;i<wd/4;i++)
+    decode_block(bc1 + 8*((size_t)j*(wd/4)+i), dec + 4*((size_t)4*j*wd + 4*i), 4*wd);
+  double mse = 0.0;
+  for(size_t k=0;k<(size_t)wd*ht;k++) for(int c=0;c<3;c++)
+  {
+    const double d = ref[4*k+c] - (double)dec[4*k+c];
+    mse += d*d;
+  }
+  free(dec);
+  mse /= 3.0*wd*ht;
+  return 10.0*log10(255.0*255.0/mse);
+}
+
+static void
+bench(const char *name, const uint8_t *in, uint8_t *out, int wd, int ht, int hq, int nt)
+{
+  const int runs = 3;
+  double beg = dt_time();
+  for(int r=0;r<runs;r++) bc1_compress(out, in, wd, ht, hq, nt);
+  double end = dt_time();
+  const double mb = runs * 4.0*wd*ht / (1024.0*1024.0);
+  fprintf(stdout, "%5d x %5d %-14s %2d threads %9.1f MB/s  psnr %5.2f dB\n",
+      wd, ht, name, nt, mb / (end-beg), psnr(in, out, wd, ht));
+}
+
+int main(int argc, char *argv[])
+{
+  setvbuf(stdout, 0, _IOLBF, 0);
+  threads_global_init();
+  const int widths[] = { 4096, 8192, 16384, 24576 };
+  for(int w=0;w<sizeof(widths)/sizeof(widths[0]);w++)
+  {
+    const int wd = widths[w], ht = 1024; // keep memory in check for the wide ones
+    uint8_t *in  = malloc(4*(size_t)wd*ht);
+    uint8_t *out = malloc(8*(size_t)(wd/4)*(ht/4));
+    uint64_t seed = 1337;
+    for(int j=0;j<ht;j++) for(int i=0;i<wd;i++)
+    { // smooth gradients with some noise and hard edges, roughly photographic
+      seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+      const int noise = (seed >> 60) - 8;
+      const int edge  = ((i/97) ^ (j/61)) & 1 ? 40 : 0;
+      uint8_t *px = in + 4*((size_t)j*wd + i);
+      px[0] = CLAMP(255*i/wd + noise + edge, 0, 255);
+      px[1] = CLAMP(255*j/ht + noise, 0, 255);
+      px[2] = CLAMP(128 + 100*sinf(i*0.01f + j*0.02f) + noise - edge, 0, 255);
+      px[3] = 255;
+    }
+    bench("stb",  in, out, wd, ht, 1, 1);
+    bench("fast", in, out, wd, ht, 0, 1);
+    bench("stb",  in, out, wd, ht, 1, threads_num());
+    bench("fast", in, out, wd, ht, 0, threads_num());
+    free(in);
+    free(out);
+  }
+  threads_global_cleanup();
+  exit(0);
+}
@@ -0,0 +1,90 @@
+// micro benchmark for the lossless jpeg decoder used by i-mlv:
+// encodes synthetic 14-bit raw frames with lj92_encode, decodes them
+// repeatedly and reports throughput in megapixels per second. also checks
+// that the decoded frame is bit exact.
+#include "../modules/i-mlv/liblj92/lj92.c"
+#include "core/core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ul;
+static inline uint32_t
+rnd()
+{ // xorshift64*
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return (rnd_state * 2685821657736338717ul) >> 32;
+}
+
+static void
+synth(uint16_t *img, int wd, int ht, int bits, float noise)
+{ // smooth gradients plus gaussian-ish noise, which is what a raw frame looks like to the predictor
+  const int max = (1<<bits)-1;
+  for(int j=0;j<ht;j++) for(int i=0;i<wd;i++)
+  {
+    float v = 0.25f*max*(1.0f + sinf(i*0.01f) * cosf(j*0.013f)) + 0.1f*max*(i&1) + 0.05f*max*(j&1);
+    float n = ((rnd()&0xffff) + (rnd()&0xffff) + (rnd()&0xffff) - 3*32768.0f)/32768.0f;
+    img[j*wd+i] = CLAMP((int)(v + noise*n), 0, max);
+  }
+}
+
+static int
+bench(int wd, int ht, float noise)
+{
+  const int bits = 14;
+  uint16_t *img = malloc(sizeof(uint16_t)*wd*ht);
+  uint16_t *out = malloc(sizeof(uint16_t)*wd*ht);
+  synth(img, wd, ht, bits, noise);
+  uint8_t *enc = 0;
+  int enc_len = 0;
+  // mlv writes the bayer frame as two interleaved rows per jpeg row:
+  if(lj92_encode(img, 2*wd, ht/2, bits, 2*wd, 0, 0, 0, &enc, &enc_len) != LJ92_ERROR_NONE)
+  {
+    fprintf(stderr, "encoding failed!\n");
+    return 1;
+  }
+  int runs = 0, err = 0;
+  double beg = now(), end = beg;
+  while(end - beg < 1.0 || runs < 3)
+  {
+    lj92 lj;
+    int w, h, b, c;
+    err |= lj92_open(&lj, enc, enc_len, &w, &h, &b, &c);
+    if(err) break;
+    err |= lj92_decode(lj, out, w*h*c, 0, 0, 0);
+    lj92_close(lj);
+    runs++;
+    end = now();
+  }
+  int diff = err ? -1 : memcmp(img, out, sizeof(uint16_t)*wd*ht);
+  fprintf(stdout, "%5dx%-5d noise %6.1f: %5.2f bits/px, %7.1f Mpix/s %s\n",
+      wd, ht, noise, 8.0*enc_len/(wd*(double)ht),
+      runs*wd*(double)ht/(end-beg)*1e-6, diff ? "MISMATCH" : "ok");
+  free(enc);
+  free(img);
+  free(out);
+  return diff != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  setvbuf(stdout, 0, _IOLBF, 0);
+  int err = 0;
+  // 4k and uhd-ish mlv frame sizes, low and high noise (short and long codes)
+  err |= bench(4096, 2160,    4.0f);
+  err |= bench(4096, 2160,   40.0f);
+  err |= bench(4096, 2160,  400.0f);
+  err |= bench(1920, 1080, 4000.0f);
+  return err;
+}
@@ -0,0 +1,89 @@
+#include "../nodecache.h"
+#include "core/hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// fill the cache beyond its size and make sure the least recently used
+// entries go first, and what we read back is what we wrote.
+static void
+test_lru()
+{
+  const uint64_t size = 1000;
+  uint8_t buf[1000], out[1000];
+  dt_nodecache_t c;
+  dt_nodecache_init(&c, 4*size);
+  for(uint64_t h=1;h<=4;h++)
+  {
+    memset(buf, h, size);
+    assert(!dt_nodecache_write(&c, h, buf, size));
+  }
+  assert(c.bytes == 4*size);
+  assert(!dt_nodecache_read(&c, 1, out, size)); // touch 1, so 2 is the oldest now
+  assert(out[0] == 1 && out[size-1] == 1);
+  memset(buf, 5, size);
+  assert(!dt_nodecache_write(&c, 5, buf, size));
+  assert(c.bytes == 4*size);
+  assert( dt_nodecache_has(&c, 1, size));
+  assert(!dt_nodecache_has(&c, 2, size));
+  assert( dt_nodecache_has(&c, 3, size));
+  assert(!dt_nodecache_has(&c, 5, size-1)); // size is part of the key
+  assert(dt_nodecache_read(&c, 2, out, size));
+  assert(dt_nodecache_write(&c, 6, buf, 5*size)); // too large
+  assert(!dt_nodecache_write(&c, 5, buf, size));  // dedup
+  assert(c.cnt == 4);
+  dt_nodecache_cleanup(&c);
+}
+
+// many small entries run into the entry limit
+static void
+test_count()
+{
+  dt_nodecache_t c;
+  dt_nodecache_init(&c, 1<<20);
+  uint64_t hash = dt_hash_init;
+  for(int i=0;i<3*DT_NODECACHE_MAX_ENTRIES;i++)
+  {
+    hash = dt_hash(hash, &i, sizeof(i));
+    assert(!dt_nodecache_write(&c, hash, &i, sizeof(i)));
+    int j = -1;
+    assert(!dt_nodecache_read(&c, hash, &j, sizeof(j)));
+    assert(j == i);
+  }
+  assert(c.cnt == DT_NODECACHE_MAX_ENTRIES);
+  assert(c.bytes == DT_NODECACHE_MAX_ENTRIES*sizeof(int));
+  dt_nodecache_cleanup(&c);
+}
+
+// a reference keeps the data alive when the entry is evicted
+static void
+test_ref()
+{
+  const uint64_t size = 1000;
+  uint8_t buf[1000];
+  dt_nodecache_t c;
+  dt_nodecache_init(&c, 2*size);
+  memset(buf, 1, size);
+  assert(!dt_nodecache_write(&c, 1, buf, size));
+  assert(!dt_nodecache_get(&c, 1, size-1));
+  const uint8_t *data = dt_nodecache_get(&c, 1, size);
+  assert(data && data[0] == 1 && data[size-1] == 1);
+  for(uint64_t h=2;h<=3;h++)
+  {
+    memset(buf, h, size);
+    assert(!dt_nodecache_write(&c, h, buf, size));
+  }
+  assert(!dt_nodecache_has(&c, 1, size)); // evicted
+  assert(data[0] == 1 && data[size-1] == 1);
+  dt_nodecache_release(&c, data);
+  dt_nodecache_cleanup(&c);
+}
+
+int main(int argc, char *arg[])
+{
+  test_lru();
+  test_count();
+  test_ref();
+  exit(0);
+}
@@ -39,9 +39,9 @@ MKCLUT_DEPS=core/inpaint.h \
 macadam.lut: macadam
 	./macadam
 
-macadam: tools/spec/macadam.c core/threads.c Makefile
+macadam: tools/spec/macadam.c core/threads.c core/trace.c Makefile
 	@echo "[tools] precomputing max theoretical reflectance brightness.."
-	$(CC) $(CFLAGS) $(OPT_CFLAGS) $(EXE_CFLAGS) $(ADD_CFLAGS) $< core/threads.c -o $@ $(LDFLAGS) $(ADD_LDFLAGS) -pthread
+	$(CC) $(CFLAGS) $(OPT_CFLAGS) $(EXE_CFLAGS) $(ADD_CFLAGS) $< core/threads.c core/trace.c -o $@ $(LDFLAGS) $(ADD_LDFLAGS) -pthread
 
-mkabney: tools/spec/createlut.c core/threads.c Makefile
-	$(CC) $(CFLAGS) $(OPT_CFLAGS) $(EXE_CFLAGS) $(ADD_CFLAGS) $< core/threads.c -o $@ $(LDFLAGS) $(ADD_LDFLAGS) -pthread
+mkabney: tools/spec/createlut.c core/threads.c core/trace.c Makefile
+	$(CC) $(CFLAGS) $(OPT_CFLAGS) $(EXE_CFLAGS) $(ADD_CFLAGS) $< core/threads.c core/trace.c -o $@ $(LDFLAGS) $(ADD_LDFLAGS) -pthread